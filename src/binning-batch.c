@@ -0,0 +1,506 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// binning-batch, bins archives of raw frames offline with libbinning.
+//
+// Each input file is a sequence of raw 24-bit BGR (or RGB) frames of the given size, e.g. from
+// 'gst-launch-1.0 ... ! filesink'. The file is memory-mapped and the frames of a batch are binned in parallel
+// on a pool of threads, one per core, while the previous batch is written out in order. So the
+// binning keeps up with the disk and the write is one sequential stream, or O_DIRECT with --direct so that
+// terabytes of output do not go through the page cache.
+//
+//   binning-batch --width 1920 --height 1080 --binsize 2 --resize --crop -o binned/ capture*.raw
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#define _GNU_SOURCE   // O_DIRECT
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "binning.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 0   // not available, --direct is refused
+#endif
+
+#define DIRECT_ALIGN 4096   // O_DIRECT buffers, offsets and lengths are multiples of this
+#define FRAMES_PER_THREAD 4   // frames in a batch for each thread
+
+// The frame layout, the same for every input file
+typedef struct
+{
+	BinningParams *params;
+	gint width, height, stride;
+	gsize in_frame_size;   // stride * height
+	gboolean crop;   // write only the binned image, packed, rather than the whole frame
+	gint out_width, out_height;
+	gsize out_frame_size;
+	gboolean huge_pages;   // the frame scratch and output buffers in huge pages
+} BatchFormat;
+
+// Frames being binned on the pool, the main thread waits on 'done' until 'remaining' is 0
+typedef struct
+{
+	const BatchFormat *format;
+	const guint8 *in;   // first input frame
+	guint8 *out;   // where the first binned frame goes
+	guint8 *buffer;   // output buffer of this batch, aligned for O_DIRECT
+	guint frames;
+	guint remaining;
+	GMutex lock;
+	GCond done;
+} Batch;
+
+typedef struct
+{
+	Batch *batch;
+	guint index;
+} BatchJob;
+
+typedef struct
+{
+	gsize size;
+	guint8 *data;
+} FrameScratch;
+
+static void
+frame_scratch_free (gpointer data)
+{
+	FrameScratch *scratch = data;
+
+	binning_memory_free (scratch->data);
+	g_free (scratch);
+}
+
+// A whole frame to bin into before cropping, one per thread
+static GPrivate frame_scratch = G_PRIVATE_INIT (frame_scratch_free);
+
+static guint8 *
+get_frame_scratch (gsize size, gboolean huge_pages)
+{
+	FrameScratch *scratch = g_private_get (&frame_scratch);
+
+	if (scratch == NULL){
+		scratch = g_new0 (FrameScratch, 1);
+		g_private_set (&frame_scratch, scratch);
+	}
+	if (scratch->size < size){
+		binning_memory_free (scratch->data);
+		scratch->data = binning_memory_alloc (size, huge_pages);
+		scratch->size = size;
+	}
+
+	return scratch->data;
+}
+
+// Bin one frame of a batch, runs on the pool
+static void
+bin_frame (gpointer data, gpointer user_data)
+{
+	BatchJob *job = data;
+	Batch *batch = job->batch;
+	const BatchFormat *format = batch->format;
+	const guint8 *in = batch->in + job->index * format->in_frame_size;
+	guint8 *out = batch->out + job->index * format->out_frame_size;
+	guint8 *frame;
+	gint y;
+
+	if (format->crop){
+		frame = get_frame_scratch (format->in_frame_size, format->huge_pages);
+		binning_process (format->params, in, frame, format->width, format->height, format->stride, NULL);
+		for (y = 0; y < format->out_height; y++)
+			memcpy (out + (gsize)y * format->out_width * 3, frame + (gsize)y * format->stride, format->out_width * 3);
+	}
+	else{   // the whole frame is written, so copy whole strides, binning_process() would leave the padding unwritten
+		memcpy (out, in, format->in_frame_size);
+		binning_process (format->params, out, out, format->width, format->height, format->stride, NULL);
+	}
+
+	g_mutex_lock (&batch->lock);
+	if (--batch->remaining == 0)
+		g_cond_signal (&batch->done);
+	g_mutex_unlock (&batch->lock);
+}
+
+static void
+batch_start (GThreadPool *pool, Batch *batch, BatchJob *jobs, const guint8 *in, guint8 *out, guint frames)
+{
+	guint i;
+
+	batch->in = in;
+	batch->out = out;
+	batch->frames = frames;
+	batch->remaining = frames;
+
+	for (i = 0; i < frames; i++){
+		jobs[i].batch = batch;
+		jobs[i].index = i;
+		g_thread_pool_push (pool, &jobs[i], NULL);
+	}
+}
+
+static void
+batch_wait (Batch *batch)
+{
+	g_mutex_lock (&batch->lock);
+	while (batch->remaining > 0)
+		g_cond_wait (&batch->done, &batch->lock);
+	g_mutex_unlock (&batch->lock);
+}
+
+static gboolean
+write_all (gint fd, const guint8 *data, gsize length, const gchar *path)
+{
+	gssize written;
+
+	while (length > 0){
+		written = write (fd, data, length);
+		if (written < 0){
+			if (errno == EINTR)
+				continue;
+			g_printerr ("Could not write %s: %s\n", path, g_strerror (errno));
+			return FALSE;
+		}
+		data += written;
+		length -= written;
+	}
+
+	return TRUE;
+}
+
+// Bin every frame of in_path into out_path, adds the frames and bytes done to the totals
+static gboolean
+process_file (const gchar *in_path, const gchar *out_path, const BatchFormat *format, GThreadPool *pool, guint batch_frames,
+		gboolean direct, guint64 *total_frames, guint64 *total_in, guint64 *total_out)
+{
+	GError *error = NULL;
+	GMappedFile *mapped;
+	const guint8 *data;
+	gsize length, buffer_size;
+	guint frames, first = 0, n, b;
+	Batch batches[2];
+	BatchJob *jobs[2];
+	gsize prev_length = 0, write_length, carry = 0;
+	gboolean have_prev = FALSE, ok = TRUE;
+	gint fd, i;
+
+	mapped = g_mapped_file_new (in_path, FALSE, &error);
+	if (mapped == NULL){
+		g_printerr ("Could not map %s: %s\n", in_path, error->message);
+		g_error_free (error);
+		return FALSE;
+	}
+
+	data = (const guint8 *) g_mapped_file_get_contents (mapped);
+	length = g_mapped_file_get_length (mapped);
+	frames = length / format->in_frame_size;
+	if (length % format->in_frame_size)
+		g_printerr ("%s: %" G_GSIZE_FORMAT " bytes after the last whole frame are left out\n", in_path, length % format->in_frame_size);
+	if (length > 0)
+		posix_madvise ((void *) data, length, POSIX_MADV_SEQUENTIAL);   // read ahead, each frame is read once
+
+	fd = g_open (out_path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	if (fd < 0 && direct && errno == EINVAL){   // the file system does not do O_DIRECT
+		g_printerr ("%s: O_DIRECT is not supported, writing through the page cache\n", out_path);
+		direct = FALSE;
+		fd = g_open (out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd < 0){
+		g_printerr ("Could not open %s: %s\n", out_path, g_strerror (errno));
+		g_mapped_file_unref (mapped);
+		return FALSE;
+	}
+
+	// two batches, one binned while the other is written, each with room for the bytes carried over
+	// from the last batch when O_DIRECT only writes whole blocks
+	buffer_size = batch_frames * format->out_frame_size + DIRECT_ALIGN;
+	for (i = 0; i < 2; i++){
+		batches[i].format = format;
+		batches[i].buffer = binning_memory_alloc (buffer_size, format->huge_pages);   // page aligned
+		g_mutex_init (&batches[i].lock);
+		g_cond_init (&batches[i].done);
+		jobs[i] = g_new (BatchJob, batch_frames);
+	}
+
+	for (b = 0; ; b++){
+		Batch *cur = &batches[b % 2], *prev = &batches[(b + 1) % 2];
+
+		n = MIN (batch_frames, frames - first);
+		write_length = 0;
+
+		if (have_prev){
+			batch_wait (prev);
+			write_length = direct ? prev_length & ~(gsize)(DIRECT_ALIGN - 1) : prev_length;
+			carry = prev_length - write_length;
+			memcpy (cur->buffer, prev->buffer + write_length, carry);
+		}
+
+		if (n > 0)
+			batch_start (pool, cur, jobs[b % 2], data + (gsize)first * format->in_frame_size, cur->buffer + carry, n);
+
+		if (have_prev && !write_all (fd, prev->buffer, write_length, out_path)){
+			if (n > 0)
+				batch_wait (cur);
+			ok = FALSE;
+			break;
+		}
+
+		if (n == 0)
+			break;
+
+		prev_length = carry + n * format->out_frame_size;
+		have_prev = TRUE;
+		first += n;
+	}
+
+	// O_DIRECT only writes whole blocks, so the end of the file is written without it
+	if (ok && carry > 0){
+		if (direct)
+			fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_DIRECT);
+		ok = write_all (fd, batches[b % 2].buffer, carry, out_path);
+	}
+
+	if (close (fd) != 0 && ok){
+		g_printerr ("Could not write %s: %s\n", out_path, g_strerror (errno));
+		ok = FALSE;
+	}
+
+	for (i = 0; i < 2; i++){
+		binning_memory_free (batches[i].buffer);
+		g_mutex_clear (&batches[i].lock);
+		g_cond_clear (&batches[i].done);
+		g_free (jobs[i]);
+	}
+	g_mapped_file_unref (mapped);
+
+	*total_frames += first;
+	*total_in += (guint64) first * format->in_frame_size;
+	*total_out += (guint64) first * format->out_frame_size;
+
+	return ok;
+}
+
+static gboolean
+parse_algorithm (const gchar *name, BinningAlgorithm *algorithm)
+{
+	if (g_strcmp0 (name, "rgb") == 0)
+		*algorithm = BINNING_RGB;
+	else if (g_strcmp0 (name, "chroma") == 0)
+		*algorithm = BINNING_CHROMA;
+	else if (g_strcmp0 (name, "median") == 0)
+		*algorithm = BINNING_MEDIAN;
+	else if (g_strcmp0 (name, "sigma-clip") == 0)
+		*algorithm = BINNING_SIGMA_CLIP;
+	else
+		return FALSE;
+	return TRUE;
+}
+
+static gboolean
+parse_border (const gchar *name, BinningBorder *border)
+{
+	if (g_strcmp0 (name, "none") == 0)
+		*border = BINNING_BORDER_NONE;
+	else if (g_strcmp0 (name, "clamp") == 0)
+		*border = BINNING_BORDER_CLAMP;
+	else if (g_strcmp0 (name, "mirror") == 0)
+		*border = BINNING_BORDER_MIRROR;
+	else if (g_strcmp0 (name, "partial") == 0)
+		*border = BINNING_BORDER_PARTIAL;
+	else
+		return FALSE;
+	return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+	BinningSettings settings;
+	BatchFormat format;
+	GOptionContext *context;
+	GError *error = NULL;
+	GThreadPool *pool;
+	gint width = 0, height = 0, stride = 0, threads = 0;
+	gchar *algorithm = NULL, *pixel_format = NULL, *output = NULL, *border = NULL;
+	gboolean crop = FALSE, direct = FALSE, huge_pages = FALSE, ok = TRUE;
+	gchar **inputs = NULL;
+	guint64 total_frames = 0, total_in = 0, total_out = 0;
+	gint64 start, elapsed;
+	gdouble seconds;
+	gint i, n_inputs;
+
+	binning_settings_init (&settings);
+
+	GOptionEntry entries[] = {
+		{ "width", 0, 0, G_OPTION_ARG_INT, &width, "Frame width in pixels", "PIXELS" },
+		{ "height", 0, 0, G_OPTION_ARG_INT, &height, "Frame height in pixels", "PIXELS" },
+		{ "stride", 0, 0, G_OPTION_ARG_INT, &stride, "Bytes from one line to the next, default width*3", "BYTES" },
+		{ "format", 'f', 0, G_OPTION_ARG_STRING, &pixel_format, "Byte order, bgr (default) or rgb", "FORMAT" },
+		{ "algorithm", 'a', 0, G_OPTION_ARG_STRING, &algorithm, "rgb (default), chroma, median or sigma-clip", "ALGORITHM" },
+		{ "binsize", 'b', 0, G_OPTION_ARG_INT, &settings.binsize, "Bin binsize x binsize pixels, 1 to 7", "N" },
+		{ "resize", 'r', 0, G_OPTION_ARG_NONE, &settings.resize, "Reduce the image by the binsize", NULL },
+		{ "bin-stride", 0, 0, G_OPTION_ARG_INT, &settings.bin_stride, "Pixels between bins, 0 to use the binsize (resize) or 1", "N" },
+		{ "rblack", 0, 0, G_OPTION_ARG_INT, &settings.black_r, "Red black level", "LEVEL" },
+		{ "gblack", 0, 0, G_OPTION_ARG_INT, &settings.black_g, "Green black level", "LEVEL" },
+		{ "bblack", 0, 0, G_OPTION_ARG_INT, &settings.black_b, "Blue black level", "LEVEL" },
+		{ "rcontrast", 0, 0, G_OPTION_ARG_INT, &settings.contrast_r, "Red gain*100, -1 to average", "CONTRAST" },
+		{ "gcontrast", 0, 0, G_OPTION_ARG_INT, &settings.contrast_g, "Green gain*100, -1 to average", "CONTRAST" },
+		{ "bcontrast", 0, 0, G_OPTION_ARG_INT, &settings.contrast_b, "Blue gain*100, -1 to average", "CONTRAST" },
+		{ "clip-sigma", 0, 0, G_OPTION_ARG_DOUBLE, &settings.clip_sigma, "Clipping limit for sigma-clip", "SIGMA" },
+		{ "border", 0, 0, G_OPTION_ARG_STRING, &border, "Bins past the edge, none (default), clamp, mirror or partial", "MODE" },
+		{ "chroma-weight", 0, 0, G_OPTION_ARG_DOUBLE, &settings.chroma_weight, "Scale of the mean colour difference for chroma", "WEIGHT" },
+		{ "crop", 'c', 0, G_OPTION_ARG_NONE, &crop, "Write only the binned image rather than whole frames", NULL },
+		{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Output file, or directory for several inputs", "PATH" },
+		{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Binning threads, default one per core", "N" },
+		{ "direct", 'd', 0, G_OPTION_ARG_NONE, &direct, "Write with O_DIRECT, bypassing the page cache", NULL },
+		{ "huge-pages", 0, 0, G_OPTION_ARG_NONE, &huge_pages, "Frame scratch and output buffers in huge pages, compare with perf stat -e dTLB-load-misses", NULL },
+		{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &inputs, NULL, "INPUT..." },
+		{ NULL }
+	};
+
+	context = g_option_context_new ("- bin raw frame files");
+	g_option_context_add_main_entries (context, entries, NULL);
+	if (!g_option_context_parse (context, &argc, &argv, &error)){
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		return 1;
+	}
+	g_option_context_free (context);
+
+	n_inputs = inputs ? g_strv_length (inputs) : 0;
+	if (n_inputs == 0 || output == NULL || width <= 0 || height <= 0){
+		g_printerr ("Give the frame --width and --height, the --output and at least one input file, see --help\n");
+		return 1;
+	}
+	if (algorithm && !parse_algorithm (algorithm, &settings.algorithm)){
+		g_printerr ("Unknown algorithm %s\n", algorithm);
+		return 1;
+	}
+	if (border && !parse_border (border, &settings.border)){
+		g_printerr ("Unknown border %s\n", border);
+		return 1;
+	}
+	if (pixel_format && g_strcmp0 (pixel_format, "rgb") != 0 && g_strcmp0 (pixel_format, "bgr") != 0){
+		g_printerr ("Unknown format %s\n", pixel_format);
+		return 1;
+	}
+	settings.format = g_strcmp0 (pixel_format, "rgb") == 0 ? BINNING_FORMAT_RGB : BINNING_FORMAT_BGR;
+	if (settings.binsize < 1 || settings.binsize > 7){
+		g_printerr ("The binsize must be 1 to 7\n");
+		return 1;
+	}
+	if (stride == 0)
+		stride = width * 3;
+	if (stride < width * 3){
+		g_printerr ("The stride must be at least width*3\n");
+		return 1;
+	}
+	if (direct && O_DIRECT == 0){
+		g_printerr ("O_DIRECT is not available here\n");
+		return 1;
+	}
+	if (threads <= 0)
+		threads = g_get_num_processors ();
+
+	format.params = binning_params_new (&settings);
+	format.width = width;
+	format.height = height;
+	format.stride = stride;
+	format.in_frame_size = (gsize) stride * height;
+	format.crop = crop;
+	format.huge_pages = huge_pages;
+	if (crop){
+		binning_output_size (format.params, width, height, &format.out_width, &format.out_height);
+		format.out_frame_size = (gsize) format.out_width * format.out_height * 3;
+	}
+	else{
+		format.out_width = width;
+		format.out_height = height;
+		format.out_frame_size = format.in_frame_size;
+	}
+
+	pool = g_thread_pool_new (bin_frame, NULL, threads, TRUE, NULL);
+
+	start = g_get_monotonic_time ();
+
+	for (i = 0; i < n_inputs && ok; i++){
+		gchar *out_path, *base;
+
+		if (n_inputs > 1 || g_file_test (output, G_FILE_TEST_IS_DIR)){   // same name in the output directory
+			base = g_path_get_basename (inputs[i]);
+			out_path = g_build_filename (output, base, NULL);
+			g_free (base);
+		}
+		else
+			out_path = g_strdup (output);
+
+		ok = process_file (inputs[i], out_path, &format, pool, threads * FRAMES_PER_THREAD, direct, &total_frames, &total_in, &total_out);
+		g_free (out_path);
+	}
+
+	elapsed = g_get_monotonic_time () - start;
+	seconds = MAX (elapsed, 1) / 1e6;
+
+	g_print ("%" G_GUINT64_FORMAT " frames (%dx%d -> %dx%d), %.1f MB in, %.1f MB out in %.2f s: %.1f frames/s, %.1f MB/s in, %.1f MB/s out, %d threads\n",
+			total_frames, width, height, format.out_width, format.out_height, total_in / 1e6, total_out / 1e6, seconds,
+			total_frames / seconds, total_in / 1e6 / seconds, total_out / 1e6 / seconds, threads);
+
+	g_thread_pool_free (pool, FALSE, TRUE);
+	binning_params_unref (format.params);
+	g_strfreev (inputs);
+	g_free (algorithm);
+	g_free (border);
+	g_free (pixel_format);
+	g_free (output);
+
+	return ok ? 0 : 1;
+}
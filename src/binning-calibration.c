@@ -0,0 +1,341 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_calibration_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_calibration_debug
+
+// Per pixel calibration, a dark frame that is subtracted and a flat field that is divided out, both in linear space.
+// Each is a raw frame of the same size and byte order as the video (e.g. saved with filesink from the camera),
+// memory-mapped at READY and used in-place, so the files are never copied.
+// The correction is made as each sample is linearised by the stride engine, see load_row_calibrated()
+//
+// The defect map lists defective (hot or dead) pixels, these are left out of the bins by the stride engine,
+// see remove_defects(), and the bins that lose pixels are scaled up to make up for them.
+
+static GMappedFile *
+map_calibration_file(Gstbinningfilter *filter, const gchar *location)
+{
+	GMappedFile *file;
+	GError *err = NULL;
+
+	if (location == NULL || location[0] == '\0')
+		return NULL;
+
+	file = g_mapped_file_new(location, FALSE, &err);
+	if (file == NULL){
+		GST_ELEMENT_ERROR (filter, RESOURCE, OPEN_READ, ("Could not open calibration file \"%s\".", location),
+				("%s", err->message));
+		g_error_free(err);
+		return NULL;
+	}
+
+	GST_DEBUG_OBJECT (filter, "Mapped calibration file %s, %" G_GSIZE_FORMAT " bytes", location, g_mapped_file_get_length(file));
+
+	return file;
+}
+
+static gint
+compare_defects(gconstpointer a, gconstpointer b)
+{
+	guint64 ka = *(const guint64 *)a, kb = *(const guint64 *)b;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+// Read the defect map, a text file with the x and y of one defective pixel on each line ('#' starts a comment),
+// into a sorted list of (y << 32 | x) keys, so that the defects of each row are together and in order.
+static gboolean
+read_defect_map(Gstbinningfilter *filter, const gchar *location, guint64 **list, guint *length)
+{
+	GMappedFile *file;
+	GArray *keys;
+	const gchar *p, *end;
+	guint64 value[2], key;
+	gint n = 0, line = 1;
+	guint i, j;
+
+	*list = NULL;
+	*length = 0;
+
+	file = map_calibration_file(filter, location);
+	if (file == NULL)
+		return FALSE;
+
+	keys = g_array_new(FALSE, FALSE, sizeof(guint64));
+	p = g_mapped_file_get_contents(file);
+	end = p + g_mapped_file_get_length(file);
+
+	while (p < end){
+		if (*p == '#'){
+			while (p < end && *p != '\n')
+				p++;
+		}
+		else if (g_ascii_isdigit(*p)){
+			value[n] = 0;
+			while (p < end && g_ascii_isdigit(*p))
+				value[n] = value[n] * 10 + (*p++ - '0');
+			if (++n == 2){
+				key = (value[1] << 32) | (value[0] & 0xffffffff);
+				g_array_append_val(keys, key);
+				n = 0;
+			}
+		}
+		else{
+			if (*p == '\n'){
+				if (n != 0)
+					GST_WARNING_OBJECT (filter, "Defect map %s line %d does not have an x and a y, ignored", location, line);
+				n = 0;
+				line++;
+			}
+			p++;
+		}
+	}
+
+	g_mapped_file_unref(file);
+
+	g_array_sort(keys, compare_defects);
+	for (i = j = 0; i < keys->len; i++)   // a pixel listed twice is only left out once
+		if (j == 0 || g_array_index(keys, guint64, i) != g_array_index(keys, guint64, j-1))
+			g_array_index(keys, guint64, j++) = g_array_index(keys, guint64, i);
+
+	*length = j;
+	*list = (guint64 *)g_array_free(keys, FALSE);
+
+	GST_DEBUG_OBJECT (filter, "Read %u defects from %s", *length, location);
+
+	return TRUE;
+}
+
+// Index the defects that are inside a frame of the given size, NULL if there are none
+static BinningDefects *
+make_defects(const guint64 *list, guint length, gint width, gint height)
+{
+	BinningDefects *defects;
+	guint i;
+	gint y;
+
+	if (length == 0)
+		return NULL;
+
+	defects = g_new0(BinningDefects, 1);
+	defects->refcount = 1;
+	defects->height = height;
+	defects->row_start = g_new0(guint, height+1);
+	defects->x = g_new(guint32, length);
+
+	for (i = 0; i < length; i++){   // sorted by y then x, so x[] comes out in row order
+		guint64 dy = list[i] >> 32, dx = list[i] & 0xffffffff;
+		if (dy < (guint64)height && dx < (guint64)width){
+			defects->x[defects->count++] = dx;
+			defects->row_start[dy+1]++;
+		}
+	}
+
+	for (y = 0; y < height; y++)
+		defects->row_start[y+1] += defects->row_start[y];
+
+	if (defects->count == 0){
+		binning_defects_unref(defects);
+		return NULL;
+	}
+
+	return defects;
+}
+
+// Map the dark-frame and flat-field files and read the defect map, called going to READY
+gboolean
+gst_binningfilter_calibration_open(Gstbinningfilter *filter)
+{
+	gchar *dark_location, *flat_location, *defect_location;
+	GMappedFile *dark = NULL, *flat = NULL;
+	guint64 *defect_list = NULL;
+	guint defect_list_length = 0;
+	gboolean ret = TRUE;
+
+	GST_OBJECT_LOCK (filter);
+	dark_location = g_strdup(filter->dark_frame_location);
+	flat_location = g_strdup(filter->flat_field_location);
+	defect_location = g_strdup(filter->defect_map_location);
+	GST_OBJECT_UNLOCK (filter);
+
+	if (dark_location && dark_location[0] != '\0')
+		ret = (dark = map_calibration_file(filter, dark_location)) != NULL;
+	if (ret && flat_location && flat_location[0] != '\0')
+		ret = (flat = map_calibration_file(filter, flat_location)) != NULL;
+	if (ret && defect_location && defect_location[0] != '\0')
+		ret = read_defect_map(filter, defect_location, &defect_list, &defect_list_length);
+
+	g_free(dark_location);
+	g_free(flat_location);
+	g_free(defect_location);
+
+	if (!ret){
+		if (dark)
+			g_mapped_file_unref(dark);
+		if (flat)
+			g_mapped_file_unref(flat);
+		return FALSE;
+	}
+
+	GST_OBJECT_LOCK (filter);
+	filter->dark_file = dark;
+	filter->flat_file = flat;
+	filter->dark_valid = filter->flat_valid = FALSE;   // until checked against the caps
+	filter->defect_list = defect_list;
+	filter->defect_list_length = defect_list_length;
+	gst_binningfilter_publish_params(filter);
+	GST_OBJECT_UNLOCK (filter);
+
+	return TRUE;
+}
+
+// Unmap the files, called going to NULL. Params still in use keep their own reference.
+void
+gst_binningfilter_calibration_close(Gstbinningfilter *filter)
+{
+	GST_OBJECT_LOCK (filter);
+	if (filter->dark_file)
+		g_mapped_file_unref(filter->dark_file);
+	if (filter->flat_file)
+		g_mapped_file_unref(filter->flat_file);
+	filter->dark_file = filter->flat_file = NULL;
+	filter->dark_valid = filter->flat_valid = FALSE;
+	g_free(filter->defect_list);
+	filter->defect_list = NULL;
+	filter->defect_list_length = 0;
+	if (filter->defects)
+		binning_defects_unref(filter->defects);
+	filter->defects = NULL;
+	gst_binningfilter_publish_params(filter);
+	GST_OBJECT_UNLOCK (filter);
+}
+
+// Check the mapped files against the frame size of new caps and make the flat field gains,
+// gain = mean / value in linear space, so a flat of uniform illumination becomes uniform.
+// The defects are indexed for the new frame size.
+// Called from the caps event, the params are published there afterwards.
+void
+gst_binningfilter_calibration_set_caps(Gstbinningfilter *filter)
+{
+	gsize frame_size = (gsize)filter->stride * filter->height;
+	gboolean dark_valid = FALSE, flat_valid = FALSE;
+	gfloat flat_gain[3][IN_RANGE];
+	BinningDefects *defects, *old_defects;
+	gint c, i;
+
+	if (filter->dark_file){
+		dark_valid = g_mapped_file_get_length(filter->dark_file) == frame_size;
+		if (!dark_valid)
+			GST_ELEMENT_WARNING (filter, STREAM, FORMAT, ("Dark frame is not the size of the video frames, it will not be used."),
+					("%" G_GSIZE_FORMAT " bytes, expected %" G_GSIZE_FORMAT " for %dx%d", g_mapped_file_get_length(filter->dark_file),
+							frame_size, filter->width, filter->height));
+	}
+
+	if (filter->flat_file){
+		flat_valid = g_mapped_file_get_length(filter->flat_file) == frame_size;
+		if (!flat_valid)
+			GST_ELEMENT_WARNING (filter, STREAM, FORMAT, ("Flat field is not the size of the video frames, it will not be used."),
+					("%" G_GSIZE_FORMAT " bytes, expected %" G_GSIZE_FORMAT " for %dx%d", g_mapped_file_get_length(filter->flat_file),
+							frame_size, filter->width, filter->height));
+	}
+
+	if (flat_valid){
+		const guint8 *flat = (const guint8 *)g_mapped_file_get_contents(filter->flat_file);
+		guint64 histogram[3][IN_RANGE];
+		gdouble mean[3] = {0, 0, 0};
+		gsize p, pixels = (gsize)filter->width * filter->height;
+
+		// mean of each channel in linear space, from the histograms of the flat values
+		memset(histogram, 0, sizeof(histogram));
+		for(p=0; p<pixels; p++)
+			for(c=0; c<3; c++)
+				histogram[c][flat[p*3+c]]++;
+
+		for(c=0; c<3; c++){
+			for(i=0; i<IN_RANGE; i++)
+				mean[c] += histogram[c][i] * filter->forward_gamma[i];
+			mean[c] /= MAX(pixels, 1);
+
+			for(i=0; i<IN_RANGE; i++)   // forward_gamma[0] is above 0 because of the gamma offset
+				flat_gain[c][i] = mean[c] / filter->forward_gamma[i];
+		}
+
+		GST_DEBUG_OBJECT (filter, "Flat field linear means (buffer order) %.1f %.1f %.1f", mean[0], mean[1], mean[2]);
+	}
+
+	defects = make_defects(filter->defect_list, filter->defect_list_length, filter->width, filter->height);
+	if (filter->defect_list_length)
+		GST_DEBUG_OBJECT (filter, "%u of %u defects are inside the %dx%d frame", defects ? defects->count : 0,
+				filter->defect_list_length, filter->width, filter->height);
+
+	GST_OBJECT_LOCK (filter);
+	filter->dark_valid = dark_valid;
+	filter->flat_valid = flat_valid;
+	if (flat_valid)
+		memcpy(filter->flat_gain, flat_gain, sizeof(flat_gain));
+	old_defects = filter->defects;
+	filter->defects = defects;
+	GST_OBJECT_UNLOCK (filter);
+
+	if (old_defects)
+		binning_defects_unref(old_defects);
+}
+
+void
+gst_binningfilter_calibration_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_calibration_debug, "binningfilter",
+			1, "binningfilter calibration");
+}
@@ -0,0 +1,207 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <string.h>
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_compare_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_compare_debug
+
+// Compare mode, to measure one kernel against another on the real video.
+// compare-a bins the frame in place, as it would normally, and compare-b bins a copy of the frame in the scratch buffer.
+// Each kernel is timed on its own, the kernels take turns to go first so that neither always finds the frame in the cache.
+// The two binned images are compared over the region both produce, and the figures are posted for every frame:
+//
+// binningfilter-compare, timestamp=(guint64), a=(string), b=(string), frames=(guint64),
+//     a-time=(double), b-time=(double), a-mean-time=(double), b-mean-time=(double),
+//     psnr=(double), mean-psnr=(double), max-abs-diff=(uint), max-abs-diff-total=(uint)
+//
+// Times are in ms, for the frame and averaged over 'frames'. psnr is of b against a in dB, inf when they are the same,
+// mean-psnr from the squared error summed over all the frames. The totals start again whenever the compared setup changes.
+
+// The totals are for these params. Any change of the properties makes new params, and any setting of them
+// (border, clip-sigma, chroma-weight, the levels, the calibration) can change the results, so the totals start again.
+static gboolean
+same_setup (const BinningCompareTotals *totals, const BinningParams *params, const BinningParams *params_b)
+{
+	return totals->frames > 0 && totals->params == params && totals->params_b == params_b;
+}
+
+static gdouble
+psnr (guint64 squared_error, guint64 samples)
+{
+	if (squared_error == 0)
+		return INFINITY;
+
+	return 10.0 * log10 (255.0 * 255.0 * samples / squared_error);
+}
+
+static const gchar *
+algorithm_nick (Gstbinningfilter *filter, BinningAlgorithm algorithm)
+{
+	GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (filter), "algorithm");
+	GEnumValue *value = g_enum_get_value (G_PARAM_SPEC_ENUM (pspec)->enum_class, algorithm);
+
+	return value ? value->value_nick : "unknown";
+}
+
+// Bin the image with both kernels of the params, leaving the compare-a result in it, and post the figures
+void
+gst_binningfilter_compare_image(Gstbinningfilter *filter, const BinningParams *params, const BinningImage *image, GstClockTime timestamp)
+{
+	const BinningParams *params_b = filter->frame.compare;
+	BinningCompareTotals *totals = &filter->compare_totals;
+	gsize frame_size = (gsize)image->stride * image->height;
+	BinningImage image_b = *image;
+	GstClockTime start, time_a, time_b;
+	gint width, height, width_b, height_b, x, y;
+	guint64 squared_error = 0;
+	guint max_abs_diff = 0;
+	GstStructure *s;
+
+	if (filter->compare_scratch_size < frame_size){
+		binning_memory_free (filter->compare_scratch);
+		filter->compare_scratch = binning_memory_alloc (frame_size, params->huge_pages);
+		filter->compare_scratch_size = frame_size;
+	}
+	memcpy (filter->compare_scratch, image->data, frame_size);
+	image_b.data = filter->compare_scratch;
+	image_b.stats = NULL;   // the statistics are of the frame passed on
+
+	if (!same_setup (totals, params, params_b)){   // the refs keep the pointers from being those of newer params
+		gst_binningfilter_compare_reset (filter);
+		totals->params = binning_params_ref ((BinningParams *) params);
+		totals->params_b = binning_params_ref ((BinningParams *) params_b);
+	}
+
+	if (totals->frames % 2 == 0){
+		start = gst_util_get_timestamp ();
+		binning_process_image (params, image);
+		time_a = gst_util_get_timestamp () - start;
+		start = gst_util_get_timestamp ();
+		binning_process_image (params_b, &image_b);
+		time_b = gst_util_get_timestamp () - start;
+	}
+	else{
+		start = gst_util_get_timestamp ();
+		binning_process_image (params_b, &image_b);
+		time_b = gst_util_get_timestamp () - start;
+		start = gst_util_get_timestamp ();
+		binning_process_image (params, image);
+		time_a = gst_util_get_timestamp () - start;
+	}
+
+	// only the region binned by both
+	binning_output_size (params, image->width, image->height, &width, &height);
+	binning_output_size (params_b, image->width, image->height, &width_b, &height_b);
+	width = MIN(width, width_b);
+	height = MIN(height, height_b);
+
+	for (y = 0; y < height; y++){
+		const guint8 *a = image->data + (gsize)y * image->stride;
+		const guint8 *b = image_b.data + (gsize)y * image->stride;
+		guint32 row_error = 0;   // at most 3*width*255^2, fits up to 22000 pixels wide
+
+		for (x = 0; x < width * 3; x++){
+			guint d = a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+			row_error += d * d;
+			max_abs_diff = MAX(max_abs_diff, d);
+		}
+		squared_error += row_error;
+	}
+
+	totals->frames++;
+	totals->time_a += time_a;
+	totals->time_b += time_b;
+	totals->squared_error += squared_error;
+	totals->samples += (guint64)width * height * 3;
+	totals->max_abs_diff = MAX(totals->max_abs_diff, max_abs_diff);
+
+	GST_LOG_OBJECT (filter, "a %" GST_TIME_FORMAT " b %" GST_TIME_FORMAT ", max diff %u",
+			GST_TIME_ARGS (time_a), GST_TIME_ARGS (time_b), max_abs_diff);
+
+	s = gst_structure_new ("binningfilter-compare",
+			"timestamp", G_TYPE_UINT64, timestamp,
+			"a", G_TYPE_STRING, algorithm_nick (filter, params->algorithm),
+			"b", G_TYPE_STRING, algorithm_nick (filter, params_b->algorithm),
+			"frames", G_TYPE_UINT64, totals->frames,
+			"a-time", G_TYPE_DOUBLE, time_a / 1e6,
+			"b-time", G_TYPE_DOUBLE, time_b / 1e6,
+			"a-mean-time", G_TYPE_DOUBLE, totals->time_a / 1e6 / totals->frames,
+			"b-mean-time", G_TYPE_DOUBLE, totals->time_b / 1e6 / totals->frames,
+			"psnr", G_TYPE_DOUBLE, psnr (squared_error, (guint64)width * height * 3),
+			"mean-psnr", G_TYPE_DOUBLE, psnr (totals->squared_error, totals->samples),
+			"max-abs-diff", G_TYPE_UINT, max_abs_diff,
+			"max-abs-diff-total", G_TYPE_UINT, totals->max_abs_diff, NULL);
+
+	gst_element_post_message (GST_ELEMENT (filter),
+			gst_message_new_element (GST_OBJECT (filter), s));
+}
+
+// Drop the totals, they start again from the next compared frame
+void
+gst_binningfilter_compare_reset(Gstbinningfilter *filter)
+{
+	BinningCompareTotals *totals = &filter->compare_totals;
+
+	if (totals->params)
+		binning_params_unref (totals->params);
+	if (totals->params_b)
+		binning_params_unref (totals->params_b);
+	memset (totals, 0, sizeof (BinningCompareTotals));
+}
+
+void
+gst_binningfilter_compare_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_compare_debug, "binningfilter",
+			1, "binningfilter compare");
+}
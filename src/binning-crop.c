@@ -0,0 +1,260 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <string.h>
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_crop_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_crop_debug
+
+// Cropped output, the src caps are of the binned image alone rather than of the whole frame with the image in its top left.
+// Their size follows the binsize, resize, bin-stride and border of each frame, so a change of any of them (or of the
+// binsize by auto-binsize) is applied at a frame boundary: caps of the new size are pushed on the src pad just before
+// the first frame binned with it, and downstream renegotiates between the two frames.
+// The output buffers come from a pool for each size, kept active while the element runs, so that switching back to a
+// size already used takes buffers that are already allocated.
+
+#define CROP_POOL_MIN_BUFFERS 2   // allocated when the pool is made, one downstream and one being binned
+
+static void
+crop_pool_free (BinningCropPool *entry)
+{
+	gst_buffer_pool_set_active (entry->pool, FALSE);
+	gst_object_unref (entry->pool);
+	gst_caps_unref (entry->caps);
+	entry->pool = NULL;
+	entry->caps = NULL;
+}
+
+// The pool for caps, made and filled if the size has not been used, and moved to the front as the most recently used.
+// When all are in use the least recently used is freed.
+static GstBufferPool *
+crop_pool (Gstbinningfilter *filter, GstCaps *caps, const GstVideoInfo *info)
+{
+	BinningCropPool entry;
+	GstStructure *config;
+	gint i;
+
+	for (i = 0; i < CROP_POOLS && filter->crop_pools[i].pool; i++)
+		if (gst_caps_is_equal (filter->crop_pools[i].caps, caps))
+			break;
+
+	if (i < CROP_POOLS && filter->crop_pools[i].pool)
+		entry = filter->crop_pools[i];
+	else {
+		i = MIN(i, CROP_POOLS - 1);
+		if (filter->crop_pools[i].pool)
+			crop_pool_free (&filter->crop_pools[i]);
+
+		entry.caps = gst_caps_ref (caps);
+		entry.pool = gst_video_buffer_pool_new ();
+		config = gst_buffer_pool_get_config (entry.pool);
+		gst_buffer_pool_config_set_params (config, caps, GST_VIDEO_INFO_SIZE (info), CROP_POOL_MIN_BUFFERS, 0);   // never blocks
+		if (!gst_buffer_pool_set_config (entry.pool, config) || !gst_buffer_pool_set_active (entry.pool, TRUE)){
+			crop_pool_free (&entry);
+			return NULL;
+		}
+		GST_DEBUG_OBJECT (filter, "Made a pool of %dx%d buffers", GST_VIDEO_INFO_WIDTH (info), GST_VIDEO_INFO_HEIGHT (info));
+	}
+
+	memmove (&filter->crop_pools[1], &filter->crop_pools[0], i * sizeof (BinningCropPool));
+	filter->crop_pools[0] = entry;
+
+	return entry.pool;
+}
+
+// Free the pools and forget the caps, when the element stops
+void
+gst_binningfilter_crop_reset (Gstbinningfilter *filter)
+{
+	gint i;
+
+	for (i = 0; i < CROP_POOLS; i++)
+		if (filter->crop_pools[i].pool)
+			crop_pool_free (&filter->crop_pools[i]);
+	if (filter->output_caps)
+		gst_caps_unref (filter->output_caps);
+	filter->output_caps = NULL;
+	filter->src_width = filter->src_height = 0;
+}
+
+// Widen the size of caps, transformed for the other side of the element, to any that cropping can give.
+// The src size is at most that of the sink and changes with the settings of each frame.
+void
+gst_binningfilter_crop_transform_caps (GstCaps *caps, GstPadDirection direction)
+{
+	static const gchar *fields[] = { "width", "height" };
+	guint i, f;
+
+	for (i = 0; i < gst_caps_get_size (caps); i++){
+		GstStructure *structure = gst_caps_get_structure (caps, i);
+
+		for (f = 0; f < G_N_ELEMENTS (fields); f++){
+			gint size;
+
+			if (!gst_structure_get_int (structure, fields[f], &size))
+				gst_structure_set (structure, fields[f], GST_TYPE_INT_RANGE, 1, G_MAXINT, NULL);
+			else if (direction == GST_PAD_SINK && size > 1)
+				gst_structure_set (structure, fields[f], GST_TYPE_INT_RANGE, 1, size, NULL);
+			else if (direction == GST_PAD_SRC && size < G_MAXINT)
+				gst_structure_set (structure, fields[f], GST_TYPE_INT_RANGE, size, G_MAXINT, NULL);
+		}
+	}
+}
+
+// Called before each frame is binned, from the streaming thread. When the size of the output binned with params
+// is not that of the src caps, caps of the new size are pushed and the pool for it made ready.
+// Also when the last caps could not be pushed or downstream asked to reconfigure.
+GstFlowReturn
+gst_binningfilter_crop_set_caps (Gstbinningfilter *filter, const BinningParams *params)
+{
+	GstCaps *caps;
+	gint width = filter->width, height = filter->height;
+	gboolean reconfigure;
+
+	if (!filter->output_caps)   // no caps on the sink pad yet
+		return GST_FLOW_OK;
+
+	if (filter->frame.crop)
+		binning_output_size (params, filter->width, filter->height, &width, &height);
+	reconfigure = filter->frame.crop && gst_pad_check_reconfigure (filter->srcpad);   // not cleared, and lost, while crop is off
+	if (width == filter->src_width && height == filter->src_height && !reconfigure)
+		return GST_FLOW_OK;
+
+	caps = gst_caps_copy (filter->output_caps);
+	gst_caps_set_simple (caps, "width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+	GST_DEBUG_OBJECT (filter, "Output of %dx%d, was %dx%d, pushing %" GST_PTR_FORMAT,
+			width, height, filter->src_width, filter->src_height, caps);
+
+	if (!gst_pad_push_event (filter->srcpad, gst_event_new_caps (caps))){
+		gst_caps_unref (caps);
+		gst_pad_mark_reconfigure (filter->srcpad);   // tried again with the next frame
+		if (GST_PAD_IS_FLUSHING (filter->srcpad))
+			return GST_FLOW_FLUSHING;
+		GST_WARNING_OBJECT (filter, "Downstream did not accept an output of %dx%d", width, height);
+		return GST_FLOW_NOT_NEGOTIATED;
+	}
+	filter->src_width = width;
+	filter->src_height = height;
+
+	if (filter->frame.crop && (!gst_video_info_from_caps (&filter->crop_info, caps) || !crop_pool (filter, caps, &filter->crop_info))){
+		gst_caps_unref (caps);
+		GST_ELEMENT_ERROR (filter, RESOURCE, NO_SPACE_LEFT, ("Could not make a pool of %dx%d buffers.", width, height), (NULL));
+		return GST_FLOW_ERROR;
+	}
+	gst_caps_unref (caps);
+
+	return GST_FLOW_OK;
+}
+
+// A buffer of the cropped output for buf, with its timestamps, from the pool of the current size, NULL if there is none
+GstBuffer *
+gst_binningfilter_crop_buffer (Gstbinningfilter *filter, GstBuffer *buf)
+{
+	GstBuffer *out = NULL;
+
+	if (!filter->crop_pools[0].pool || gst_buffer_pool_acquire_buffer (filter->crop_pools[0].pool, &out, NULL) != GST_FLOW_OK){
+		GST_ELEMENT_ERROR (filter, RESOURCE, NO_SPACE_LEFT, ("Could not get a buffer of the cropped output."), (NULL));
+		return NULL;
+	}
+	gst_buffer_copy_into (out, buf, GST_BUFFER_COPY_METADATA, 0, -1);
+
+	return out;
+}
+
+// The binned image in the top left of the frame buf, binned in place, copied into a buffer of the cropped output.
+// buf is unreffed, NULL is returned if the copy could not be made.
+GstBuffer *
+gst_binningfilter_crop_frame (Gstbinningfilter *filter, GstBuffer *buf)
+{
+	GstMapInfo in_info, out_info;
+	GstBuffer *out;
+	gint out_stride = GST_VIDEO_INFO_PLANE_STRIDE (&filter->crop_info, 0);
+	gint row_bytes = MIN(out_stride, filter->stride);   // whole words of packed samples, not past the input rows
+	gint y;
+
+	out = gst_binningfilter_crop_buffer (filter, buf);
+	if (!out){
+		gst_buffer_unref (buf);
+		return NULL;
+	}
+
+	if (!gst_buffer_map (buf, &in_info, GST_MAP_READ)){
+		GST_ELEMENT_ERROR (filter, RESOURCE, READ, ("Could not map the binned frame to crop."), (NULL));
+		gst_buffer_unref (out);
+		gst_buffer_unref (buf);
+		return NULL;
+	}
+	if (!gst_buffer_map (out, &out_info, GST_MAP_WRITE)){
+		GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, ("Could not map the cropped output."), (NULL));
+		gst_buffer_unmap (buf, &in_info);
+		gst_buffer_unref (out);
+		gst_buffer_unref (buf);
+		return NULL;
+	}
+
+	for (y = 0; y < filter->src_height; y++)
+		memcpy (out_info.data + (gsize)y * out_stride, in_info.data + (gsize)y * filter->stride, row_bytes);
+
+	gst_buffer_unmap (out, &out_info);
+	gst_buffer_unmap (buf, &in_info);
+	gst_buffer_unref (buf);
+
+	return out;
+}
+
+void
+gst_binningfilter_crop_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_crop_debug, "binningfilter",
+			1, "binningfilter cropped output");
+}
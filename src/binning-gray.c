@@ -0,0 +1,220 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <string.h>
+
+#include "binning-private.h"
+
+// Binning of linear mono or raw sensor data straight from its packed format into a 16-bit linear output.
+// As the stride engine, with one channel: the samples of the last binsize rows are kept in a ring with a running sum
+// of each column, and each row is unpacked as it is loaded into the ring, so the unpacked frame is never made.
+// The samples stay in the units of the input, the bin sums are scaled to those of the gamma luts as they are written.
+// A ring of 7 rows of 4096 samples is 112 KB, so the frame is not cut into tiles of columns.
+
+typedef struct
+{
+	gsize size;   // number of guint32 in data
+	guint32 data[];
+} GrayScratch;
+
+static GPrivate gray_scratch = G_PRIVATE_INIT (g_free);
+
+static guint32 *
+get_scratch(gsize size)
+{
+	GrayScratch *scratch = g_private_get(&gray_scratch);
+
+	if (!scratch || scratch->size < size){
+		scratch = g_malloc(sizeof(GrayScratch) + size * sizeof(guint32));
+		scratch->size = size;
+		g_private_replace(&gray_scratch, scratch);   // frees the old one
+	}
+
+	return scratch->data;
+}
+
+// Unpack one row into a slot of the ring, less the black level, and add it to the column sums
+static inline void
+load_row(BinningFormat format, const guint8 *line, gint width, gint black, guint32 *row, guint32 *col_sums)
+{
+	gint x, v;
+
+	switch (format){
+	case BINNING_FORMAT_GRAY10_LE32:{
+		const guint32 *words = (const guint32 *)line;
+		guint32 word = 0;
+
+		for(x=0; x<width; x++){
+			if (x % 3 == 0)   // words are only read while they hold samples of the row
+				word = GUINT32_FROM_LE(*words++);
+			v = MAX((gint)(word & 0x3FF) - black, 0);
+			word >>= 10;
+			row[x] = v;
+			col_sums[x] += v;
+		}
+		break;
+	}
+	case BINNING_FORMAT_GRAY10_LE16:
+	case BINNING_FORMAT_GRAY16_LE:
+	default:{
+		const guint16 *samples = (const guint16 *)line;
+		guint mask = format == BINNING_FORMAT_GRAY10_LE16 ? 0x3FF : 0xFFFF;
+
+		for(x=0; x<width; x++){
+			v = MAX((gint)(GUINT16_FROM_LE(samples[x]) & mask) - black, 0);
+			row[x] = v;
+			col_sums[x] += v;
+		}
+		break;
+	}
+	}
+}
+
+// Load image row r, or the row a border repeats past the bottom, and the columns past the right, into a ring slot of
+// padded columns. The input is only read, so the border is taken straight from it.
+static inline void
+load_padded_row(const BinningParams *params, const BinningImage *image, gint r, gint black, guint32 *row, guint32 *col_sums, gint padded)
+{
+	gint x, width = image->width;
+
+	if (r >= image->height){
+		if (params->border == BINNING_BORDER_PARTIAL){   // nothing there
+			memset(row, 0, padded * sizeof(guint32));
+			return;
+		}
+		r = binning_border_index(params->border, r, image->height);
+	}
+	load_row(params->format, image->data + (gsize)r * image->stride, width, black, row, col_sums);
+
+	for(x=width; x<padded; x++){   // the samples are already in the row
+		row[x] = params->border == BINNING_BORDER_PARTIAL ? 0 : row[binning_border_index(params->border, x, width)];
+		col_sums[x] += row[x];
+	}
+}
+
+void
+binning_gray_image(const BinningParams *params, const BinningImage *image, gint bin_stride)
+{
+	gint x, y, r, out_x, out_y;
+	gint s = params->binsize;
+	gint k = bin_stride;
+	gint width = image->width;
+	gint height = image->height;
+	gint bits = params->format == BINNING_FORMAT_GRAY16_LE ? 16 : 10;
+	gint black = params->black_g << (bits - 8);   // the black level is set in 8-bit units
+	gfloat gain = params->gain_g * (OUT_RANGE - 1) / ((1 << bits) - 1);   // and the sums are scaled to the gamma luts
+	gint channels = params->output == BINNING_OUTPUT_GRAY16 ? 1 : 4;
+
+	if (s > width || s > height || !image->out)   // there is no in-place output of a packed format
+		return;
+
+	// a border runs the window on past the right and bottom of the frame, as in the stride engine
+	gboolean right = params->border && BINNING_IMAGE_RIGHT_EDGE(image);
+	gboolean bottom = params->border && BINNING_IMAGE_BOTTOM_EDGE(image);
+	gboolean partial = params->border == BINNING_BORDER_PARTIAL;
+	gint out_width = (width - (right ? 1 : s)) / k + 1;
+	gint out_height = (height - (bottom ? 1 : s)) / k + 1;
+	gint full_width = partial && right ? (width - s) / k + 1 : out_width;   // bins with every sample inside the image
+	gint padded = MAX(width, (out_width - 1) * k + s);   // columns of the ring, the whole row is loaded even with gaps
+	gint n = s * s;
+
+	guint32 *ring = get_scratch((gsize)(s+1) * padded);
+	guint32 *col_sums = ring + (gsize)s * padded;
+
+	for(out_y=0, y=0; out_y<out_height; out_y++, y+=k){
+
+		if (out_y==0 || k>=s){  // no overlap with the last window, start again
+			memset(col_sums, 0, padded * sizeof(guint32));
+			for(r=y; r<y+s; r++)
+				load_padded_row(params, image, r, black, ring + (gsize)(r % s) * padded, col_sums, padded);
+		}
+		else{  // the ring slot of each new row holds the row that has just left the window
+			for(r=y+s-k; r<y+s; r++){
+				guint32 *row = ring + (gsize)(r % s) * padded;
+				for(x=0; x<padded; x++)
+					col_sums[x] -= row[x];
+				load_padded_row(params, image, r, black, row, col_sums, padded);
+			}
+		}
+
+		guint32 sum = 0;
+		guint16 *out_ptr = (guint16 *)(image->out + (gsize)image->out_stride * out_y);
+		gint rows_inside = partial && bottom ? MIN(s, height - y) : s;
+		gint plain_end = rows_inside < s ? 0 : full_width;
+
+		for(out_x=0, x=0; out_x<plain_end; out_x++, x+=k){
+			if (out_x==0 || k>=s){
+				sum = 0;
+				for(r=x; r<x+s; r++)
+					sum += col_sums[r];
+			}
+			else
+				for(r=x-k; r<x; r++)
+					sum += col_sums[r+s] - col_sums[r];
+
+			gfloat v = sum * gain;
+			binning_store_linear(params, out_ptr, v, v, v, image->stats);
+			out_ptr += channels;
+		}
+
+		for(; out_x<out_width; out_x++, x+=k){   // partial bins, scaled up for the samples they lack
+			if (out_x==plain_end || k>=s){
+				sum = 0;
+				for(r=x; r<x+s; r++)
+					sum += col_sums[r];
+			}
+			else
+				for(r=x-k; r<x; r++)
+					sum += col_sums[r+s] - col_sums[r];
+
+			gfloat v = sum * gain * n / (rows_inside * (right ? MIN(s, width - x) : s));
+			binning_store_linear(params, out_ptr, v, v, v, image->stats);
+			out_ptr += channels;
+		}
+	}
+}
@@ -0,0 +1,327 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_incremental_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_incremental_debug
+
+// Incremental binning, for static scenes (a fixed microscope stage, a surveillance background).
+// The frame is cut into tiles of TILE x TILE input pixels, each compared with the reference, the input that the cached
+// output was last binned from. The output is cut into tiles of TILE x TILE output pixels, and an output tile is only
+// binned again when a changed input tile falls in its footprint, the input rows and columns its bins gather from.
+// The other tiles are copied from the cache of the last output. An input tile counts as changed when any sample in it
+// differs from the reference by more than the threshold, so sensor noise can be let through, and the reference only
+// moves on when a tile changes, so a slow drift is caught once it adds up to more than the threshold.
+// When most tiles have changed the frame is binned whole, which is cheaper than tile by tile.
+
+#define TILE 32
+
+typedef struct
+{
+	const BinningParams *params;
+	gint threshold;   // filter->frame.incremental_threshold
+	const BinningImage *image;
+	const guint8 *reference;
+	guint8 *output;   // the cache, laid out as the frame
+	gint s, k;
+	gint out_width, out_height;
+	gint in_cols, in_rows;   // input tiles
+	gint out_cols;   // output tiles in a row
+	guint8 *changed;   // for each input tile
+	guint *dirty;   // output tiles to bin, as row * out_cols + column
+} Incremental;
+
+// TRUE if any of the rows x bytes samples differ by more than threshold
+static gboolean
+tile_changed (const guint8 *a, const guint8 *b, gsize stride, gint bytes, gint rows, guint8 threshold)
+{
+	gint r, x = 0;
+
+#ifdef __SSE2__
+	const __m128i limit = _mm_set1_epi8 ((gchar) threshold);
+	const __m128i zero = _mm_setzero_si128 ();
+
+	for (r = 0; r < rows; r++, a += stride, b += stride){
+		__m128i over = zero;
+
+		for (x = 0; x + 16 <= bytes; x += 16){
+			__m128i va = _mm_loadu_si128 ((const __m128i *)(a + x));
+			__m128i vb = _mm_loadu_si128 ((const __m128i *)(b + x));
+			__m128i diff = _mm_or_si128 (_mm_subs_epu8 (va, vb), _mm_subs_epu8 (vb, va));   // |a-b|
+			over = _mm_or_si128 (over, _mm_subs_epu8 (diff, limit));   // non-zero where |a-b| > threshold
+		}
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (over, zero)) != 0xFFFF)
+			return TRUE;
+
+		for (; x < bytes; x++)
+			if (ABS ((gint)a[x] - (gint)b[x]) > threshold)
+				return TRUE;
+	}
+#else
+	for (r = 0; r < rows; r++, a += stride, b += stride)
+		for (x = 0; x < bytes; x++)
+			if (ABS ((gint)a[x] - (gint)b[x]) > threshold)
+				return TRUE;
+#endif
+
+	return FALSE;
+}
+
+// Compare one row of input tiles with the reference
+static void
+detect_row (gpointer data, guint index)
+{
+	Incremental *inc = data;
+	const BinningImage *image = inc->image;
+	gint y = index * TILE, rows = MIN(TILE, image->height - y), col;
+	gsize offset = (gsize)y * image->stride;
+
+	for (col = 0; col < inc->in_cols; col++){
+		gint x = col * TILE;
+		gint bytes = MIN(TILE, image->width - x) * 3;
+
+		inc->changed[index * inc->in_cols + col] = tile_changed (image->data + offset + x * 3, inc->reference + offset + x * 3,
+				image->stride, bytes, rows, inc->threshold);
+	}
+}
+
+// Input pixels gathered by output pixels first to end-1, along a row or a column
+static void
+footprint (const Incremental *inc, gint first, gint end, gint size, gint *in_first, gint *in_end)
+{
+	*in_first = first * inc->k;
+	*in_end = MIN((end - 1) * inc->k + inc->s, size);
+}
+
+// Bin one output tile from its footprint of the frame, in the scratch of this thread, into the cache
+static void
+bin_tile (gpointer data, guint index)
+{
+	Incremental *inc = data;
+	const BinningImage *image = inc->image;
+	guint tile = inc->dirty[index];
+	gint tx = (tile % inc->out_cols) * TILE, ty = (tile / inc->out_cols) * TILE;
+	gint tw = MIN(TILE, inc->out_width - tx), th = MIN(TILE, inc->out_height - ty);
+	gint x0, x1, y0, y1, r;
+	gsize stride = image->stride;
+	BinningImage part;
+	guint8 *scratch;
+
+	footprint (inc, tx, tx + tw, image->width, &x0, &x1);
+	footprint (inc, ty, ty + th, image->height, &y0, &y1);
+
+	// the frame stride is kept, the calibration frames are indexed with it
+	scratch = binning_pool_scratch ((y1 - y0) * stride, inc->params->huge_pages);
+	for (r = y0; r < y1; r++)
+		memcpy (scratch + (r - y0) * stride, image->data + r * stride + x0 * 3, (x1 - x0) * 3);
+
+	part.data = scratch;
+	part.width = x1 - x0;
+	part.height = y1 - y0;
+	part.stride = image->stride;
+	part.stats = NULL;   // taken from the whole output at the end
+	part.top = image->top + y0;
+	part.left = image->left + x0;
+	part.out = NULL;
+	part.frame_width = image->frame_width ? image->frame_width : image->left + image->width;
+	part.frame_height = image->frame_height ? image->frame_height : image->top + image->height;
+	binning_process_image (inc->params, &part);
+
+	for (r = 0; r < th; r++)
+		memcpy (inc->output + (ty + r) * stride + tx * 3, scratch + r * stride, tw * 3);
+}
+
+// Start again from this frame, binned whole, e.g. on the first frame, when the params or the frame size change
+// and when most of the frame has changed
+static void
+bin_whole (Gstbinningfilter *filter, const BinningParams *params, const BinningImage *image, gint out_width, gint out_height)
+{
+	gsize frame_size = (gsize)image->stride * image->height;
+	gint r;
+
+	memcpy (filter->incremental_reference, image->data, frame_size);
+	binning_process_image_parallel (params, image);
+	for (r = 0; r < out_height; r++)
+		memcpy (filter->incremental_output + (gsize)r * image->stride, image->data + (gsize)r * image->stride, out_width * 3);
+}
+
+// Bin the image, reusing the cached output of the tiles whose input has not changed since they were last binned
+void
+gst_binningfilter_incremental_image (Gstbinningfilter *filter, const BinningParams *params, const BinningImage *image)
+{
+	Incremental inc;
+	gsize frame_size = (gsize)image->stride * image->height;
+	gint out_rows, tiles, n_dirty = 0, tx, ty, r, col, row;
+	guint64 binned, reused;
+
+	inc.params = params;
+	inc.threshold = filter->frame.incremental_threshold;
+	inc.image = image;
+	inc.s = params->binsize;
+	inc.k = params->bin_stride > 0 ? params->bin_stride : (params->resize ? inc.s : 1);
+	binning_output_size (params, image->width, image->height, &inc.out_width, &inc.out_height);
+	inc.out_cols = (inc.out_width + TILE - 1) / TILE;
+	out_rows = (inc.out_height + TILE - 1) / TILE;
+	tiles = inc.out_cols * out_rows;
+
+	if (inc.s > image->width || inc.s > image->height){   // nothing is binned
+		binning_process_image (params, image);
+		return;
+	}
+
+	// the cache is only good for the params and frame size it was made with
+	if (filter->incremental_params != params || filter->incremental_size != frame_size){
+		if (filter->incremental_params)
+			binning_params_unref (filter->incremental_params);
+		filter->incremental_params = binning_params_ref ((BinningParams *) params);
+		if (filter->incremental_size != frame_size){
+			binning_memory_free (filter->incremental_reference);
+			binning_memory_free (filter->incremental_output);
+			filter->incremental_reference = binning_memory_alloc (frame_size, params->huge_pages);
+			filter->incremental_output = binning_memory_alloc (frame_size, params->huge_pages);
+			filter->incremental_size = frame_size;
+		}
+		GST_DEBUG_OBJECT (filter, "New settings or frame size, binning the whole frame");
+		bin_whole (filter, params, image, inc.out_width, inc.out_height);
+		binned = tiles;
+		reused = 0;
+		goto done;
+	}
+
+	inc.reference = filter->incremental_reference;
+	inc.output = filter->incremental_output;
+	inc.in_cols = (image->width + TILE - 1) / TILE;
+	inc.in_rows = (image->height + TILE - 1) / TILE;
+	inc.changed = g_new (guint8, inc.in_cols * inc.in_rows);
+	inc.dirty = g_new (guint, tiles);
+
+	binning_pool_run (inc.in_rows, detect_row, &inc);
+
+	// an output tile is binned again if any input tile under its footprint has changed
+	for (ty = 0; ty < inc.out_height; ty += TILE){
+		for (tx = 0; tx < inc.out_width; tx += TILE){
+			gint x0, x1, y0, y1;
+			gboolean changed = FALSE;
+
+			footprint (&inc, tx, MIN(tx + TILE, inc.out_width), image->width, &x0, &x1);
+			footprint (&inc, ty, MIN(ty + TILE, inc.out_height), image->height, &y0, &y1);
+			for (row = y0 / TILE; row <= (y1 - 1) / TILE && !changed; row++)
+				for (col = x0 / TILE; col <= (x1 - 1) / TILE && !changed; col++)
+					changed = inc.changed[row * inc.in_cols + col];
+
+			if (changed)
+				inc.dirty[n_dirty++] = (ty / TILE) * inc.out_cols + tx / TILE;
+		}
+	}
+
+	if (n_dirty * 2 > tiles){
+		bin_whole (filter, params, image, inc.out_width, inc.out_height);
+		binned = tiles;
+	}
+	else{
+		binning_pool_run (n_dirty, bin_tile, &inc);
+
+		// the changed input becomes the reference, before the frame is overwritten by the output
+		for (row = 0; row < inc.in_rows; row++)
+			for (col = 0; col < inc.in_cols; col++)
+				if (inc.changed[row * inc.in_cols + col]){
+					gint x = col * TILE, y = row * TILE;
+					for (r = y; r < MIN(y + TILE, image->height); r++)
+						memcpy (filter->incremental_reference + (gsize)r * image->stride + x * 3,
+								image->data + (gsize)r * image->stride + x * 3, MIN(TILE, image->width - x) * 3);
+				}
+
+		// the binned image, the rest of the frame is left as the kernels leave it, unchanged
+		for (r = 0; r < inc.out_height; r++)
+			memcpy (image->data + (gsize)r * image->stride, inc.output + (gsize)r * image->stride, inc.out_width * 3);
+
+		if (image->stats)
+			binning_stats_add_image (image->stats, image->data, inc.out_width, inc.out_height, image->stride / 3);
+
+		binned = n_dirty;
+	}
+	reused = tiles - binned;
+
+	g_free (inc.changed);
+	g_free (inc.dirty);
+
+done:
+	GST_LOG_OBJECT (filter, "Binned %" G_GUINT64_FORMAT " of %d tiles", binned, tiles);
+
+	GST_OBJECT_LOCK (filter);
+	filter->tiles_binned += binned;
+	filter->tiles_reused += reused;
+	GST_OBJECT_UNLOCK (filter);
+}
+
+// Drop the cache, e.g. when the element stops
+void
+gst_binningfilter_incremental_reset (Gstbinningfilter *filter)
+{
+	if (filter->incremental_params)
+		binning_params_unref (filter->incremental_params);
+	filter->incremental_params = NULL;
+	binning_memory_free (filter->incremental_reference);
+	binning_memory_free (filter->incremental_output);
+	filter->incremental_reference = filter->incremental_output = NULL;
+	filter->incremental_size = 0;
+}
+
+void
+gst_binningfilter_incremental_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_incremental_debug, "binningfilter",
+			1, "binningfilter incremental");
+}
@@ -0,0 +1,269 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_levels_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_levels_debug
+
+#define AUTO_LEVELS_STEP 8              // sample every 8th pixel of every 8th line, 1/64 of the frame
+#define AUTO_LEVELS_LOW_PERCENTILE 0.5  // % of samples allowed below the black level
+#define AUTO_LEVELS_HIGH_PERCENTILE 99.5  // % of samples at or below the level that is mapped to AUTO_LEVELS_TARGET
+#define AUTO_LEVELS_TARGET 0.9          // fraction of full scale that the high percentile is binned to
+#define AUTO_BINSIZE_MAX 7              // as the binsize property
+#define AUTO_BINSIZE_HYSTERESIS 0.25    // fraction past the target the bins must be before the binsize changes
+
+// The properties that auto-levels and auto-binsize set, bit i of filter->levels_changed is levels_properties[i]
+static const gchar *levels_properties[] = { "rblack", "gblack", "bblack", "rcontrast", "gcontrast", "bcontrast", "binsize" };
+#define LEVELS_CHANGED_BINSIZE (1 << 6)
+
+// Set a level as if it were set as a property, noting the change for gst_binningfilter_levels_notify(),
+// returns whether it changed
+static gboolean
+set_level(Gstbinningfilter *filter, gint *level, gint value, guint changed)
+{
+	if (*level == value)
+		return FALSE;
+	*level = value;
+	filter->levels_changed |= changed;
+	return TRUE;
+}
+
+// Histogram a sparse subsample of the input frame, before it is binned in-place, for auto-levels and auto-binsize
+void
+gst_binningfilter_auto_levels_sample(Gstbinningfilter *filter, GstBuffer *buf)
+{
+	gint x, y;
+	bgr_pixel *ptr;
+	GstMapInfo minfo;
+	gint pitch = filter->stride / 3;  // want the number of pixels to next line
+
+	memset(filter->levels_histogram, 0, sizeof(filter->levels_histogram));
+
+	if (!gst_buffer_map (buf, &minfo, GST_MAP_READ)){   // nothing sampled, the levels and binsize stay as they are
+		GST_WARNING_OBJECT (filter, "Could not map the frame to sample its levels");
+		return;
+	}
+
+	for(y=AUTO_LEVELS_STEP/2; y<filter->height; y+=AUTO_LEVELS_STEP){
+		ptr = (bgr_pixel *)minfo.data + pitch * y + AUTO_LEVELS_STEP/2; // ptr to first sample of line
+		for(x=AUTO_LEVELS_STEP/2; x<filter->width; x+=AUTO_LEVELS_STEP){
+			filter->levels_histogram[0][ptr->b]++;
+			filter->levels_histogram[1][ptr->g]++;
+			filter->levels_histogram[2][ptr->r]++;
+			ptr+=AUTO_LEVELS_STEP;
+		}
+	}
+
+	gst_buffer_unmap (buf, &minfo);
+}
+
+// Number of samples in a histogram
+static guint64
+histogram_total(const guint32 *histogram)
+{
+	gint i;
+	guint64 total = 0;
+
+	for(i=0; i<IN_RANGE; i++)
+		total += histogram[i];
+
+	return total;
+}
+
+// Level below which the given percentage of the samples fall
+static gint
+histogram_percentile(guint32 *histogram, gdouble percentile)
+{
+	gint i;
+	guint64 total = histogram_total(histogram), count = 0, limit;
+
+	limit = (guint64)(total * percentile / 100.0);
+
+	for(i=0; i<IN_RANGE; i++){
+		count += histogram[i];
+		if (count > limit)
+			return i;
+	}
+
+	return IN_RANGE-1;
+}
+
+// Derive new black and contrast levels from the sampled histograms,
+// called after the frame is binned so they are used from the next frame on
+void
+gst_binningfilter_auto_levels_update(Gstbinningfilter *filter, const BinningParams *params)
+{
+	gint c, low, high;
+	gboolean changed = FALSE;
+	gint n = params->binsize * params->binsize;   // pixels summed into each bin
+	gdouble black, contrast, lin;
+	gdouble smoothing = filter->frame.auto_levels_smoothing;
+
+	if (histogram_total(filter->levels_histogram[1]) == 0)   // nothing sampled
+		return;
+
+	if (!filter->auto_levels_valid)   // first frame, go straight to the estimate
+		smoothing = 1.0;
+
+	for(c=0; c<3; c++){
+		low = histogram_percentile(filter->levels_histogram[c], AUTO_LEVELS_LOW_PERCENTILE);
+		high = histogram_percentile(filter->levels_histogram[c], AUTO_LEVELS_HIGH_PERCENTILE);
+
+		black = low;
+
+		// gain that takes the sum of n pixels at the high level to the target, in linear space
+		lin = params->forward_gamma[MAX(high - low, 1)] * n;
+		contrast = 100.0 * AUTO_LEVELS_TARGET * OUT_RANGE / lin;
+		contrast = CLAMP(contrast, 1.0, 1000.0);
+
+		filter->auto_black[c] += smoothing * (black - filter->auto_black[c]);
+		filter->auto_contrast[c] += smoothing * (contrast - filter->auto_contrast[c]);
+	}
+
+	filter->auto_levels_valid = TRUE;
+
+	// histograms are in buffer order, b, g, r for BGR data, r, g, b for RGB, the filter levels are always for the real colours
+	// they are written as if set as properties, so the kernels get them with the next params, only made if one changed,
+	// as a new params block also restarts the compare totals and the incremental cache
+	GST_OBJECT_LOCK (filter);
+	if(filter->format_is_RGB){
+		changed |= set_level(filter, &filter->black_r, (gint)(filter->auto_black[0] + 0.5), 1 << 0);
+		changed |= set_level(filter, &filter->black_b, (gint)(filter->auto_black[2] + 0.5), 1 << 2);
+		changed |= set_level(filter, &filter->contrast_r, (gint)(filter->auto_contrast[0] + 0.5), 1 << 3);
+		changed |= set_level(filter, &filter->contrast_b, (gint)(filter->auto_contrast[2] + 0.5), 1 << 5);
+	}
+	else{
+		changed |= set_level(filter, &filter->black_b, (gint)(filter->auto_black[0] + 0.5), 1 << 2);
+		changed |= set_level(filter, &filter->black_r, (gint)(filter->auto_black[2] + 0.5), 1 << 0);
+		changed |= set_level(filter, &filter->contrast_b, (gint)(filter->auto_contrast[0] + 0.5), 1 << 5);
+		changed |= set_level(filter, &filter->contrast_r, (gint)(filter->auto_contrast[2] + 0.5), 1 << 3);
+	}
+	changed |= set_level(filter, &filter->black_g, (gint)(filter->auto_black[1] + 0.5), 1 << 1);
+	changed |= set_level(filter, &filter->contrast_g, (gint)(filter->auto_contrast[1] + 0.5), 1 << 4);
+
+	GST_LOG_OBJECT (filter, "Auto levels, black: %d %d %d contrast: %d %d %d",
+			filter->black_r, filter->black_g, filter->black_b, filter->contrast_r, filter->contrast_g, filter->contrast_b);
+
+	if (changed)
+		gst_binningfilter_publish_params(filter);
+	GST_OBJECT_UNLOCK (filter);
+}
+
+// Choose the binsize for the next frame from the sampled histograms, the smallest whose bins reach the target.
+// The sum of a bin is estimated from the mean linear level of the green samples, before the contrast,
+// so the choice does not depend on the contrast that auto-levels sets for it.
+// Dimmer bins than the target by the hysteresis step up to the first binsize that reaches it,
+// and it only steps down while the smaller bins are still brighter than the target by the hysteresis.
+void
+gst_binningfilter_auto_binsize_update(Gstbinningfilter *filter, const BinningParams *params)
+{
+	gint i, n = params->binsize;
+	guint32 *histogram = filter->levels_histogram[1];   // green is in the middle in either byte order
+	guint64 total = 0;
+	gdouble mean = 0.0;
+	gdouble target = params->forward_gamma[filter->frame.auto_binsize_target];
+
+	for(i=0; i<IN_RANGE; i++){
+		total += histogram[i];
+		mean += histogram[i] * params->forward_gamma[MAX(i - params->black_g, 0)];
+	}
+
+	if (total == 0)   // frame smaller than the sample step
+		return;
+
+	mean /= total;
+
+	if (n * n * mean < target * (1.0 - AUTO_BINSIZE_HYSTERESIS))
+		while (n < AUTO_BINSIZE_MAX && n * n * mean < target)
+			n++;
+	else
+		while (n > 1 && (n-1) * (n-1) * mean >= target * (1.0 + AUTO_BINSIZE_HYSTERESIS))
+			n--;
+
+	if (n == params->binsize)
+		return;
+
+	GST_DEBUG_OBJECT (filter, "Auto binsize %d, was %d, mean linear level %.1f target %.1f", n, params->binsize, mean, target);
+
+	// written as if set as a property, so the kernels get it with the next params
+	GST_OBJECT_LOCK (filter);
+	if (set_level(filter, &filter->binsize, n, LEVELS_CHANGED_BINSIZE))
+		gst_binningfilter_publish_params(filter);
+	GST_OBJECT_UNLOCK (filter);
+}
+
+// Notify the properties that auto-levels and auto-binsize changed. Called by the streaming thread once the frame
+// has been pushed, outside the object lock, as the handlers run in this thread and may get the properties.
+void
+gst_binningfilter_levels_notify(Gstbinningfilter *filter)
+{
+	guint i, changed = filter->levels_changed;
+
+	if (!changed)
+		return;
+	filter->levels_changed = 0;
+
+	g_object_freeze_notify (G_OBJECT (filter));   // one notify of each at the thaw
+	for(i=0; i<G_N_ELEMENTS(levels_properties); i++)
+		if (changed & (1 << i))
+			g_object_notify (G_OBJECT (filter), levels_properties[i]);
+	g_object_thaw_notify (G_OBJECT (filter));
+}
+
+void
+gst_binningfilter_levels_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_levels_debug, "binningfilter",
+			1, "binningfilter auto levels");
+}
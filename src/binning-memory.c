@@ -0,0 +1,154 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+// Memory for the frame sized buffers of libbinning and its users, optionally in huge pages.
+// Kernels that run down the rows of a large frame touch a new 4K page every few pixels of each row they read or
+// write, and with several rows of a bin and a scratch copy in flight at once they miss the TLB on most of them.
+// A 2M huge page covers 512 times as much, so the same walk stays within a few TLB entries.
+// Reserved huge pages (vm.nr_hugepages) are tried first, as they are certain to be huge pages. Most systems have none,
+// the memory is then mapped on a huge page boundary and transparent huge pages asked for with madvise(), which the
+// kernel gives where it can. Where neither is available the memory is in normal pages.
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <stdlib.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "binning.h"
+
+#define MEMORY_ALIGN 4096   // a normal page, enough for O_DIRECT
+#define HUGE_PAGE_SIZE ((gsize)2 << 20)   // the default huge page size of x86-64, and of arm64 with 4K pages
+
+// The mappings made, by address, so that binning_memory_free() knows to unmap them and their size
+static GHashTable *mapped = NULL;
+static GMutex mapped_lock;
+
+#ifdef HAVE_MMAP
+// size bytes on a huge page boundary, size is a whole number of huge pages. NULL if nothing could be mapped.
+static guint8 *
+map_huge(gsize size)
+{
+	guint8 *mem;
+	gsize head;
+
+#ifdef MAP_HUGETLB
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (mem != MAP_FAILED){
+		g_debug("libbinning: %" G_GSIZE_FORMAT " bytes in reserved huge pages", size);
+		return mem;
+	}
+#endif
+
+	// a huge page more than needed, then the ends trimmed so that it starts on a huge page boundary
+	mem = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	head = (HUGE_PAGE_SIZE - ((guintptr)mem & (HUGE_PAGE_SIZE - 1))) & (HUGE_PAGE_SIZE - 1);
+	if (head)
+		munmap(mem, head);
+	munmap(mem + head + size, HUGE_PAGE_SIZE - head);
+	mem += head;
+
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+	if (madvise(mem, size, MADV_HUGEPAGE) == 0)   // fails where transparent huge pages are not built in
+		g_debug("libbinning: %" G_GSIZE_FORMAT " bytes in transparent huge pages", size);
+#endif
+
+	return mem;
+}
+#endif
+
+gpointer
+binning_memory_alloc(gsize size, gboolean huge_pages)
+{
+	gpointer mem = NULL;
+
+#ifdef HAVE_MMAP
+	if (huge_pages && size >= HUGE_PAGE_SIZE / 2){   // smaller would waste more than it saves in rounding up
+		gsize map_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+		mem = map_huge(map_size);
+		if (mem){
+			g_mutex_lock(&mapped_lock);
+			if (!mapped)
+				mapped = g_hash_table_new(NULL, NULL);
+			g_hash_table_insert(mapped, mem, GSIZE_TO_POINTER(map_size));
+			g_mutex_unlock(&mapped_lock);
+			return mem;
+		}
+	}
+#endif
+
+	if (posix_memalign(&mem, MEMORY_ALIGN, MAX(size, 1)) != 0)
+		g_error("libbinning: could not allocate %" G_GSIZE_FORMAT " bytes", size);   // as g_malloc() would
+
+	return mem;
+}
+
+void
+binning_memory_free(gpointer mem)
+{
+	gpointer map_size = NULL;
+
+	if (!mem)
+		return;
+
+	g_mutex_lock(&mapped_lock);
+	if (mapped && g_hash_table_lookup_extended(mapped, mem, NULL, &map_size))
+		g_hash_table_remove(mapped, mem);
+	g_mutex_unlock(&mapped_lock);
+
+#ifdef HAVE_MMAP
+	if (map_size){
+		munmap(mem, GPOINTER_TO_SIZE(map_size));
+		return;
+	}
+#endif
+	free(mem);
+}
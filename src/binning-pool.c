@@ -0,0 +1,543 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// The worker pool of libbinning, one per process and shared by everything in it that bins, e.g. all the
+// binningfilter elements of a host running many camera pipelines, so that each does not start a thread per core.
+//
+// Work is handed out as a task of n items, the frames of a buffer list or the row bands of one frame.
+// The caller pushes helper jobs for the task onto the pool and works on it too, every thread takes the next item
+// with an atomic increment until none are left. So a task is never held up behind a busy pool, it just gets
+// fewer helpers, and a task started from inside another runs in line rather than waiting on the pool.
+
+#define _GNU_SOURCE   // sched_setaffinity
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <string.h>
+#include <stdio.h>
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+#include "binning-private.h"
+
+#define BAND_MIN_ROWS 32   // output rows, smaller bands cost more in halo and copies than the extra threads gain
+
+typedef struct
+{
+	gint refcount;   // the caller and each helper job
+	BinningPoolFunc func;
+	gpointer data;
+	gint n;
+	gint next;   // next item to take, atomic
+	gint remaining;   // items not finished, protected by lock
+	GMutex lock;
+	GCond done;
+} PoolTask;
+
+static GMutex pool_lock;   // protects the pool setup
+static GThreadPool *pool = NULL;   // made by the first task that can use it
+static gint pool_threads = 0;   // 0 for one per core
+static gint *pool_cores = NULL;   // cores the threads are pinned to, in turn, NULL to leave them to the scheduler
+static gint pool_n_cores = 0;
+static gint pool_next_core = 0;
+
+static GPrivate in_task = G_PRIVATE_INIT (NULL);   // set while the thread works on a task
+static GPrivate pinned = G_PRIVATE_INIT (NULL);   // set once a thread of the pool has been pinned
+
+// Band scratch, one per thread and allocated by it, so that with first-touch NUMA policy (the Linux default)
+// its pages are on the node of the thread that bins into it, freed when the thread exits
+typedef struct
+{
+	gsize size;
+	gboolean huge_pages;
+	guint8 data[];
+} BandScratch;
+
+static GPrivate band_scratch = G_PRIVATE_INIT (binning_memory_free);
+static GPrivate snapshot_scratch = G_PRIVATE_INIT (binning_memory_free);
+
+static guint8 *
+get_scratch(GPrivate *key, gsize size, gboolean huge_pages)
+{
+	BandScratch *scratch = g_private_get(key);
+
+	if (!scratch || scratch->size < size || (huge_pages && !scratch->huge_pages)){
+		scratch = binning_memory_alloc(sizeof(BandScratch) + size, huge_pages);
+		scratch->size = size;
+		scratch->huge_pages = huge_pages;
+		g_private_replace(key, scratch);   // frees the old one
+	}
+
+	return scratch->data;
+}
+
+// Scratch of the calling thread for binning a part of a frame, it keeps the biggest size asked for,
+// in huge pages once they have been asked for
+guint8 *
+binning_pool_scratch(gsize size, gboolean huge_pages)
+{
+	return get_scratch(&band_scratch, size, huge_pages);
+}
+
+// Parse a list of cores such as "0-3,8,10-11"
+static gboolean
+parse_cores(const gchar *list, gint **cores, gint *n_cores)
+{
+	gchar **parts = g_strsplit(list, ",", -1);
+	GArray *found = g_array_new(FALSE, FALSE, sizeof(gint));
+	gint first, last, c, i;
+	gboolean ok = TRUE;
+
+	for(i=0; parts[i] && ok; i++){
+		if (sscanf(parts[i], "%d-%d", &first, &last) == 2 && first >= 0 && last >= first)
+			for(c=first; c<=last; c++)
+				g_array_append_val(found, c);
+		else if (sscanf(parts[i], "%d", &first) == 1 && first >= 0)
+			g_array_append_val(found, first);
+		else
+			ok = FALSE;
+	}
+	g_strfreev(parts);
+
+	if (!ok || found->len == 0){
+		g_array_free(found, TRUE);
+		return FALSE;
+	}
+
+	*n_cores = found->len;
+	*cores = (gint *)g_array_free(found, FALSE);
+	return TRUE;
+}
+
+void
+binning_pool_configure(gint threads, const gchar *cores)
+{
+	g_mutex_lock(&pool_lock);
+
+	if (pool)
+		g_warning("libbinning: the worker pool is already running, threads and cores are not changed");
+	else{
+		pool_threads = MAX(threads, 0);
+		g_free(pool_cores);
+		pool_cores = NULL;
+		pool_n_cores = 0;
+		if (cores && *cores && !parse_cores(cores, &pool_cores, &pool_n_cores))
+			g_warning("libbinning: can not read the core list '%s', threads are not pinned", cores);
+	}
+
+	g_mutex_unlock(&pool_lock);
+}
+
+static void
+task_unref(PoolTask *task)
+{
+	if (g_atomic_int_dec_and_test(&task->refcount)){
+		g_mutex_clear(&task->lock);
+		g_cond_clear(&task->done);
+		g_free(task);
+	}
+}
+
+// Take items of the task until there are none left
+static void
+task_work(PoolTask *task)
+{
+	gint i;
+
+	g_private_set(&in_task, task);
+	while ((i = g_atomic_int_add(&task->next, 1)) < task->n){
+		task->func(task->data, i);
+
+		g_mutex_lock(&task->lock);
+		if (--task->remaining == 0)
+			g_cond_signal(&task->done);
+		g_mutex_unlock(&task->lock);
+	}
+	g_private_set(&in_task, NULL);
+}
+
+// Pin the calling thread of the pool to the next core of the list
+static void
+pool_pin(void)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	gint core = pool_cores[g_atomic_int_add(&pool_next_core, 1) % pool_n_cores];
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(core, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0)
+		g_debug("libbinning: could not pin a worker to core %d", core);
+#endif
+}
+
+static void
+pool_worker(gpointer data, gpointer user_data)
+{
+	PoolTask *task = data;
+
+	if (pool_cores && !g_private_get(&pinned)){   // the threads are exclusive to the pool, so once is enough
+		pool_pin();
+		g_private_set(&pinned, GINT_TO_POINTER (1));
+	}
+
+	task_work(task);
+	task_unref(task);
+}
+
+static gint
+get_threads(void)
+{
+	return pool_threads > 0 ? pool_threads : (gint)g_get_num_processors();
+}
+
+static GThreadPool *
+get_pool(void)
+{
+	g_mutex_lock(&pool_lock);
+	if (!pool)   // exclusive, so the threads start now, stay for the life of the process and are not shared with other pools
+		pool = g_thread_pool_new(pool_worker, NULL, get_threads(), TRUE, NULL);
+	g_mutex_unlock(&pool_lock);
+
+	return pool;
+}
+
+void
+binning_pool_run(guint n, BinningPoolFunc func, gpointer data)
+{
+	GThreadPool *p;
+	PoolTask *task;
+	guint i, helpers;
+
+	if (n == 0)
+		return;
+
+	if (n == 1 || g_private_get(&in_task)){   // nothing to share, or already one item of a task
+		for(i=0; i<n; i++)
+			func(data, i);
+		return;
+	}
+
+	p = get_pool();
+
+	task = g_new(PoolTask, 1);
+	task->refcount = 1;
+	task->func = func;
+	task->data = data;
+	task->n = n;
+	task->next = 0;
+	task->remaining = n;
+	g_mutex_init(&task->lock);
+	g_cond_init(&task->done);
+
+	// the caller takes items too, so n-1 helpers are enough
+	helpers = MIN(n - 1, (guint)g_thread_pool_get_max_threads(p));
+	for(i=0; i<helpers; i++){
+		g_atomic_int_inc(&task->refcount);
+		g_thread_pool_push(p, task, NULL);
+	}
+
+	task_work(task);
+
+	g_mutex_lock(&task->lock);
+	while (task->remaining > 0)
+		g_cond_wait(&task->done, &task->lock);
+	g_mutex_unlock(&task->lock);
+
+	task_unref(task);   // helpers that come to it later find nothing left and drop theirs
+}
+
+// One frame split into bands of output rows, each binned in the scratch of the thread that takes it.
+// The kernels work in place and read the rows below (and for a bin stride > 1 write above) the ones they write,
+// so a band copies its input rows out, bins them and copies the output rows back. Frame rows written by one band
+// before another has read them are copied to a snapshot first and the reading band takes them from there.
+// The bands may cover only some of the output rows, from j0 to j_end, the rows above are then already binned and
+// never read again, the rows below are left for a later call.
+typedef struct
+{
+	const BinningParams *params;
+	const BinningImage *image;
+	gint s, k;   // binsize and bin stride of the kernel
+	gint out_height;
+	gint j0, j_end;   // the output rows binned
+	gboolean final;   // j_end is out_height, the last band finishes the frame
+	gint rows;   // output rows of each band, the last has the rest
+	gint n;
+	gsize row_bytes;   // bytes of each output row written back
+	gint *snapshot_row;   // for each frame row, its row in the snapshot, or -1 to read it from the frame
+	guint8 *snapshot;
+	BinningStats *stats;   // one for each band, NULL without statistics
+} Bands;
+
+static void
+band_input(const Bands *bands, gint band, gint *first, gint *end)
+{
+	gint j0 = bands->j0 + band * bands->rows;
+	gint j1 = band == bands->n - 1 ? bands->j_end : j0 + bands->rows;
+
+	*first = j0 * bands->k;
+	*end = band == bands->n - 1 && bands->final ? bands->image->height : MIN((j1 - 1) * bands->k + bands->s, bands->image->height);
+}
+
+static gint
+band_of_row(const Bands *bands, gint j)   // the band that writes output row j
+{
+	return MIN((j - bands->j0) / bands->rows, bands->n - 1);
+}
+
+static void
+bin_band(gpointer data, guint index)
+{
+	const Bands *bands = data;
+	const BinningImage *image = bands->image;
+	gint band = index;
+	gint j0 = bands->j0 + band * bands->rows;
+	gint j1, first, end, r, j;
+	gsize stride = image->stride;
+	BinningImage part;
+	guint8 *scratch;
+
+	band_input(bands, band, &first, &end);
+
+	if (image->out){   // the frame is only read, so the band bins straight from it into its rows of the output
+		part = *image;
+		part.data = image->data + first * stride;
+		part.height = end - first;
+		part.stats = bands->stats ? &bands->stats[band] : NULL;
+		part.top = image->top + first;
+		part.out = image->out + (gsize)j0 * image->out_stride;
+		part.frame_width = image->frame_width ? image->frame_width : image->left + image->width;
+		part.frame_height = image->frame_height ? image->frame_height : image->top + image->height;
+		binning_process_image(bands->params, &part);
+		return;
+	}
+
+	// the last band also writes back the bottom rows of a sliding bin frame, which the kernel may have left changed
+	if (band < bands->n - 1)
+		j1 = j0 + bands->rows;
+	else
+		j1 = bands->k == 1 && bands->final ? image->height : bands->j_end;
+
+	scratch = binning_pool_scratch((end - first) * stride, bands->params->huge_pages);
+	for(r=first; r<end; r++){
+		guint8 *dst = scratch + (r - first) * stride;
+
+		if (bands->snapshot_row[r] >= 0){   // written columns from the snapshot, the rest of the row is never written
+			memcpy(dst, bands->snapshot + bands->snapshot_row[r] * bands->row_bytes, bands->row_bytes);
+			memcpy(dst + bands->row_bytes, image->data + r * stride + bands->row_bytes, image->width * 3 - bands->row_bytes);
+		}
+		else
+			memcpy(dst, image->data + r * stride, image->width * 3);
+	}
+
+	part.data = scratch;
+	part.width = image->width;
+	part.height = end - first;
+	part.stride = image->stride;
+	part.stats = bands->stats ? &bands->stats[band] : NULL;
+	part.top = image->top + first;
+	part.left = image->left;
+	part.out = NULL;
+	part.frame_width = image->frame_width ? image->frame_width : image->left + image->width;   // the border is only at the frame edge
+	part.frame_height = image->frame_height ? image->frame_height : image->top + image->height;
+	binning_process_image(bands->params, &part);
+
+	for(j=j0; j<j1; j++)
+		memcpy(image->data + j * stride, scratch + (j - j0) * stride, bands->row_bytes);
+}
+
+// Copy the frame rows that one band writes and another reads, output row j is written to frame row j
+static void
+snapshot_shared_rows(Bands *bands, const BinningImage *image)
+{
+	gint band, first, end, r, snapshot_rows = 0;
+
+	bands->snapshot_row = g_new(gint, image->height);
+	for(r=0; r<image->height; r++)
+		bands->snapshot_row[r] = -1;
+	for(band=0; band<bands->n; band++){
+		band_input(bands, band, &first, &end);
+		for(r=first; r<MIN(end, bands->j_end); r++)
+			if (band_of_row(bands, r) != band && bands->snapshot_row[r] < 0)
+				bands->snapshot_row[r] = snapshot_rows++;
+	}
+	if (bands->k == 1 && bands->final)   // the last band writes every row from its first down
+		for(band=0; band<bands->n-1; band++){
+			band_input(bands, band, &first, &end);
+			for(r=MAX(first, bands->out_height); r<end; r++)
+				if (bands->snapshot_row[r] < 0)
+					bands->snapshot_row[r] = snapshot_rows++;
+		}
+
+	bands->snapshot = get_scratch(&snapshot_scratch, snapshot_rows * bands->row_bytes, bands->params->huge_pages);
+	for(r=0; r<image->height; r++)
+		if (bands->snapshot_row[r] >= 0)
+			memcpy(bands->snapshot + bands->snapshot_row[r] * bands->row_bytes, image->data + (gsize)r * image->stride, bands->row_bytes);
+}
+
+// Bin output rows j0 to j_end-1 in n bands, n may be 1 to bin them on this thread
+static void
+bin_bands(const BinningParams *params, const BinningImage *image, gint out_width, gint out_height, gint j0, gint j_end, gint n)
+{
+	Bands bands;
+	gint s = params->binsize, r, c, i;
+
+	bands.params = params;
+	bands.image = image;
+	bands.s = s;
+	bands.k = params->bin_stride > 0 ? params->bin_stride : (params->resize ? s : 1);
+	bands.out_height = out_height;
+	bands.j0 = j0;
+	bands.j_end = j_end;
+	bands.final = j_end == out_height;
+	bands.n = n;
+	bands.rows = (j_end - j0) / n;
+	bands.row_bytes = bands.k == 1 ? image->width * 3 : out_width * 3;   // sliding bins may change whole rows
+	bands.stats = image->stats ? g_new0(BinningStats, n) : NULL;
+
+	bands.snapshot_row = NULL;
+	if (!image->out)   // a linear output leaves the frame as it is
+		snapshot_shared_rows(&bands, image);
+
+	if (n > 1)
+		binning_pool_run(n, bin_band, &bands);
+	else
+		bin_band(&bands, 0);
+	g_free(bands.snapshot_row);
+
+	if (bands.stats){
+		for(i=0; i<n; i++)
+			for(c=0; c<3; c++)
+				for(r=0; r<256; r++)
+					image->stats->histogram[c][r] += bands.stats[i].histogram[c][r];
+		g_free(bands.stats);
+	}
+}
+
+// Number of bands for rows output rows, two a thread, so a thread slowed down by other work (another pipeline)
+// does not hold up the whole frame
+static gint
+band_count(gint rows)
+{
+	gint n;
+
+	g_mutex_lock(&pool_lock);
+	n = MIN(rows / BAND_MIN_ROWS, get_threads() * 2);
+	g_mutex_unlock(&pool_lock);
+
+	return g_private_get(&in_task) ? 1 : MAX(n, 1);
+}
+
+void
+binning_process_image_parallel(const BinningParams *params, const BinningImage *image)
+{
+	gint s = params->binsize, out_width, out_height, n;
+
+	binning_output_size(params, image->width, image->height, &out_width, &out_height);
+
+	n = band_count(out_height);
+	if (s > image->width || s > image->height || n < 2 ||
+			(BINNING_FORMAT_IS_GRAY(params->format) && !image->out)){
+		binning_process_image(params, image);
+		return;
+	}
+
+	bin_bands(params, image, out_width, out_height, 0, out_height, n);
+}
+
+// Bin the output rows from first_row up to end_row, in bands on the worker pool. The rows above first_row must
+// have been binned already, by earlier calls in order down the frame, output rows from end_row on are left to
+// later calls, so the frame can be passed on in slices as each is binned. Only the call that reaches the last
+// output row finishes the frame below the binned image. The rows are clamped to the output of the frame.
+// With a border the bins along the bottom read rows above their own, which the rows above them are written to,
+// so the call that reaches past the last bin inside the frame bins the rest of it. Returns the output row after
+// the last one binned, where the next call starts.
+gint
+binning_process_image_rows(const BinningParams *params, const BinningImage *image, gint first_row, gint end_row)
+{
+	gint s = params->binsize, out_width, out_height;
+	gint k = params->bin_stride > 0 ? params->bin_stride : (params->resize ? s : 1);
+
+	binning_output_size(params, image->width, image->height, &out_width, &out_height);
+	first_row = MAX(first_row, 0);
+	end_row = MIN(end_row, out_height);
+	if (params->border && end_row > (image->height - s) / k)
+		end_row = out_height;
+	if (s > image->width || s > image->height || first_row >= end_row ||
+			(BINNING_FORMAT_IS_GRAY(params->format) && !image->out))
+		return MAX(first_row, end_row);
+
+	bin_bands(params, image, out_width, out_height, first_row, end_row, band_count(end_row - first_row));
+
+	return end_row;
+}
+
+void
+binning_process_parallel(const BinningParams *params, const guint8 *src, guint8 *dst, gint width, gint height, gint stride, BinningStats *stats)
+{
+	BinningImage image = { dst, width, height, stride, stats, 0, 0, NULL, 0, 0, 0 };
+	gint y;
+
+	g_return_if_fail (!BINNING_FORMAT_IS_GRAY (params->format));   // see binning_process_linear()
+
+	if (src != dst)   // the kernels work in place
+		for (y = 0; y < height; y++)
+			memcpy(dst + (gsize)y * stride, src + (gsize)y * stride, width * 3);
+
+	binning_process_image_parallel(params, &image);
+}
+
+void
+binning_process_linear(const BinningParams *params, const guint8 *src, gint width, gint height, gint stride,
+		guint8 *dst, gint dst_stride, BinningStats *stats)
+{
+	BinningImage image = { (guint8 *)src, width, height, stride, stats, 0, 0, dst, dst_stride, 0, 0 };   // src is only read
+
+	g_return_if_fail (params->output != BINNING_OUTPUT_8BIT);
+
+	binning_process_image_parallel(params, &image);
+}
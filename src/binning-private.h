@@ -0,0 +1,229 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Internals of libbinning, shared by the kernels and the binningfilter element, not installed
+
+#ifndef __BINNING_PRIVATE_H__
+#define __BINNING_PRIVATE_H__
+
+#include "binning.h"
+
+G_BEGIN_DECLS
+
+// Bin in linear intensity space, we expect the camera to have applied a 0.45 gamma
+// So linearise with a 2.22 gamma, bin and then re-gamma with 0.45
+// We create a gamma luts for speed, with integers
+// To apply the 2.22 gamma to the int input value i, use v=gamma[i]
+// To apply the 0.45 gamma to the int calculated value v, use i=inverse_gamma[v]
+#define GAMMA 2.22
+#define OFFSET 0.099   // from Rec. 709 standard
+#define FACTOR 283.02  // Factor to divide input by so that it's never >1 when 0.099 is added
+#define IN_RANGE 256
+#define OUT_RANGE 4096     // an higher bit lut for reverse lookup, 18 bit (262144) guarantees every level preserved, 12 (4096) may be ok
+#define LINEAR_SCALE (65535.0f / (OUT_RANGE - 1))   // from the linear values of the luts to the 16-bit linear output
+
+// Defective pixels as a sorted sparse index, made from the defect map for the frame size of the caps.
+// The columns of the defects in row y are x[row_start[y]] to x[row_start[y+1]-1], in increasing order,
+// so a clean row is found with one compare.
+typedef struct
+{
+	gint refcount;
+	gint height;
+	guint *row_start;   // height+1 entries
+	guint32 *x;
+	guint count;
+} BinningDefects;
+
+// The settings a frame is processed with, made from the properties whenever they change and never modified after that.
+// The streaming thread takes the newest block at the start of each frame, so a frame never sees half of a change
+// and the kernels need no locking. Blacks and contrasts are in buffer order, i.e. b and r already swapped for RGB data.
+// binning_params_new() fills in the binning, the element adds the calibration before the params are shared.
+struct _BinningParams
+{
+	gint refcount;
+
+	BinningAlgorithm algorithm;
+	gint binsize;
+	gboolean resize;
+	gint bin_stride;
+	gdouble clip_sigma;
+	BinningBorder border;
+	gint chroma_factor;   // chroma_weight/(binsize^2) in 16.16 fixed point, the colour differences of a bin sum are scaled by it
+	BinningFormat format;
+	BinningOutput output;
+	gboolean huge_pages;   // frame sized scratch in huge pages
+
+	gint black_r, black_g, black_b;
+	gint contrast_r, contrast_g, contrast_b;
+	gfloat gain_r, gain_g, gain_b;   // contrast/100, or 1/binsize^2 for averaging (contrast=-1)
+
+	const double *forward_gamma;   // the luts of binning_gamma_luts(), made once and never freed
+	const unsigned int *inverse_gamma;
+
+	// Per pixel calibration, frames of the same size and byte order as the video, NULL when not used, set by the element
+	GMappedFile *dark_file, *flat_file;   // reffed, so the data stays mapped while the params are in use
+	const guint8 *dark, *flat;
+	gfloat flat_gain[3][IN_RANGE];   // gain for each flat field value, in buffer order
+	BinningDefects *defects;   // reffed, pixels left out of the bins, NULL if there are none
+
+	gboolean corrected;   // any of the above, rgb binning then goes through the stride engine
+};
+
+typedef struct {
+	guint8 b, g, r;
+} bgr_pixel;
+
+// The image a kernel works on, in place, the binned image is built up in the top left
+typedef struct
+{
+	guint8 *data;
+	gint width, height;   // image size
+	gint stride;   // bytes to next line
+	BinningStats *stats;   // histograms of the output are added here, NULL if not wanted
+	gint top, left;   // pixel of the whole frame that the image starts at, for the per pixel calibration, 0 for a whole frame.
+	                  // A part of a frame keeps the stride of the frame, the calibration frames are indexed with it.
+	guint8 *out;   // the 16-bit linear output of params->output, NULL to bin in place. The input is then only read.
+	gint out_stride;
+	gint frame_width, frame_height;   // size of the whole frame, the border is only binned at its edges, 0 for a whole frame
+} BinningImage;
+
+// Whether the right and bottom of the image are those of the frame, where params->border applies
+#define BINNING_IMAGE_RIGHT_EDGE(image) (!(image)->frame_width || (image)->left + (image)->width >= (image)->frame_width)
+#define BINNING_IMAGE_BOTTOM_EDGE(image) (!(image)->frame_height || (image)->top + (image)->height >= (image)->frame_height)
+
+// The pixels that clamp and mirror borders read, copied before an in-place kernel can write over them,
+// see binning_border_copy()
+typedef struct
+{
+	const bgr_pixel *rows;   // rows height-s to height-1, width pixels each, NULL without a bottom border
+	const bgr_pixel *cols;   // columns width-s to width-1 of every row, s pixels each, NULL without a right border
+	gint s, width, height;
+} BinningBorderCopy;
+
+// The row or column inside the image that position i, past its end at size, reads with a clamp or mirror border.
+// With size >= binsize it is always one of the last binsize, which the copy holds.
+static inline gint
+binning_border_index(BinningBorder border, gint i, gint size)
+{
+	return border == BINNING_BORDER_MIRROR ? 2 * (size - 1) - i : size - 1;
+}
+
+// The pixel that (x, y) of a clamp or mirror border reads, (x, y) may also be inside the image
+static inline const bgr_pixel *
+binning_border_pixel(const BinningImage *image, const BinningBorderCopy *copy, BinningBorder border, gint x, gint y)
+{
+	if (x >= copy->width)
+		x = binning_border_index(border, x, copy->width);
+	if (y >= copy->height){
+		y = binning_border_index(border, y, copy->height);
+		return copy->rows + (gsize)(y - (copy->height - copy->s)) * copy->width + x;
+	}
+	if (x >= copy->width - copy->s && copy->cols)
+		return copy->cols + (gsize)y * copy->s + x - (copy->width - copy->s);
+	return (const bgr_pixel *)image->data + (gsize)(image->stride / 3) * y + x;
+}
+
+// A task for the worker pool, called once for each index from 0 to n-1
+typedef void (*BinningPoolFunc)(gpointer data, guint index);
+
+void binning_gamma_luts(const double **forward_gamma, const unsigned int **inverse_gamma);
+BinningDefects *binning_defects_ref(BinningDefects *defects);
+void binning_defects_unref(BinningDefects *defects);
+
+void binning_process_image(const BinningParams *params, const BinningImage *image);
+void binning_process_image_parallel(const BinningParams *params, const BinningImage *image);
+gint binning_process_image_rows(const BinningParams *params, const BinningImage *image, gint first_row, gint end_row);
+void binning_pool_run(guint n, BinningPoolFunc func, gpointer data);
+guint8 *binning_pool_scratch(gsize size, gboolean huge_pages);
+void binning_image_rgb(const BinningParams *params, const BinningImage *image);
+void binning_resize_image_rgb(const BinningParams *params, const BinningImage *image);
+void binning_stride_image_rgb(const BinningParams *params, const BinningImage *image, gint bin_stride);
+void binning_robust_image_rgb(const BinningParams *params, const BinningImage *image, gint bin_stride);
+void binning_gray_image(const BinningParams *params, const BinningImage *image, gint bin_stride);
+void binning_border_copy(const BinningImage *image, gint s, gboolean right, gboolean bottom, BinningBorderCopy *copy);
+void binning_stats_add_image(BinningStats *stats, guint8 *img_ptr, gint width, gint height, gint pitch);
+
+// Add an output pixel to the statistics, if they are being gathered
+#define BINNING_STATS_ADD(stats, p) do { if (stats) { \
+		(stats)->histogram[0][(p)->b]++; (stats)->histogram[1][(p)->g]++; (stats)->histogram[2][(p)->r]++; } } while (0)
+
+// Write one binned pixel to the 16-bit linear output, from its linear values v in buffer order (b, g, r for BGR data).
+// The statistics are of the 8-bit pixel that the gamma encoded output would have had.
+static inline void
+binning_store_linear(const BinningParams *params, guint16 *out, gfloat v0, gfloat v1, gfloat v2, BinningStats *stats)
+{
+	gfloat limit = OUT_RANGE - 1;   // as the 8-bit output is clipped
+	gfloat r, b, y;
+
+	v0 = CLAMP(v0, 0, limit);
+	v1 = CLAMP(v1, 0, limit);
+	v2 = CLAMP(v2, 0, limit);
+	r = params->format == BINNING_FORMAT_RGB ? v0 : v2;
+	b = params->format == BINNING_FORMAT_RGB ? v2 : v0;
+
+	if (params->output == BINNING_OUTPUT_GRAY16){
+		y = MIN(0.2126f * r + 0.7152f * v1 + 0.0722f * b, limit);   // Rec. 709 luminance, of the linear values
+		out[0] = GUINT16_TO_LE((guint16)(y * LINEAR_SCALE + 0.5f));
+		if (stats){
+			guint8 i = params->inverse_gamma[(unsigned int)y];
+			stats->histogram[0][i]++; stats->histogram[1][i]++; stats->histogram[2][i]++;
+		}
+		return;
+	}
+
+	out[0] = GUINT16_TO_LE((guint16)(r * LINEAR_SCALE + 0.5f));
+	out[1] = GUINT16_TO_LE((guint16)(v1 * LINEAR_SCALE + 0.5f));
+	out[2] = GUINT16_TO_LE((guint16)(b * LINEAR_SCALE + 0.5f));
+	out[3] = 0xFFFF;   // opaque
+	if (stats){
+		stats->histogram[0][params->inverse_gamma[(unsigned int)v0]]++;
+		stats->histogram[1][params->inverse_gamma[(unsigned int)v1]]++;
+		stats->histogram[2][params->inverse_gamma[(unsigned int)v2]]++;
+	}
+}
+
+#define SWAP(x, y) do { typeof(x) SWAP = x; x = y; y = SWAP; } while (0)
+
+G_END_DECLS
+
+#endif /* __BINNING_PRIVATE_H__ */
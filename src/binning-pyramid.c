@@ -0,0 +1,229 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_pyramid_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_pyramid_debug
+
+// Work out the caps of each pyramid level from the input caps, level n is reduced by 2^n
+void
+gst_binningfilter_pyramid_set_caps(Gstbinningfilter *filter, GstCaps *caps)
+{
+	gint level;
+
+	for(level=1; level<=PYRAMID_MAX_LEVELS; level++){
+		gint width = MAX(filter->width >> level, 1);
+		gint height = MAX(filter->height >> level, 1);
+
+		if (filter->pyramid_caps[level])
+			gst_caps_unref(filter->pyramid_caps[level]);
+
+		filter->pyramid_caps[level] = gst_caps_copy(caps);
+		gst_caps_set_simple(filter->pyramid_caps[level],
+				"width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+		gst_video_info_from_caps(&filter->pyramid_info[level], filter->pyramid_caps[level]);
+	}
+}
+
+// Write the binned image of one level from its sums, FALSE if the buffer could not be mapped
+static gboolean
+write_level(const BinningParams *params, GstBuffer *out, GstVideoInfo *info, guint32 *sums,
+		gfloat gain_r, gfloat gain_g, gfloat gain_b)
+{
+	gint x, y;
+	bgr_pixel *out_ptr;
+	GstMapInfo minfo;
+	const unsigned int *inverse_gamma = params->inverse_gamma;
+	unsigned int out_limit = OUT_RANGE - 1;
+	gint width = GST_VIDEO_INFO_WIDTH(info);
+	gint height = GST_VIDEO_INFO_HEIGHT(info);
+	gint out_stride = GST_VIDEO_INFO_PLANE_STRIDE(info, 0);
+
+	if (!gst_buffer_map (out, &minfo, GST_MAP_WRITE))
+		return FALSE;
+
+	for(y=0; y<height; y++){
+		out_ptr = (bgr_pixel *)(minfo.data + out_stride * y); // ptr to start of line
+		for(x=0; x<width; x++){
+			out_ptr->b = inverse_gamma[(unsigned int)CLAMP(sums[0]*gain_b, 0, out_limit)];
+			out_ptr->g = inverse_gamma[(unsigned int)CLAMP(sums[1]*gain_g, 0, out_limit)];
+			out_ptr->r = inverse_gamma[(unsigned int)CLAMP(sums[2]*gain_r, 0, out_limit)];
+			sums+=3;
+			out_ptr++;
+		}
+	}
+
+	gst_buffer_unmap (out, &minfo);
+	return TRUE;
+}
+
+// Make the reduced images for the levels set in the 'wanted' bitmask from one read of the input frame.
+// Level 1 sums 2x2 linearised input pixels, each further level sums 2x2 of the sums of the level before,
+// so all the levels together cost about 1.33x a single 2x2 binning.
+// Must be called before the input is binned in-place. New buffers are returned in levels[].
+// A frame or level that can not be mapped posts an error and returns GST_FLOW_ERROR, with no levels.
+GstFlowReturn
+gst_bin_pyramid_image_rgb(Gstbinningfilter *filter, const BinningParams *params, GstBuffer *buf, guint wanted, GstBuffer **levels)
+{
+	gint x, y, c, level, max_level = 0;
+	bgr_pixel *ptr;
+	GstMapInfo minfo;
+	guint32 *sums[PYRAMID_MAX_LEVELS+1];
+	gsize size = 0;
+
+	const double *forward_gamma = params->forward_gamma;
+	gint in_limit = IN_RANGE - 1;  // signed, so that CLAMP catches values below the black level
+
+	for(level=1; level<=PYRAMID_MAX_LEVELS; level++){
+		levels[level] = NULL;
+		if (wanted & (1 << level))
+			max_level = level;
+	}
+
+	// no level can be smaller than a pixel
+	while (max_level > 0 && ((filter->width >> max_level) < 1 || (filter->height >> max_level) < 1))
+		max_level--;
+
+	if (max_level == 0)
+		return GST_FLOW_OK;
+
+	// scratch for the sums of all the levels up to the highest wanted
+	for(level=1; level<=max_level; level++)
+		size += (gsize)(filter->width >> level) * (filter->height >> level) * 3;
+	if (filter->pyramid_sums_size < size){
+		binning_memory_free(filter->pyramid_sums);
+		filter->pyramid_sums = binning_memory_alloc(size * sizeof(guint32), params->huge_pages);
+		filter->pyramid_sums_size = size;
+	}
+	sums[1] = filter->pyramid_sums;
+	for(level=2; level<=max_level; level++)
+		sums[level] = sums[level-1] + (gsize)(filter->width >> (level-1)) * (filter->height >> (level-1)) * 3;
+
+    gint black_r = params->black_r, black_g = params->black_g, black_b = params->black_b;   // black levels, already swapped for RGB data
+    gint contrast_r = params->contrast_r, contrast_g = params->contrast_g, contrast_b = params->contrast_b;
+
+	gint pitch = filter->stride / 3;  // want the number of pixels to next line
+
+	// Level 1 from the input
+	if (!gst_buffer_map (buf, &minfo, GST_MAP_READ)){
+		GST_ELEMENT_ERROR (filter, RESOURCE, READ, ("Could not map the frame for the pyramid."), (NULL));
+		return GST_FLOW_ERROR;
+	}
+	{
+		gint width = filter->width >> 1, height = filter->height >> 1;
+		guint32 *out = sums[1];
+
+		for(y=0; y<height; y++){
+			ptr = (bgr_pixel *)minfo.data + pitch * 2 * y; // ptr to start of line pair
+			for(x=0; x<width; x++){
+				out[0] = forward_gamma[CLAMP(ptr->b - black_b, 0, in_limit)] + forward_gamma[CLAMP((ptr+1)->b - black_b, 0, in_limit)] +
+						forward_gamma[CLAMP((ptr+pitch)->b - black_b, 0, in_limit)] + forward_gamma[CLAMP((ptr+pitch+1)->b - black_b, 0, in_limit)];
+				out[1] = forward_gamma[CLAMP(ptr->g - black_g, 0, in_limit)] + forward_gamma[CLAMP((ptr+1)->g - black_g, 0, in_limit)] +
+						forward_gamma[CLAMP((ptr+pitch)->g - black_g, 0, in_limit)] + forward_gamma[CLAMP((ptr+pitch+1)->g - black_g, 0, in_limit)];
+				out[2] = forward_gamma[CLAMP(ptr->r - black_r, 0, in_limit)] + forward_gamma[CLAMP((ptr+1)->r - black_r, 0, in_limit)] +
+						forward_gamma[CLAMP((ptr+pitch)->r - black_r, 0, in_limit)] + forward_gamma[CLAMP((ptr+pitch+1)->r - black_r, 0, in_limit)];
+				out+=3;
+				ptr+=2;
+			}
+		}
+	}
+	gst_buffer_unmap (buf, &minfo);
+
+	// Each further level from the sums of the one before
+	for(level=2; level<=max_level; level++){
+		gint in_width = filter->width >> (level-1);
+		gint width = filter->width >> level, height = filter->height >> level;
+		guint32 *out = sums[level];
+
+		for(y=0; y<height; y++){
+			guint32 *in = sums[level-1] + (gsize)in_width * 3 * 2 * y;  // start of line pair
+			for(x=0; x<width; x++){
+				for(c=0; c<3; c++)
+					out[c] = in[c] + in[c+3] + in[in_width*3+c] + in[in_width*3+c+3];
+				out+=3;
+				in+=6;
+			}
+		}
+	}
+
+	for(level=1; level<=max_level; level++){
+		GstVideoInfo *info = &filter->pyramid_info[level];
+		gint n = 1 << (2*level);   // pixels summed in each bin
+
+		if (!(wanted & (1 << level)))
+			continue;
+
+		gfloat gain_r = contrast_r < 0 ? 1.0f / n : contrast_r / 100.0f;    // contrast=-1 => averaging, as for the other algorithms
+		gfloat gain_g = contrast_g < 0 ? 1.0f / n : contrast_g / 100.0f;
+		gfloat gain_b = contrast_b < 0 ? 1.0f / n : contrast_b / 100.0f;
+
+		levels[level] = gst_buffer_new_allocate(NULL, GST_VIDEO_INFO_SIZE(info), NULL);
+		gst_buffer_copy_into(levels[level], buf, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+		if (!write_level(params, levels[level], info, sums[level], gain_r, gain_g, gain_b)){
+			GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, ("Could not map pyramid level %d.", level), (NULL));
+			for(level=1; level<=max_level; level++)
+				gst_buffer_replace(&levels[level], NULL);
+			return GST_FLOW_ERROR;
+		}
+	}
+
+	return GST_FLOW_OK;
+}
+
+void
+gst_binningfilter_pyramid_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_pyramid_debug, "binningfilter",
+			1, "binningfilter pyramid");
+}
@@ -58,72 +58,238 @@
 #  include <config.h>
 #endif
 
-#include <gst/gst.h>
-#include <gst/video/video.h>
+#include <glib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
 
-#include "gstbinningfilter.h"
+#include "binning-private.h"
 
-GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_RGBresize_debug);
-#define GST_CAT_DEFAULT gst_binningfilter_RGBresize_debug
+// Power of two binsizes are resized by a cascade of 2x2 halvings. For each output row the first stage sums 2x2 input
+// pixels into 16-bit sums, and each further stage sums 2x2 of the stage before, so every input pixel is read once and
+// there is no rounding between the stages, the sums are those of adding up the whole bin. All the stages are the same
+// 2x2 kernel, in blocks of a fixed number of pixels, which the compiler turns into vector code.
+
+#define CASCADE_MAX_BINSIZE 16   // the sum of 16x16 8-bit values fits in 16 bits
+#define CASCADE_MAX_STAGES 4
+
+typedef struct
+{
+	gsize size;   // number of guint16 in data
+	guint16 data[];
+} CascadeScratch;
+
+static GPrivate cascade_scratch = G_PRIVATE_INIT (g_free);
+
+static guint16 *
+get_scratch(gsize size)
+{
+	CascadeScratch *scratch = g_private_get(&cascade_scratch);
+
+	if (!scratch || scratch->size < size){
+		scratch = g_malloc(sizeof(CascadeScratch) + size * sizeof(guint16));
+		scratch->size = size;
+		g_private_replace(&cascade_scratch, scratch);   // frees the old one
+	}
+
+	return scratch->data;
+}
+
+#define HALVE_BLOCK 16   // output pixels of each block, a fixed count so that the loops vectorise
+
+// Sum 2x2 pixels of rows a and b into out, which is width pixels wide.
+// In blocks, the two rows are added, then the pairs of pixels of the block, the rest of the row one at a time.
+static void
+halve_row_u8(const guint8 *a, const guint8 *b, guint16 *out, gint width)
+{
+	guint16 v[HALVE_BLOCK * 6];
+	gint x0, i, x, c;
+
+	for(x0=0; x0+HALVE_BLOCK<=width; x0+=HALVE_BLOCK, a+=HALVE_BLOCK*6, b+=HALVE_BLOCK*6, out+=HALVE_BLOCK*3){
+		for(i=0; i<HALVE_BLOCK*6; i++)
+			v[i] = a[i] + b[i];
+		for(i=0; i<HALVE_BLOCK; i++){
+			out[3*i] = v[6*i] + v[6*i+3];
+			out[3*i+1] = v[6*i+1] + v[6*i+4];
+			out[3*i+2] = v[6*i+2] + v[6*i+5];
+		}
+	}
+	for(x=0; x<width-x0; x++)
+		for(c=0; c<3; c++)
+			out[3*x+c] = a[6*x+c] + a[6*x+3+c] + b[6*x+c] + b[6*x+3+c];
+}
+
+// The same for the 16-bit sums of the stage before
+static void
+halve_row_u16(const guint16 *a, const guint16 *b, guint16 *out, gint width)
+{
+	guint16 v[HALVE_BLOCK * 6];
+	gint x0, i, x, c;
+
+	for(x0=0; x0+HALVE_BLOCK<=width; x0+=HALVE_BLOCK, a+=HALVE_BLOCK*6, b+=HALVE_BLOCK*6, out+=HALVE_BLOCK*3){
+		for(i=0; i<HALVE_BLOCK*6; i++)
+			v[i] = a[i] + b[i];
+		for(i=0; i<HALVE_BLOCK; i++){
+			out[3*i] = v[6*i] + v[6*i+3];
+			out[3*i+1] = v[6*i+1] + v[6*i+4];
+			out[3*i+2] = v[6*i+2] + v[6*i+5];
+		}
+	}
+	for(x=0; x<width-x0; x++)
+		for(c=0; c<3; c++)
+			out[3*x+c] = a[6*x+c] + a[6*x+3+c] + b[6*x+c] + b[6*x+3+c];
+}
+
+// Resize by a power of two binsize, the bins are as those of the loops for the other binsizes, width/binsize across
+static void
+resize_cascade(const BinningParams *params, const BinningImage *image)
+{
+	gint s = params->binsize, n = s * s;
+	gint stages, stage, r, x, out_y, val;
+	gint out_width = image->width / s, out_height = image->height / s;
+	gint stride = image->stride;
+	gint black_r = params->black_r, black_g = params->black_g, black_b = params->black_b;
+	gfloat gain_r = params->gain_r, gain_g = params->gain_g, gain_b = params->gain_b;
+	BinningStats *stats = image->stats;
+	guint16 *rows[CASCADE_MAX_STAGES+1], *sums;   // the sums of each stage, s >> stage rows of width >> stage pixels
+	gsize size = 0;
+	bgr_pixel *out_ptr;
+	const guint8 *in;
+
+	for(stages=0; (1 << stages) < s; stages++)
+		size += (gsize)(s >> (stages + 1)) * (image->width >> (stages + 1)) * 3;
+	rows[1] = get_scratch(size);
+	for(stage=2; stage<=stages; stage++)
+		rows[stage] = rows[stage-1] + (gsize)(s >> (stage - 1)) * (image->width >> (stage - 1)) * 3;
+
+	// output row out_y is written after its input rows, from out_y*s down, have been read, so in-place is safe
+	for(out_y=0; out_y<out_height; out_y++){
+		in = image->data + (gsize)out_y * s * stride;
+		for(r=0; r<s/2; r++)
+			halve_row_u8(in + (gsize)2*r * stride, in + (gsize)(2*r+1) * stride, rows[1] + (gsize)r * (image->width >> 1) * 3, image->width >> 1);
+		for(stage=2; stage<=stages; stage++){
+			gsize in_row = (gsize)(image->width >> (stage - 1)) * 3;
+			gsize out_row = (gsize)(image->width >> stage) * 3;
+
+			for(r=0; r<s>>stage; r++)
+				halve_row_u16(rows[stage-1] + 2*r * in_row, rows[stage-1] + (2*r+1) * in_row, rows[stage] + r * out_row, image->width >> stage);
+		}
+
+		sums = rows[stages];
+		out_ptr = (bgr_pixel *)(image->data + (gsize)out_y * stride);
+		for(x=0; x<out_width; x++){
+			// Use 'val' to limit the result without over or under flowing
+			val = sums[0] - n*black_b;
+			out_ptr->b = MIN(255, MAX(0,val*gain_b));
+			val = sums[1] - n*black_g;
+			out_ptr->g = MIN(255, MAX(0,val*gain_g));
+			val = sums[2] - n*black_r;
+			out_ptr->r = MIN(255, MAX(0,val*gain_r));
+
+			BINNING_STATS_ADD(stats, out_ptr);
+			sums += 3;
+			out_ptr++;
+		}
+	}
+}
+
+// The bins of a border, those past the last whole bin along the right and the bottom, summed in the same
+// gamma encoded values as the other bins. Their pixels are read from the copy taken before the image was written,
+// or are never written over, see binning_resize_image_rgb(). A partial border scales each bin up by n/(pixels binned).
+static void
+resize_border(const BinningParams *params, const BinningImage *image, const BinningBorderCopy *copy,
+		gboolean right, gboolean bottom)
+{
+	gint s = params->binsize, n = s * s;
+	gint full_width = image->width / s, full_height = image->height / s;
+	gint out_width = full_width + (right ? 1 : 0);
+	gint pitch = image->stride / 3;
+	gint black_r = params->black_r, black_g = params->black_g, black_b = params->black_b;
+	gfloat gain_r = params->gain_r, gain_g = params->gain_g, gain_b = params->gain_b;
+	gboolean partial = params->border == BINNING_BORDER_PARTIAL;
+	BinningStats *stats = image->stats;
+	gint out_x, out_y, x, y, i, j, binned;
+	gint sum[3];
+	gfloat w;
+	const bgr_pixel *ptr;
+	bgr_pixel *out_ptr;
+
+	for(out_y=0; out_y<full_height+(bottom ? 1 : 0); out_y++){
+		for(out_x=out_y<full_height ? full_width : 0; out_x<out_width; out_x++){   // the right column, then the whole bottom row
+			sum[0] = sum[1] = sum[2] = 0;
+			binned = 0;
+			for(i=0; i<s; i++){
+				y = out_y * s + i;
+				for(j=0; j<s; j++){
+					x = out_x * s + j;
+					if (partial && (x >= image->width || y >= image->height))
+						continue;
+					ptr = binning_border_pixel(image, copy, params->border, x, y);
+					sum[0] += ptr->b;
+					sum[1] += ptr->g;
+					sum[2] += ptr->r;
+					binned++;
+				}
+			}
+			w = (gfloat)n / binned;   // 1 unless partial
+
+			out_ptr = (bgr_pixel *)image->data + pitch * out_y + out_x;
+			out_ptr->b = MIN(255, MAX(0, (sum[0]*w - n*black_b)*gain_b));
+			out_ptr->g = MIN(255, MAX(0, (sum[1]*w - n*black_g)*gain_g));
+			out_ptr->r = MIN(255, MAX(0, (sum[2]*w - n*black_r)*gain_r));
+
+			BINNING_STATS_ADD(stats, out_ptr);
+		}
+	}
+}
 
 void
-gst_bin_resize_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
+binning_resize_image_rgb(const BinningParams *params, const BinningImage *image)
 {
 	gint count=0;
 	gint x, y, out_y, i, j, val;
 	bgr_pixel *ptr=NULL, *out_ptr;
-	GstMapInfo minfo;
+	BinningStats *stats = image->stats;   // NULL unless statistics are wanted
 
 	// ***********************************
 	// binning the pixels from 24-bit BGR data
 	// to do this in-place, always gather pixels from below and right
 
-	// Access the buffer - READ AND WRITE
-	gst_buffer_map (buf, &minfo, GST_MAP_READWRITE);
-
-    gint black_r, black_g, black_b;   // RGB black levels that will be subtracted from each pixel
-    gint contrast_r, contrast_g, contrast_b;   // RGB contrast values that will be applied to the summed/binned data
-
-	if(filter->format_is_RGB){  // default is BGR, so swap black and contrast b for r
-		black_r = filter->black_b; black_g = filter->black_g; black_b = filter->black_r;
-		contrast_r = filter->contrast_b; contrast_g = filter->contrast_g; contrast_b = filter->contrast_r;
-	}
-	else{
-		black_r = filter->black_r; black_g = filter->black_g; black_b = filter->black_b;
-		contrast_r = filter->contrast_r; contrast_g = filter->contrast_g; contrast_b = filter->contrast_b;
-	}
+    gint black_r = params->black_r, black_g = params->black_g, black_b = params->black_b;   // black levels, already swapped for RGB data
 
 	gint start_y = 0;
-	gint stop_y  = filter->height;
+	gint stop_y  = image->height;
 	gint start_x = 0;
-	gint stop_x  = filter->width;
-	gint step = filter->binsize;
-
-	guint8 *img_ptr = minfo.data;
-	gint pitch = filter->stride / 3;  // want the number of pixels to next line
+	gint stop_x  = image->width;
+	gint step = params->binsize;
 
-	gfloat gain_r = contrast_r / 100.0f;    // convert contrast values into real gain factors, contrast=100 => gain=1 => normal summed binning
-	gfloat gain_g = contrast_g / 100.0f;
-	gfloat gain_b = contrast_b / 100.0f;
+	guint8 *img_ptr = image->data;
+	gint pitch = image->stride / 3;  // want the number of pixels to next line
 
-	// Check for the special contrast value (-1) to do averaging rather than binning, gain here is dependent in the bin size.
-	if (contrast_r < 0)
-		gain_r = 1.0f / (filter->binsize*filter->binsize);
-	if (contrast_g < 0)
-		gain_g = 1.0f / (filter->binsize*filter->binsize);
-	if (contrast_b < 0)
-		gain_b = 1.0f / (filter->binsize*filter->binsize);
+	gfloat gain_r = params->gain_r, gain_g = params->gain_g, gain_b = params->gain_b;   // contrast/100, or 1/binsize^2 for averaging (contrast=-1)
 
 //	GST_DEBUG_OBJECT (filter, "Gains: %.3f %.3f %.3f, Blacks: %d %d %d", gain_r, gain_g, gain_b, black_r, black_g, black_b);
 
-	if (filter->binsize == 1){  // no binning here but may want to contrast stretch and apply black levels
+	// With params->border there is also a bin at the right and bottom where the image is not a whole number of bins,
+	// as binning_output_size() counts them. Those bins are done after the others, by resize_border().
+	// Their pixels at the right, and those that a clamp or mirror border repeats, may be written over by then,
+	// they are copied first. The rows of the bottom bins are below any output row, so they are read as they are.
+	gint s = params->binsize;
+	gboolean right = params->border && s > 1 && image->width % s && BINNING_IMAGE_RIGHT_EDGE(image);
+	gboolean bottom = params->border && s > 1 && image->height % s && BINNING_IMAGE_BOTTOM_EDGE(image);
+	BinningBorderCopy copy = { NULL, NULL, s, image->width, image->height };   // nothing copied, for a partial border
+
+	if (s > image->width || s > image->height)
+		right = bottom = FALSE;   // too small to bin, as binning_output_size()
+	if ((right || bottom) && params->border != BINNING_BORDER_PARTIAL)
+		binning_border_copy(image, s, right, bottom, &copy);
+
+	if (params->binsize == 1){  // no binning here but may want to contrast stretch and apply black levels
 
 		if(gain_r==1.0f && gain_g==1.0f && gain_b==1.0f &&
 				black_r==0 && black_g==0 && black_b==0){     // Just check that we have to do anything at all, if not return.
-			gst_buffer_unmap (buf, &minfo);
+			if (stats)   // image is unchanged but the statistics are still wanted
+				binning_stats_add_image(stats, image->data, image->width, image->height, image->stride / 3);
 			return;
 		}
 
@@ -139,36 +305,18 @@ gst_bin_resize_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 				val = ptr->r - black_r;
 				ptr->r = MIN(255, MAX(0,val*gain_r));
 
+				BINNING_STATS_ADD(stats, ptr);
 				count++; // pixel count
 				ptr++;  // next pixel, 3 bytes on
 			}
 		}
 	}
-	else if (filter->binsize == 2){  // fast implementation for 2x2
-		stop_y  = filter->height-1;
-		stop_x  = filter->width-1;
-		for(y=start_y, out_y=0; y<stop_y; y+=step, out_y++){
-			ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
-			out_ptr = (bgr_pixel *)img_ptr + pitch * out_y; // ptr to start of line
-			for(x=start_x; x<stop_x; x+=step){
-
-				// Use 'val' to limit the result without over or under flowing
-				val = ptr->b + (ptr+1)->b + (ptr+pitch)->b + (ptr+pitch+1)->b - 4*black_b;
-				out_ptr->b = MIN(255, MAX(0,val*gain_b));
-				val = ptr->g + (ptr+1)->g + (ptr+pitch)->g + (ptr+pitch+1)->g - 4*black_g;
-				out_ptr->g = MIN(255, MAX(0,val*gain_g));
-				val = ptr->r + (ptr+1)->r + (ptr+pitch)->r + (ptr+pitch+1)->r - 4*black_r;
-				out_ptr->r = MIN(255, MAX(0,val*gain_r));
-
-				count++; // pixel count
-				ptr+=step;  // next pixel, 3 bytes on
-				out_ptr++;
-			}
-		}
+	else if (params->binsize <= CASCADE_MAX_BINSIZE && (params->binsize & (params->binsize - 1)) == 0){   // 2 and 4
+		resize_cascade(params, image);
 	}
-	else if (filter->binsize == 3){  // fast implementation for 3x3
-		stop_y  = filter->height-2;
-		stop_x  = filter->width-2;
+	else if (params->binsize == 3){  // fast implementation for 3x3
+		stop_y  = image->height-2;
+		stop_x  = image->width-2;
 		for(y=start_y, out_y=0; y<stop_y; y+=step, out_y++){
 			ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
 			out_ptr = (bgr_pixel *)img_ptr + pitch * out_y; // ptr to start of line
@@ -188,37 +336,7 @@ gst_bin_resize_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 						(ptr+2*pitch)->r + (ptr+2*pitch+1)->r + (ptr+2*pitch+2)->r - 9*black_r;
 				out_ptr->r = MIN(255, MAX(0,val*gain_r));
 
-				count++; // pixel count
-				ptr+=step;  // next pixel, 3 bytes on
-				out_ptr++;
-			}
-		}
-	}
-	else if (filter->binsize == 4){  // fast implementation for 4x4
-		stop_y  = filter->height-3;
-		stop_x  = filter->width-3;
-		for(y=start_y, out_y=0; y<stop_y; y+=step, out_y++){
-			ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
-			out_ptr = (bgr_pixel *)img_ptr + pitch * out_y; // ptr to start of line
-			for(x=start_x; x<stop_x; x+=step){
-
-				// Use 'val' to limit the result without over or under flowing
-				val = ptr->b + (ptr+1)->b  + (ptr+2)->b + (ptr+3)->b +
-						(ptr+pitch)->b + (ptr+pitch+1)->b + (ptr+pitch+2)->b + (ptr+pitch+3)->b +
-						(ptr+2*pitch)->b + (ptr+2*pitch+1)->b + (ptr+2*pitch+2)->b + (ptr+2*pitch+3)->b +
-						(ptr+3*pitch)->b + (ptr+3*pitch+1)->b + (ptr+3*pitch+2)->b + (ptr+3*pitch+3)->b + - 16*black_b;
-				out_ptr->b = MIN(255, MAX(0,val*gain_b));
-				val = ptr->g + (ptr+1)->g  + (ptr+2)->g + (ptr+3)->g +
-						(ptr+pitch)->g + (ptr+pitch+1)->g + (ptr+pitch+2)->g + (ptr+pitch+3)->g +
-						(ptr+2*pitch)->g + (ptr+2*pitch+1)->g + (ptr+2*pitch+2)->g + (ptr+2*pitch+3)->g +
-						(ptr+3*pitch)->g + (ptr+3*pitch+1)->g + (ptr+3*pitch+2)->g + (ptr+3*pitch+3)->g + - 16*black_g;
-				out_ptr->g = MIN(255, MAX(0,val*gain_g));
-				val = ptr->r + (ptr+1)->r  + (ptr+2)->r + (ptr+3)->r +
-						(ptr+pitch)->r + (ptr+pitch+1)->r + (ptr+pitch+2)->r + (ptr+pitch+3)->r +
-						(ptr+2*pitch)->r + (ptr+2*pitch+1)->r + (ptr+2*pitch+2)->r + (ptr+2*pitch+3)->r +
-						(ptr+3*pitch)->r + (ptr+3*pitch+1)->r + (ptr+3*pitch+2)->r + (ptr+3*pitch+3)->r + - 16*black_r;
-				out_ptr->r = MIN(255, MAX(0,val*gain_r));
-
+				BINNING_STATS_ADD(stats, out_ptr);
 				count++; // pixel count
 				ptr+=step;  // next pixel, 3 bytes on
 				out_ptr++;
@@ -226,9 +344,9 @@ gst_bin_resize_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 		}
 	}
 	else{  // generic implementation
-		gint s = filter->binsize, valr, valg, valb;
-		stop_y  = filter->height-s;
-		stop_x  = filter->width-s;
+		gint valr, valg, valb;
+		stop_y  = image->height-s+1;   // the last bin starts s-1 from the edge, as for the fixed sizes
+		stop_x  = image->width-s+1;
 		for(y=start_y, out_y=0; y<stop_y; y+=step, out_y++){
 			ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
 			out_ptr = (bgr_pixel *)img_ptr + pitch * out_y; // ptr to start of line
@@ -250,6 +368,7 @@ gst_bin_resize_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 				out_ptr->g = MIN(255, MAX(0,valg*gain_g));
 				out_ptr->r = MIN(255, MAX(0,valr*gain_r));
 
+				BINNING_STATS_ADD(stats, out_ptr);
 				count++; // pixel count
 				ptr+=step;  // next pixel, 3 bytes on
 				out_ptr++;
@@ -257,13 +376,6 @@ gst_bin_resize_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 		}
 	}
 
-	gst_buffer_unmap (buf, &minfo);
-}
-
-
-void
-gst_binningfilter_rgbresize_init(void)
-{
-	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_RGBresize_debug, "binningfilter",
-			1, "binningfilter RGBresiz");
+	if (right || bottom)
+		resize_border(params, image, &copy, right, bottom);
 }
@@ -58,78 +58,57 @@
 #  include <config.h>
 #endif
 
-#include <gst/gst.h>
-#include <gst/video/video.h>
+#include <glib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
 
-#include "gstbinningfilter.h"
-
-GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_RGB_debug);
-#define GST_CAT_DEFAULT gst_binningfilter_RGB_debug
+#include "binning-private.h"
 
 void
-gst_bin_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
+binning_image_rgb(const BinningParams *params, const BinningImage *image)
 {
 	unsigned int count=0;
-	unsigned int x, y, i, j, val;
+	unsigned int x, y, val;
 	bgr_pixel *ptr=NULL;
-	GstMapInfo minfo;
+	BinningStats *stats = image->stats;   // NULL unless statistics are wanted
 
-	double *forward_gamma = filter->forward_gamma;
-	unsigned int *inverse_gamma = filter->inverse_gamma;
+	const double *forward_gamma = params->forward_gamma;
+	const unsigned int *inverse_gamma = params->inverse_gamma;
 
 	unsigned int out_limit = OUT_RANGE - 1;
-	unsigned int in_limit = IN_RANGE - 1;
+	gint in_limit = IN_RANGE - 1;  // signed, so that CLAMP catches values below the black level
 
 	// ***********************************
 	// binning the pixels from 24-bit BGR data
 	// to do this in-place, always gather pixels from below and right
 
-	// Access the buffer - READ AND WRITE
-	gst_buffer_map (buf, &minfo, GST_MAP_READWRITE);
-
-    gint black_r, black_g, black_b;   // RGB black levels that will be subtracted from each pixel
-    gint contrast_r, contrast_g, contrast_b;   // RGB contrast values that will be applied to the summed/binned data
-
-	if(filter->format_is_RGB){  // default is BGR, so swap black and contrast b for r
-		black_r = filter->black_b; black_g = filter->black_g; black_b = filter->black_r;
-		contrast_r = filter->contrast_b; contrast_g = filter->contrast_g; contrast_b = filter->contrast_r;
-	}
-	else{
-		black_r = filter->black_r; black_g = filter->black_g; black_b = filter->black_b;
-		contrast_r = filter->contrast_r; contrast_g = filter->contrast_g; contrast_b = filter->contrast_b;
+	if (params->binsize > 2){  // generic implementation, rolling row sums in cache sized tiles, see binning-stride-rgb.c
+		binning_stride_image_rgb(params, image, 1);
+		return;
 	}
 
+    gint black_r = params->black_r, black_g = params->black_g, black_b = params->black_b;   // black levels, already swapped for RGB data
+
 	gint start_y = 0;
-	gint stop_y  = filter->height;
+	gint stop_y  = image->height;
 	gint start_x = 0;
-	gint stop_x  = filter->width;
-
-	guint8 *img_ptr = minfo.data;
-	gint pitch = filter->stride / 3;  // want the number of pixels to next line
+	gint stop_x  = image->width;
 
-	gfloat gain_r = contrast_r / 100.0f;    // convert contrast values into real gain factors, contrast=100 => gain=1 => normal summed binning
-	gfloat gain_g = contrast_g / 100.0f;
-	gfloat gain_b = contrast_b / 100.0f;
+	guint8 *img_ptr = image->data;
+	gint pitch = image->stride / 3;  // want the number of pixels to next line
 
-	// Check for the special contrast value (-1) to do averaging rather than binning, gain here is dependent in the bin size.
-	if (contrast_r < 0)
-		gain_r = 1.0f / (filter->binsize*filter->binsize);
-	if (contrast_g < 0)
-		gain_g = 1.0f / (filter->binsize*filter->binsize);
-	if (contrast_b < 0)
-		gain_b = 1.0f / (filter->binsize*filter->binsize);
+	gfloat gain_r = params->gain_r, gain_g = params->gain_g, gain_b = params->gain_b;   // contrast/100, or 1/binsize^2 for averaging (contrast=-1)
 
-//	GST_DEBUG_OBJECT (filter, "Binsize: %d Gains: %.3f %.3f %.3f, Blacks: %d %d %d", filter->binsize, gain_r, gain_g, gain_b, black_r, black_g, black_b);
+//	GST_DEBUG_OBJECT (filter, "Binsize: %d Gains: %.3f %.3f %.3f, Blacks: %d %d %d", params->binsize, gain_r, gain_g, gain_b, black_r, black_g, black_b);
 
-	if (filter->binsize == 1){  // no binning here but may want to contrast stretch and apply black levels
+	if (params->binsize == 1){  // no binning here but may want to contrast stretch and apply black levels
 
 		if(gain_r==1.0f && gain_g==1.0f && gain_b==1.0f &&
 				black_r==0 && black_g==0 && black_b==0){     // Just check that we have to do anything at all, if not return.
 //			GST_DEBUG_OBJECT (filter, "Nothing to do!");
-			gst_buffer_unmap (buf, &minfo);
+			if (stats)   // image is unchanged but the statistics are still wanted
+				binning_stats_add_image(stats, image->data, image->width, image->height, image->stride / 3);
 			return;
 		}
 
@@ -146,14 +125,15 @@ gst_bin_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 				val = forward_gamma[CLAMP(ptr->r - black_r, 0, in_limit)];
 				ptr->r = inverse_gamma[(unsigned int)CLAMP(val*gain_r, 0, out_limit)];
 
+				BINNING_STATS_ADD(stats, ptr);
 				count++; // pixel count
 				ptr++;  // next pixel, 3 bytes on
 			}
 		}
 	}
-	else if (filter->binsize == 2){  // fast implementation for 2x2
-		stop_y  = filter->height-1;
-		stop_x  = filter->width-1;
+	else if (params->binsize == 2){  // fast implementation for 2x2
+		stop_y  = image->height-1;
+		stop_x  = image->width-1;
 		for(y=start_y; y<stop_y; y++){
 			ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
 			for(x=start_x; x<stop_x; x++){
@@ -171,38 +151,12 @@ gst_bin_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 						forward_gamma[CLAMP((ptr+pitch)->r - black_r, 0, in_limit)] + forward_gamma[CLAMP((ptr+pitch+1)->r - black_r, 0, in_limit)];
 				ptr->r = inverse_gamma[(unsigned int)CLAMP(val*gain_r, 0, out_limit)];
 
+				BINNING_STATS_ADD(stats, ptr);
 				count++; // pixel count
 				ptr++;  // next pixel, 3 bytes on
 			}
 		}
 	}
-	else{  // generic implementation
-		gint s = filter->binsize, valr, valg, valb;
-		stop_y  = filter->height-s;
-		stop_x  = filter->width-s;
-		for(y=start_y; y<stop_y; y++){
-			ptr = (bgr_pixel *)img_ptr + pitch * y + start_x; // ptr to start of line
-			for(x=start_x; x<stop_x; x++){
-				valb = valg = valr = 0;
-				for(i=0; i<s; i++){
-					for(j=0; j<s; j++){
-						valb += forward_gamma[CLAMP((ptr+i*pitch+j)->b - black_b, 0, in_limit)];
-						valg += forward_gamma[CLAMP((ptr+i*pitch+j)->g - black_g, 0, in_limit)];
-						valr += forward_gamma[CLAMP((ptr+i*pitch+j)->r - black_r, 0, in_limit)];
-					}
-				}
-
-				ptr->b = inverse_gamma[(unsigned int)CLAMP(valb*gain_b, 0, out_limit)];
-				ptr->g = inverse_gamma[(unsigned int)CLAMP(valg*gain_g, 0, out_limit)];
-				ptr->r = inverse_gamma[(unsigned int)CLAMP(valr*gain_r, 0, out_limit)];
-
-				count++; // pixel count
-				ptr++;  // next pixel, 3 bytes on
-			}
-		}
-	}
-
-	gst_buffer_unmap (buf, &minfo);
 }
 
 /*
@@ -388,12 +342,3 @@ gst_bin_image_rgb(Gstbinningfilter *filter, GstBuffer *buf)
 	gst_buffer_unmap (buf, &minfo);
 }
 */
-
-
-void
-gst_binningfilter_rgb_init(void)
-{
-	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_RGB_debug, "binningfilter",
-			1, "binningfilter RGB");
-}
-
@@ -0,0 +1,344 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "binning-private.h"
+
+// Robust binning, each bin is estimated from the median, or a mean that leaves out values far from the median,
+// so that a cosmic ray or impulse noise in one pixel does not spread over the whole bin.
+// The estimate is multiplied by the number of pixels in the bin, so that the contrast values work as for
+// summed binning, i.e. contrast=100 gives the (robust) sum and contrast=-1 the (robust) average.
+//
+// The values of each bin are put in order with a sorting network, a fixed sequence of compare-exchanges.
+// As the sequence does not depend on the data, ROBUST_LANES neighbouring bins go through it together,
+// each compare-exchange is then a min and max of two rows of bytes, which the compiler turns into vector code.
+// The median does not depend on the gamma, so the 8-bit input values are sorted and only the values used are linearised.
+
+#define ROBUST_MAX_VALUES 49   // binsize 7
+#define ROBUST_LANES 16   // bins sorted at once
+
+typedef guint8 RobustValues[ROBUST_MAX_VALUES][ROBUST_LANES];   // value i of the bin in lane l is [i][l]
+
+static inline void
+compare_exchange(guint8 *a, guint8 *b)
+{
+	gint l;
+	guint8 t;
+
+	for (l = 0; l < ROBUST_LANES; l++){
+		t = MIN(a[l], b[l]);
+		b[l] = MAX(a[l], b[l]);
+		a[l] = t;
+	}
+}
+
+#define PIX_SORT(a, b) compare_exchange(a, b)
+
+// Batcher's odd-even merge sort of the next power of 2 up from n, the values above n taken as +infinity.
+// A compare-exchange with one of those never swaps, so it is left out, as it is in the unrolled networks below.
+static void
+batcher_sort(RobustValues v, gint n)
+{
+	gint p, k, j, i, size;
+
+	for (size = 1; size < n; size <<= 1)
+		;
+
+	for (p = 1; p < size; p <<= 1)
+		for (k = p; k >= 1; k >>= 1)
+			for (j = k % p; j <= size - 1 - k; j += 2 * k)
+				for (i = 0; i <= MIN(k - 1, size - j - k - 1) && i + j + k < n; i++)
+					if ((i + j) / (p * 2) == (i + j + k) / (p * 2))
+						PIX_SORT(v[i + j], v[i + j + k]);
+}
+
+// The same networks unrolled for the common binsizes, 2x2, 3x3 and 4x4
+
+static inline void
+sort4(RobustValues v)
+{
+	PIX_SORT(v[0], v[1]); PIX_SORT(v[2], v[3]); PIX_SORT(v[0], v[2]); PIX_SORT(v[1], v[3]);
+	PIX_SORT(v[1], v[2]);
+}
+
+static inline void
+sort9(RobustValues v)
+{
+	PIX_SORT(v[0], v[1]); PIX_SORT(v[2], v[3]); PIX_SORT(v[4], v[5]); PIX_SORT(v[6], v[7]);
+	PIX_SORT(v[0], v[2]); PIX_SORT(v[1], v[3]); PIX_SORT(v[4], v[6]); PIX_SORT(v[5], v[7]);
+	PIX_SORT(v[1], v[2]); PIX_SORT(v[5], v[6]); PIX_SORT(v[0], v[4]); PIX_SORT(v[1], v[5]);
+	PIX_SORT(v[2], v[6]); PIX_SORT(v[3], v[7]); PIX_SORT(v[2], v[4]); PIX_SORT(v[3], v[5]);
+	PIX_SORT(v[1], v[2]); PIX_SORT(v[3], v[4]); PIX_SORT(v[5], v[6]); PIX_SORT(v[0], v[8]);
+	PIX_SORT(v[4], v[8]); PIX_SORT(v[2], v[4]); PIX_SORT(v[3], v[5]); PIX_SORT(v[6], v[8]);
+	PIX_SORT(v[1], v[2]); PIX_SORT(v[3], v[4]); PIX_SORT(v[5], v[6]); PIX_SORT(v[7], v[8]);
+}
+
+static inline void
+sort16(RobustValues v)
+{
+	PIX_SORT(v[0], v[1]); PIX_SORT(v[2], v[3]); PIX_SORT(v[4], v[5]); PIX_SORT(v[6], v[7]);
+	PIX_SORT(v[8], v[9]); PIX_SORT(v[10], v[11]); PIX_SORT(v[12], v[13]); PIX_SORT(v[14], v[15]);
+	PIX_SORT(v[0], v[2]); PIX_SORT(v[1], v[3]); PIX_SORT(v[4], v[6]); PIX_SORT(v[5], v[7]);
+	PIX_SORT(v[8], v[10]); PIX_SORT(v[9], v[11]); PIX_SORT(v[12], v[14]); PIX_SORT(v[13], v[15]);
+	PIX_SORT(v[1], v[2]); PIX_SORT(v[5], v[6]); PIX_SORT(v[9], v[10]); PIX_SORT(v[13], v[14]);
+	PIX_SORT(v[0], v[4]); PIX_SORT(v[1], v[5]); PIX_SORT(v[2], v[6]); PIX_SORT(v[3], v[7]);
+	PIX_SORT(v[8], v[12]); PIX_SORT(v[9], v[13]); PIX_SORT(v[10], v[14]); PIX_SORT(v[11], v[15]);
+	PIX_SORT(v[2], v[4]); PIX_SORT(v[3], v[5]); PIX_SORT(v[10], v[12]); PIX_SORT(v[11], v[13]);
+	PIX_SORT(v[1], v[2]); PIX_SORT(v[3], v[4]); PIX_SORT(v[5], v[6]); PIX_SORT(v[9], v[10]);
+	PIX_SORT(v[11], v[12]); PIX_SORT(v[13], v[14]); PIX_SORT(v[0], v[8]); PIX_SORT(v[1], v[9]);
+	PIX_SORT(v[2], v[10]); PIX_SORT(v[3], v[11]); PIX_SORT(v[4], v[12]); PIX_SORT(v[5], v[13]);
+	PIX_SORT(v[6], v[14]); PIX_SORT(v[7], v[15]); PIX_SORT(v[4], v[8]); PIX_SORT(v[5], v[9]);
+	PIX_SORT(v[6], v[10]); PIX_SORT(v[7], v[11]); PIX_SORT(v[2], v[4]); PIX_SORT(v[3], v[5]);
+	PIX_SORT(v[6], v[8]); PIX_SORT(v[7], v[9]); PIX_SORT(v[10], v[12]); PIX_SORT(v[11], v[13]);
+	PIX_SORT(v[1], v[2]); PIX_SORT(v[3], v[4]); PIX_SORT(v[5], v[6]); PIX_SORT(v[7], v[8]);
+	PIX_SORT(v[9], v[10]); PIX_SORT(v[11], v[12]); PIX_SORT(v[13], v[14]);
+}
+
+// Median of 9 values with 19 compare-exchanges, from the 3x3 median filter network (Paeth / Devillard),
+// only the middle value p[4] ends up in its place
+static inline void
+median9(RobustValues p)
+{
+	PIX_SORT(p[1], p[2]); PIX_SORT(p[4], p[5]); PIX_SORT(p[7], p[8]);
+	PIX_SORT(p[0], p[1]); PIX_SORT(p[3], p[4]); PIX_SORT(p[6], p[7]);
+	PIX_SORT(p[1], p[2]); PIX_SORT(p[4], p[5]); PIX_SORT(p[7], p[8]);
+	PIX_SORT(p[0], p[3]); PIX_SORT(p[5], p[8]); PIX_SORT(p[4], p[7]);
+	PIX_SORT(p[3], p[6]); PIX_SORT(p[1], p[4]); PIX_SORT(p[2], p[5]);
+	PIX_SORT(p[4], p[7]); PIX_SORT(p[4], p[2]); PIX_SORT(p[6], p[4]);
+	PIX_SORT(p[4], p[2]);
+}
+
+static inline void
+sort_values(RobustValues v, gint n)
+{
+	switch (n){
+	case 1:
+		break;
+	case 4:
+		sort4(v);
+		break;
+	case 9:
+		sort9(v);
+		break;
+	case 16:
+		sort16(v);
+		break;
+	default:
+		batcher_sort(v, n);
+		break;
+	}
+}
+
+// Linear value of the median of the n sorted values in lane l, the mean of the middle two for even n
+static inline gdouble
+sorted_median(RobustValues v, gint l, gint n, const double *forward_gamma)
+{
+	if (n & 1)
+		return forward_gamma[v[n/2][l]];
+	return 0.5 * (forward_gamma[v[n/2-1][l]] + forward_gamma[v[n/2][l]]);
+}
+
+// Mean of the sorted values in lane l that are within clip_sigma standard deviations of the median, in linear space.
+// The standard deviation is estimated from the quartiles, the smaller of the two half spreads is used,
+// so a group of hot (or dead) pixels at one end does not widen the limits.
+static inline gdouble
+sorted_clipped_mean(RobustValues v, gint l, gint n, const double *forward_gamma, gdouble clip_sigma)
+{
+	gdouble median = sorted_median(v, l, n, forward_gamma);
+	gdouble low = median - forward_gamma[v[n/4][l]];
+	gdouble high = forward_gamma[v[(3*n)/4][l]] - median;
+	gdouble limit = clip_sigma * MIN(low, high) / 0.6745;   // quartiles of a normal distribution are 0.6745 sigma from the middle
+	gdouble sum = 0.0, lin;
+	gint i, kept = 0;
+
+	for (i = 0; i < n; i++){
+		lin = forward_gamma[v[i][l]];
+		if (fabs(lin - median) <= limit){
+			sum += lin;
+			kept++;
+		}
+	}
+
+	return kept ? sum / kept : median;   // the median is always kept, unless rounding
+}
+
+// Bin the frame with binsize s, bins every k pixels.
+// Forced inline for each binsize so that the right network is picked and the gather loops unroll at compile time.
+static inline __attribute__((always_inline)) void
+robust_bin(const BinningParams *params, const BinningImage *image, gint s, gint k)
+{
+	gint x, y, i, j, l, c, lanes, out_x, out_y;
+	gint n = s * s;
+	gint in_limit = IN_RANGE - 1;  // signed, so that CLAMP catches values below the black level
+	unsigned int out_limit = OUT_RANGE - 1;
+	const double *forward_gamma = params->forward_gamma;
+	const unsigned int *inverse_gamma = params->inverse_gamma;
+	gint black[3] = { params->black_b, params->black_g, params->black_r };   // in bgr_pixel order
+	gfloat gain[3] = { params->gain_b * n, params->gain_g * n, params->gain_r * n };   // the estimate stands for n pixels
+	gboolean median = params->algorithm == BINNING_MEDIAN;
+	gdouble clip_sigma = params->clip_sigma;
+	BinningStats *stats = image->stats;   // NULL unless statistics are wanted
+	guint8 *img_ptr = image->data;
+	gint pitch = image->stride / 3;  // want the number of pixels to next line
+	gint width = image->width, height = image->height;
+	gboolean right = params->border && BINNING_IMAGE_RIGHT_EDGE(image);
+	gboolean bottom = params->border && BINNING_IMAGE_BOTTOM_EDGE(image);
+	gboolean partial = params->border == BINNING_BORDER_PARTIAL;
+	gint out_width = (width - (right ? 1 : s)) / k + 1;
+	gint out_height = (height - (bottom ? 1 : s)) / k + 1;
+	gint inner_width = (width - s) / k + 1;   // bins with every pixel inside the image
+	gint inner_height = (height - s) / k + 1;
+	gint row_end, m;
+	BinningBorderCopy copy = { NULL, NULL, s, width, height };   // nothing copied, for a partial border
+	RobustValues v[3];
+	gdouble est;
+	guint8 *out;
+	bgr_pixel *ptr, *out_ptr;
+
+	if ((right || bottom) && !partial)   // taken before the image is written over
+		binning_border_copy(image, s, right, bottom, &copy);
+	if (right || bottom)   // the edge bins only use lane 0, the others are sorted along with it
+		memset(v, 0, sizeof(v));
+
+	// gather from below and right, output (out_x, out_y) is never to the right of or below input (x, y), so in-place is safe,
+	// all lanes are gathered before any is written
+	for(out_y=0, y=0; out_y<out_height; out_y++, y+=k){
+		row_end = out_y < inner_height ? inner_width : 0;   // the bins inside, gathered without a test
+		for(out_x=0; out_x<row_end; out_x+=ROBUST_LANES){
+			lanes = MIN(ROBUST_LANES, row_end - out_x);
+
+			for(l=0; l<ROBUST_LANES; l++){
+				x = (out_x + MIN(l, lanes - 1)) * k;   // spare lanes at the end of the row repeat the last bin
+				for(j=0; j<s; j++){
+					ptr = (bgr_pixel *)img_ptr + pitch * (y+j) + x;
+					for(i=0; i<s; i++, ptr++){
+						v[0][j*s+i][l] = CLAMP(ptr->b - black[0], 0, in_limit);
+						v[1][j*s+i][l] = CLAMP(ptr->g - black[1], 0, in_limit);
+						v[2][j*s+i][l] = CLAMP(ptr->r - black[2], 0, in_limit);
+					}
+				}
+			}
+
+			for(c=0; c<3; c++){
+				if (median && n == 9)
+					median9(v[c]);
+				else
+					sort_values(v[c], n);
+			}
+
+			out_ptr = (bgr_pixel *)img_ptr + pitch * out_y + out_x;
+			for(l=0; l<lanes; l++, out_ptr++){
+				for(c=0; c<3; c++){
+					est = median ? sorted_median(v[c], l, n, forward_gamma) : sorted_clipped_mean(v[c], l, n, forward_gamma, clip_sigma);
+					out = c == 0 ? &out_ptr->b : (c == 1 ? &out_ptr->g : &out_ptr->r);
+					*out = inverse_gamma[(unsigned int)CLAMP(est*gain[c], 0, out_limit)];
+				}
+				BINNING_STATS_ADD(stats, out_ptr);
+			}
+		}
+
+		// the bins that reach past the right or bottom, one at a time through the border, after the bins inside
+		// so they do not write over what those read. A partial bin is estimated from the m pixels it has.
+		for(out_x=row_end; out_x<out_width; out_x++){
+			x = out_x * k;
+			m = 0;
+			for(j=0; j<s; j++){
+				for(i=0; i<s; i++){
+					if (partial && (x+i >= width || y+j >= height))
+						continue;
+					ptr = (bgr_pixel *)binning_border_pixel(image, &copy, params->border, x+i, y+j);
+					v[0][m][0] = CLAMP(ptr->b - black[0], 0, in_limit);
+					v[1][m][0] = CLAMP(ptr->g - black[1], 0, in_limit);
+					v[2][m][0] = CLAMP(ptr->r - black[2], 0, in_limit);
+					m++;
+				}
+			}
+
+			out_ptr = (bgr_pixel *)img_ptr + pitch * out_y + out_x;
+			for(c=0; c<3; c++){
+				sort_values(v[c], m);
+				est = median ? sorted_median(v[c], 0, m, forward_gamma) : sorted_clipped_mean(v[c], 0, m, forward_gamma, clip_sigma);
+				out = c == 0 ? &out_ptr->b : (c == 1 ? &out_ptr->g : &out_ptr->r);
+				*out = inverse_gamma[(unsigned int)CLAMP(est*gain[c], 0, out_limit)];
+			}
+			BINNING_STATS_ADD(stats, out_ptr);
+		}
+	}
+}
+
+// Median or sigma-clipped binning, params->algorithm says which.
+// Bins are placed every bin_stride pixels, as for binning_stride_image_rgb(), 1 for sliding bins, binsize to resize.
+void
+binning_robust_image_rgb(const BinningParams *params, const BinningImage *image, gint bin_stride)
+{
+	gint s = params->binsize;
+
+	if (s > image->width || s > image->height || s * s > ROBUST_MAX_VALUES)
+		return;
+
+	switch (s){   // a constant binsize for each unrolled network
+	case 1:   // only the black level and contrast
+		robust_bin(params, image, 1, bin_stride);
+		break;
+	case 2:
+		robust_bin(params, image, 2, bin_stride);
+		break;
+	case 3:
+		robust_bin(params, image, 3, bin_stride);
+		break;
+	case 4:
+		robust_bin(params, image, 4, bin_stride);
+		break;
+	default:
+		robust_bin(params, image, s, bin_stride);
+		break;
+	}
+}
@@ -0,0 +1,248 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <string.h>
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_slice_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_slice_debug
+
+// Slice output, for low latency consumers (encoders, analytics) that can start on the top of a frame.
+// The frame is binned from the top down, binning_process_image_rows() a slice at a time, and each slice is pushed
+// as soon as its rows are final. The rows binned for a slice are still split in bands over the worker pool.
+// A slice is a buffer that wraps its rows of the frame, no copy is made. The frame stays mapped until the last
+// slice of it is freed downstream, as the kernels carry on writing the rows below those already pushed.
+
+// The mapped frame that the slices are made from, freed with the last of them
+typedef struct
+{
+	gint refcount;   // the element while it bins the frame, and each slice
+	GstBuffer *buf;
+	GstMapInfo map;
+} BinningSliceFrame;
+
+static void
+slice_frame_unref (gpointer data)
+{
+	BinningSliceFrame *frame = data;
+
+	if (!g_atomic_int_dec_and_test (&frame->refcount))
+		return;
+	gst_buffer_unmap (frame->buf, &frame->map);
+	gst_buffer_unref (frame->buf);
+	g_free (frame);
+}
+
+static gboolean
+slice_meta_init (GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+	GstBinningSliceMeta *slice = (GstBinningSliceMeta *) meta;
+
+	slice->y = slice->height = slice->frame_height = 0;
+	slice->last = FALSE;
+
+	return TRUE;
+}
+
+// The rows only stay right for a copy of the whole slice
+static gboolean
+slice_meta_transform (GstBuffer *dest, GstMeta *meta, GstBuffer *buffer, GQuark type, gpointer data)
+{
+	GstBinningSliceMeta *slice = (GstBinningSliceMeta *) meta, *copy;
+
+	if (!GST_META_TRANSFORM_IS_COPY (type) || ((GstMetaTransformCopy *) data)->region)
+		return FALSE;
+
+	copy = (GstBinningSliceMeta *) gst_buffer_add_meta (dest, gst_binning_slice_meta_get_info (), NULL);
+	copy->y = slice->y;
+	copy->height = slice->height;
+	copy->frame_height = slice->frame_height;
+	copy->last = slice->last;
+
+	return TRUE;
+}
+
+// Register the API type that gstbinningslicemeta.h finds by name
+static GType
+slice_meta_api_register (void)
+{
+	static gsize type = 0;
+	static const gchar *tags[] = { GST_META_TAG_VIDEO_STR, NULL };
+
+	if (g_once_init_enter (&type))
+		g_once_init_leave (&type, gst_meta_api_type_register (GST_BINNING_SLICE_META_API_NAME, tags));
+
+	return (GType) type;
+}
+
+const GstMetaInfo *
+gst_binning_slice_meta_get_info (void)
+{
+	static gsize info = 0;
+
+	if (g_once_init_enter (&info))
+		g_once_init_leave (&info, (gsize) gst_meta_register (slice_meta_api_register (), "GstBinningSliceMeta",
+				sizeof (GstBinningSliceMeta), slice_meta_init, NULL, slice_meta_transform));
+
+	return (const GstMetaInfo *) info;
+}
+
+// A buffer of rows y to y+height-1 of the frame, reffing it
+static GstBuffer *
+slice_new (BinningSliceFrame *frame, GstBuffer *buf, gint y, gint height, gint stride, gint frame_height)
+{
+	GstBinningSliceMeta *meta;
+	GstBuffer *slice;
+	gsize offset = (gsize)y * stride;
+	gboolean last = y + height >= frame_height;
+
+	g_atomic_int_inc (&frame->refcount);
+	slice = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY, frame->map.data, frame->map.size, offset,
+			last ? frame->map.size - offset : (gsize)height * stride, frame, slice_frame_unref);
+
+	gst_buffer_copy_into (slice, buf, GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+	if (y > 0)
+		GST_BUFFER_FLAG_UNSET (slice, GST_BUFFER_FLAG_DISCONT);
+	if (last)
+		GST_BUFFER_FLAG_SET (slice, GST_BUFFER_FLAG_MARKER);
+
+	meta = (GstBinningSliceMeta *) gst_buffer_add_meta (slice, gst_binning_slice_meta_get_info (), NULL);
+	meta->y = y;
+	meta->height = height;
+	meta->frame_height = frame_height;
+	meta->last = last;
+
+	return slice;
+}
+
+// Bin the frame, in place or into a new buffer of the 16-bit linear output, and push it on in slices of
+// filter->frame.slice_height rows, each as soon as its rows are binned. The caller keeps buf.
+// Compare mode and incremental binning work on the whole frame, which is then binned first and pushed in slices.
+GstFlowReturn
+gst_binningfilter_push_slices (Gstbinningfilter *filter, const BinningParams *params, GstBuffer * buf)
+{
+	GstFlowReturn ret = GST_FLOW_OK;
+	BinningSliceFrame *frame;
+	BinningImage image;
+	GstMapInfo in_info;
+	gboolean linear = params->output != BINNING_OUTPUT_8BIT;
+	gboolean whole = !linear && (filter->frame.compare || filter->frame.incremental);
+	gint height = filter->height;
+	gint slice_height = filter->frame.slice_height;
+	gint stride, y, rows, binned = 0;
+
+	if (whole && !gst_binningfilter_bin_frame (filter, params, buf))
+		return GST_FLOW_ERROR;
+
+	frame = g_new0 (BinningSliceFrame, 1);
+	frame->refcount = 1;
+	frame->buf = linear ? gst_binningfilter_linear_output_new (filter, params, buf) : buf;
+	if (!gst_buffer_map (frame->buf, &frame->map, GST_MAP_READWRITE)){   // before it is reffed, when it is still writable
+		GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, ("Could not map the frame to bin."), (NULL));
+		if (linear)
+			gst_buffer_unref (frame->buf);
+		g_free (frame);
+		return GST_FLOW_ERROR;
+	}
+	if (!linear)
+		gst_buffer_ref (buf);
+
+	image.data = frame->map.data;
+	image.width = filter->width;
+	image.height = height;
+	image.stride = filter->stride;
+	image.stats = filter->stats;
+	image.top = image.left = 0;
+	image.out = NULL;   // in place
+	image.out_stride = 0;
+	image.frame_width = image.frame_height = 0;
+	stride = filter->stride;
+
+	if (linear){   // the frame is only read, the slices are of the output
+		if (!gst_buffer_map (buf, &in_info, GST_MAP_READ)){
+			GST_ELEMENT_ERROR (filter, RESOURCE, READ, ("Could not map the frame to bin."), (NULL));
+			slice_frame_unref (frame);
+			return GST_FLOW_ERROR;
+		}
+		image.data = in_info.data;
+		image.out = frame->map.data;
+		image.out_stride = stride = GST_VIDEO_INFO_PLANE_STRIDE (&filter->output_info, 0);
+	}
+
+	for (y = 0; y < height && ret == GST_FLOW_OK; y += slice_height){
+		rows = MIN(slice_height, height - y);
+		if (!whole && binned < y + rows)   // output row j is frame row j
+			binned = binning_process_image_rows (params, &image, binned, y + rows);
+
+		ret = gst_pad_push (filter->srcpad, slice_new (frame, buf, y, rows, stride, height));
+	}
+
+	// the rest of a frame that was not wanted downstream, for its statistics
+	if (!whole)
+		binning_process_image_rows (params, &image, binned, G_MAXINT);
+
+	GST_LOG_OBJECT (filter, "Pushed a frame in slices of %d rows, %s", slice_height, gst_flow_get_name (ret));
+
+	if (linear)
+		gst_buffer_unmap (buf, &in_info);
+	slice_frame_unref (frame);
+
+	return ret;
+}
+
+void
+gst_binningfilter_slice_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_slice_debug, "binningfilter",
+			1, "binningfilter slices");
+
+	slice_meta_api_register ();   // so downstream finds the API type before the first slice
+}
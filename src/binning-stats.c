@@ -0,0 +1,131 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "gstbinningfilter.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_binningfilter_stats_debug);
+#define GST_CAT_DEFAULT gst_binningfilter_stats_debug
+
+// Post the statistics of the frame just binned as an element message:
+//
+// binningfilter-stats, timestamp=(guint64), pixels=(uint),
+//     r-min=(uint), r-max=(uint), r-mean=(double), r-saturated=(uint), r-black=(uint), r-histogram=(uint)< 256 values >,
+//     and the same for g and b
+//
+// saturated and black count the binned pixels that were clipped at 255 and 0.
+void
+gst_binningfilter_post_stats(Gstbinningfilter *filter, GstBuffer *buf)
+{
+	BinningStats *stats = &filter->frame_stats;
+	GstStructure *s;
+	guint c, i, pixels = 0;
+	const gchar *bgr_names[3] = {"b", "g", "r"};
+	const gchar *rgb_names[3] = {"r", "g", "b"};
+	const gchar **names = filter->format_is_RGB ? rgb_names : bgr_names;   // histograms are in buffer order
+
+	for(i=0; i<256; i++)
+		pixels += stats->histogram[0][i];
+
+	s = gst_structure_new ("binningfilter-stats",
+			"timestamp", G_TYPE_UINT64, GST_BUFFER_PTS (buf),
+			"pixels", G_TYPE_UINT, pixels, NULL);
+
+	for(c=0; c<3; c++){
+		guint32 *histogram = stats->histogram[c];
+		guint min = 0, max = 0;
+		gboolean empty = TRUE;
+		guint64 sum = 0;
+		GValue array = G_VALUE_INIT, value = G_VALUE_INIT;
+		gchar field[16];
+
+		g_value_init (&array, GST_TYPE_ARRAY);
+		g_value_init (&value, G_TYPE_UINT);
+
+		for(i=0; i<256; i++){
+			if (histogram[i]){
+				if (empty)
+					min = i;
+				max = i;
+				empty = FALSE;
+			}
+			sum += (guint64)i * histogram[i];
+			g_value_set_uint (&value, histogram[i]);
+			gst_value_array_append_value (&array, &value);
+		}
+
+		g_snprintf(field, sizeof(field), "%s-min", names[c]);
+		gst_structure_set (s, field, G_TYPE_UINT, min, NULL);
+		g_snprintf(field, sizeof(field), "%s-max", names[c]);
+		gst_structure_set (s, field, G_TYPE_UINT, max, NULL);
+		g_snprintf(field, sizeof(field), "%s-mean", names[c]);
+		gst_structure_set (s, field, G_TYPE_DOUBLE, pixels ? (gdouble)sum / pixels : 0.0, NULL);
+		g_snprintf(field, sizeof(field), "%s-saturated", names[c]);
+		gst_structure_set (s, field, G_TYPE_UINT, histogram[255], NULL);
+		g_snprintf(field, sizeof(field), "%s-black", names[c]);
+		gst_structure_set (s, field, G_TYPE_UINT, histogram[0], NULL);
+		g_snprintf(field, sizeof(field), "%s-histogram", names[c]);
+		gst_structure_take_value (s, field, &array);
+
+		g_value_unset (&value);
+	}
+
+	gst_element_post_message (GST_ELEMENT (filter),
+			gst_message_new_element (GST_OBJECT (filter), s));
+}
+
+void
+gst_binningfilter_stats_init(void)
+{
+	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_stats_debug, "binningfilter",
+			1, "binningfilter stats");
+}
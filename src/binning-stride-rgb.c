@@ -0,0 +1,577 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "binning-private.h"
+
+#define DEFAULT_L2_CACHE_SIZE (256*1024)   // if it can not be found
+
+// Scratch for the ring and the column sums, one per thread so that frames can be binned in parallel (see chain_list),
+// it grows to the biggest size a thread has needed and is freed when the thread exits
+typedef struct
+{
+	gsize size;   // number of guint32 in data
+	guint32 data[];
+} StrideScratch;
+
+static GPrivate stride_scratch = G_PRIVATE_INIT (g_free);
+
+static guint32 *
+get_scratch(gsize size)
+{
+	StrideScratch *scratch = g_private_get(&stride_scratch);
+
+	if (!scratch || scratch->size < size){
+		scratch = g_malloc(sizeof(StrideScratch) + size * sizeof(guint32));
+		scratch->size = size;
+		g_private_replace(&stride_scratch, scratch);   // frees the old one
+	}
+
+	return scratch->data;
+}
+
+// Linearise one image row into a slot of the row ring and add it to the column sums
+static inline void
+load_row(const bgr_pixel *ptr, guint32 *row, guint32 *col_sums, gint width,
+		const double *forward_gamma, gint black_r, gint black_g, gint black_b)
+{
+	gint x;
+	gint in_limit = IN_RANGE - 1;  // signed, so that CLAMP catches values below the black level
+
+	for(x=0; x<width; x++){
+		row[0] = forward_gamma[CLAMP(ptr->b - black_b, 0, in_limit)];
+		row[1] = forward_gamma[CLAMP(ptr->g - black_g, 0, in_limit)];
+		row[2] = forward_gamma[CLAMP(ptr->r - black_r, 0, in_limit)];
+		col_sums[0] += row[0];
+		col_sums[1] += row[1];
+		col_sums[2] += row[2];
+		row+=3;
+		col_sums+=3;
+		ptr++;
+	}
+}
+
+// As load_row, with the dark frame subtracted and the flat field gain applied to each linear sample,
+// dark and flat point to the same pixel of the calibration frames as ptr, either may be NULL
+static inline void
+load_row_calibrated(const bgr_pixel *ptr, const bgr_pixel *dark, const bgr_pixel *flat, guint32 *row, guint32 *col_sums, gint width,
+		const BinningParams *params)
+{
+	gint x;
+	gint in_limit = IN_RANGE - 1;  // signed, so that CLAMP catches values below the black level
+	const double *forward_gamma = params->forward_gamma;
+	gint black_r = params->black_r, black_g = params->black_g, black_b = params->black_b;
+	gfloat lin[3];
+
+	for(x=0; x<width; x++){
+		lin[0] = forward_gamma[CLAMP(ptr->b - black_b, 0, in_limit)];
+		lin[1] = forward_gamma[CLAMP(ptr->g - black_g, 0, in_limit)];
+		lin[2] = forward_gamma[CLAMP(ptr->r - black_r, 0, in_limit)];
+		if (dark){
+			lin[0] -= forward_gamma[CLAMP(dark->b - black_b, 0, in_limit)];
+			lin[1] -= forward_gamma[CLAMP(dark->g - black_g, 0, in_limit)];
+			lin[2] -= forward_gamma[CLAMP(dark->r - black_r, 0, in_limit)];
+			dark++;
+		}
+		if (flat){
+			lin[0] *= params->flat_gain[0][flat->b];
+			lin[1] *= params->flat_gain[1][flat->g];
+			lin[2] *= params->flat_gain[2][flat->r];
+			flat++;
+		}
+		row[0] = MAX(lin[0], 0.0f);
+		row[1] = MAX(lin[1], 0.0f);
+		row[2] = MAX(lin[2], 0.0f);
+		col_sums[0] += row[0];
+		col_sums[1] += row[1];
+		col_sums[2] += row[2];
+		row+=3;
+		col_sums+=3;
+		ptr++;
+	}
+}
+
+// Load width pixels from ptr, with the calibration if there is any, frame_offset is the frame pixel ptr was read from
+static inline void
+load_pixels(const BinningParams *params, const bgr_pixel *ptr, gsize frame_offset, guint32 *row, guint32 *col_sums, gint width)
+{
+	if (params->dark || params->flat)
+		load_row_calibrated(ptr,
+				params->dark ? (const bgr_pixel *)params->dark + frame_offset : NULL,
+				params->flat ? (const bgr_pixel *)params->flat + frame_offset : NULL,
+				row, col_sums, width, params);
+	else
+		load_row(ptr, row, col_sums, width,
+				params->forward_gamma, params->black_r, params->black_g, params->black_b);
+}
+
+// Load image row r, columns in_x to in_x+width, the image starts at frame pixel (left, top)
+static inline void
+load_image_row(const BinningParams *params, guint8 *img_ptr, gint pitch, gint top, gint left, gint r, gint in_x,
+		guint32 *row, guint32 *col_sums, gint width)
+{
+	gsize offset = (gsize)pitch * r + in_x;   // in pixels
+	gsize frame_offset = (gsize)pitch * (top + r) + left + in_x;   // the calibration frames have the layout of the whole frame
+
+	load_pixels(params, (bgr_pixel *)img_ptr + offset, frame_offset, row, col_sums, width);
+}
+
+// Load the part of a tile row past the right or bottom of the image, row r and columns in_x+first to in_x+width,
+// the pixels that the border reads there, each with the calibration of the pixel it is read from.
+// Only the last rows and columns of the image go through here, so the interior rows are loaded without a test.
+static void
+load_border(const BinningParams *params, const BinningImage *image, const BinningBorderCopy *copy, gint r, gint in_x,
+		gint first, guint32 *row, guint32 *col_sums, gint width)
+{
+	gint x, c, fx, fy;
+	gint pitch = image->stride / 3;
+
+	if (params->border == BINNING_BORDER_PARTIAL){   // nothing there, the bins are scaled up for the pixels they lack
+		memset(row + first * 3, 0, (width - first) * 3 * sizeof(guint32));
+		return;
+	}
+
+	fy = r < image->height ? r : binning_border_index(params->border, r, image->height);
+	for(x=first; x<width; x++){
+		c = in_x + x;
+		fx = c < image->width ? c : binning_border_index(params->border, c, image->width);
+		load_pixels(params, binning_border_pixel(image, copy, params->border, c, r),
+				(gsize)pitch * (image->top + fy) + image->left + fx, row + x * 3, col_sums + x * 3, 1);
+	}
+}
+
+// Load tile row r, columns in_x to in_x+width, which may reach past the right and bottom of the image into the border
+static inline void
+load_tile_row(const BinningParams *params, const BinningImage *image, const BinningBorderCopy *copy, gint r, gint in_x,
+		guint32 *row, guint32 *col_sums, gint width)
+{
+	gint inside = MIN(width, image->width - in_x);   // columns of the image, the rest are the border
+
+	if (r >= image->height){
+		load_border(params, image, copy, r, in_x, 0, row, col_sums, width);
+		return;
+	}
+	load_image_row(params, image->data, image->stride / 3, image->top, image->left, r, in_x, row, col_sums, inside);
+	if (inside < width)
+		load_border(params, image, copy, r, in_x, inside, row, col_sums, width);
+}
+
+// Take the defective pixels of image row r out of the loaded row of a tile (image columns in_x to in_x+width)
+// and count them in col_defects, returns the number taken out. Rows without defects cost one compare.
+static inline gint
+remove_defects(const BinningDefects *defects, gint r, gint in_x, gint width, guint32 *row, guint32 *col_sums, guint32 *col_defects)
+{
+	guint i;
+	gint x, c, n = 0;
+
+	for(i=defects->row_start[r]; i<defects->row_start[r+1]; i++){
+		x = (gint)defects->x[i] - in_x;
+		if (x < 0)
+			continue;
+		if (x >= width)
+			break;   // sorted, so no more in this tile
+		for(c=0; c<3; c++){
+			col_sums[x*3+c] -= row[x*3+c];
+			row[x*3+c] = 0;
+		}
+		col_defects[x]++;
+		n++;
+	}
+
+	return n;
+}
+
+// Forget the defects of image row r when it leaves the window, the pixels themselves are already 0 in the ring
+static inline gint
+drop_defects(const BinningDefects *defects, gint r, gint in_x, gint width, guint32 *col_defects)
+{
+	guint i;
+	gint x, n = 0;
+
+	for(i=defects->row_start[r]; i<defects->row_start[r+1]; i++){
+		x = (gint)defects->x[i] - in_x;
+		if (x < 0)
+			continue;
+		if (x >= width)
+			break;
+		col_defects[x]--;
+		n++;
+	}
+
+	return n;
+}
+
+// As remove_defects, for the tile columns first to width past the right of the image (image columns in_x+first on),
+// which a clamp or mirror border fills with the pixels of image row r in its last columns, a defect there is taken out
+// of every column that repeats it. r is the image row, left the frame column of the image origin.
+static gint
+remove_border_defects(const BinningParams *params, const BinningImage *image, gint r, gint in_x, gint first, gint width,
+		guint32 *row, guint32 *col_sums, guint32 *col_defects)
+{
+	const BinningDefects *defects = params->defects;
+	gint fr = image->top + r;
+	gint x, c, n = 0;
+	guint i;
+
+	if (defects->row_start[fr] == defects->row_start[fr+1])
+		return 0;
+	for(x=first; x<width; x++){
+		gint fx = image->left + binning_border_index(params->border, in_x + x, image->width);
+		for(i=defects->row_start[fr]; i<defects->row_start[fr+1] && (gint)defects->x[i] <= fx; i++){
+			if ((gint)defects->x[i] != fx)
+				continue;
+			for(c=0; c<3; c++){
+				col_sums[x*3+c] -= row[x*3+c];
+				row[x*3+c] = 0;
+			}
+			col_defects[x]++;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+// Forget the repeated defects of image row r, as drop_defects
+static gint
+drop_border_defects(const BinningParams *params, const BinningImage *image, gint r, gint in_x, gint first, gint width,
+		guint32 *col_defects)
+{
+	const BinningDefects *defects = params->defects;
+	gint fr = image->top + r;
+	gint x, n = 0;
+	guint i;
+
+	if (defects->row_start[fr] == defects->row_start[fr+1])
+		return 0;
+	for(x=first; x<width; x++){
+		gint fx = image->left + binning_border_index(params->border, in_x + x, image->width);
+		for(i=defects->row_start[fr]; i<defects->row_start[fr+1] && (gint)defects->x[i] <= fx; i++){
+			if ((gint)defects->x[i] != fx)
+				continue;
+			col_defects[x]--;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+// Chroma binning of a bin sum, green is kept and the colour differences scaled, B = G + (B-G)*factor, factor in 16.16 fixed point
+static inline void
+chroma_mix(guint32 *sum, gint factor)
+{
+	gint64 g = sum[1];
+
+	sum[0] = MAX(g + ((((gint64)sum[0] - g) * factor) >> 16), 0);
+	sum[2] = MAX(g + ((((gint64)sum[2] - g) * factor) >> 16), 0);
+}
+
+// Remove a row that has left the window from the column sums
+static inline void
+drop_row(const guint32 *row, guint32 *col_sums, gint width)
+{
+	gint x;
+
+	for(x=0; x<width*3; x++)
+		col_sums[x] -= row[x];
+}
+
+// Size of the L2 cache, the working set of a tile is kept within half of it
+static gsize
+cache_size(void)
+{
+	static gsize size = 0;
+
+	if (g_once_init_enter (&size)){
+		glong l2 = -1;
+		FILE *f;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+		l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+		if (l2 <= 0 && (f = fopen("/sys/devices/system/cpu/cpu0/cache/index2/size", "r"))){  // e.g. "256K"
+			if (fscanf(f, "%ldK", &l2) == 1)
+				l2 *= 1024;
+			else
+				l2 = -1;
+			fclose(f);
+		}
+		if (l2 <= 0)
+			l2 = DEFAULT_L2_CACHE_SIZE;
+
+		g_debug ("L2 cache size %ld bytes", l2);
+		g_once_init_leave (&size, (gsize)l2);
+	}
+
+	return size;
+}
+
+void
+binning_stride_image_rgb(const BinningParams *params, const BinningImage *image, gint bin_stride)
+{
+	gint x, y, r, out_x, out_y, c;
+	gint tile_x, tile_end, in_x, in_width;
+	bgr_pixel *out_ptr;
+	BinningStats *stats = image->stats;   // NULL unless statistics are wanted
+
+	const unsigned int *inverse_gamma = params->inverse_gamma;
+
+	unsigned int out_limit = OUT_RANGE - 1;
+
+	// ***********************************
+	// binning the pixels from 24-bit BGR data with a bin of binsize x binsize placed every bin_stride pixels
+	// bin_stride=1 is the sliding box filter of binning_image_rgb, bin_stride=binsize is the decimation of binning_resize_image_rgb
+	// the output image is built up in the top-left of the buffer, as for resize
+	//
+	// Method
+	// keep the linearised values of the last binsize rows in a ring and a running sum of each column over those rows,
+	// moving the window down by bin_stride rows only adds the new rows and subtracts the ones that left,
+	// along a row the bin sum is moved on in the same way from the column sums.
+	// So the input is read once and each output pixel costs ~2*bin_stride adds per channel whatever the binsize.
+	// Output row out_y is written after rows >= out_y*bin_stride have been loaded, so this works in-place.
+	//
+	// For wide frames the binsize rows of the ring do not fit in the cache, so the frame is done in tiles of
+	// columns, each running from top to bottom, with the tile width set from the L2 cache size.
+	// A tile writes output columns to the left of any input column that a later tile reads, so tiles are also in-place safe.
+	//
+	// The 16-bit linear output of binning_process_linear() is written from the sums as they are, with no inverse gamma,
+	// to a buffer of its own, and is made here for every algorithm and bin size.
+	//
+	// Chroma binning is the same sums, with the colour differences of each bin sum scaled by chroma_weight/n
+	// before the gains, so it also works in linear space and with any bin stride.
+	//
+	// With params->border the window runs on past the right and bottom of the image. The rows and the ends of rows
+	// there are loaded by load_border() with the pixels the border repeats, or zeros for a partial border, so the
+	// sums need no test. Only the bins of a partial border that reach past the edge, like those with defects,
+	// go through the second output loop that scales them up for the pixels they lack.
+
+	gint s = params->binsize;
+	gint k = bin_stride;
+	gint width = image->width;
+	gint height = image->height;
+
+	if (s > width || s > height)
+		return;
+
+	guint8 *img_ptr = image->data;
+	gint pitch = image->stride / 3;  // want the number of pixels to next line
+	gint top = image->top, left = image->left;   // frame pixel of the image origin, for the calibration and defects
+
+	gfloat gain_r = params->gain_r, gain_g = params->gain_g, gain_b = params->gain_b;   // contrast/100, or 1/binsize^2 for averaging (contrast=-1)
+
+	// with a border there is a bin every k pixels up to the right and bottom of the frame, which a part of a frame
+	// (a band or a tile) only reaches if it is at that edge
+	gboolean right = params->border && BINNING_IMAGE_RIGHT_EDGE(image);
+	gboolean bottom = params->border && BINNING_IMAGE_BOTTOM_EDGE(image);
+	gboolean partial = params->border == BINNING_BORDER_PARTIAL;
+	BinningBorderCopy copy = { NULL, NULL, s, width, height };   // nothing copied, for a partial border
+
+	gint out_width = (width - (right ? 1 : s)) / k + 1;
+	gint out_height = (height - (bottom ? 1 : s)) / k + 1;
+	gint full_width = partial && right ? (width - s) / k + 1 : out_width;   // bins with every pixel inside the image
+
+	if ((right || bottom) && !partial)   // taken before the image is written over
+		binning_border_copy(image, s, right, bottom, &copy);
+
+	// tile width, in output pixels, so that the ring and the column sums (s+1 rows of 3 guint32 per column) fit in half the L2 cache
+	gint tile_in_width = MAX(cache_size() / 2 / ((s+1) * 3 * sizeof(guint32)), (gsize)(4*s));
+	gint tile_width = MAX((tile_in_width - s) / k + 1, 1);
+	tile_width = MIN(tile_width, out_width);
+	tile_in_width = (tile_width-1) * k + s;   // may reach past the right of the image into the border
+
+	// scratch: binsize rows of linear values followed by the column sums, and the column defect counts
+	const BinningDefects *defects = params->defects;
+	guint32 *ring = get_scratch((gsize)(s+1) * tile_in_width * 3 + tile_in_width);
+	guint32 *col_sums = ring + (gsize)s * tile_in_width * 3;
+	guint32 *col_defects = col_sums + (gsize)tile_in_width * 3;
+	gint window_defects = 0;   // defective pixels in the rows of the window, the bins are only renormalised when there are some
+	gint n = s * s;
+
+	gboolean chroma = params->algorithm == BINNING_CHROMA;
+	gint chroma_factor = params->chroma_factor;
+
+	// with a 16-bit linear output the sums are written there and the image is only read
+	guint16 *lin_ptr = NULL;
+	gint channels = params->output == BINNING_OUTPUT_GRAY16 ? 1 : 4;
+
+	for(tile_x=0; tile_x<out_width; tile_x+=tile_width){
+		tile_end = MIN(tile_x + tile_width, out_width);
+		in_x = tile_x * k;    // input columns used by this tile
+		in_width = (tile_end-1) * k + s - in_x;
+		gint in_inside = MIN(in_width, width - in_x);   // the rest are past the right of the image
+		gboolean repeated = defects && !partial && in_inside < in_width;   // and repeat its last columns, with their defects
+
+		for(out_y=0, y=0; out_y<out_height; out_y++, y+=k){
+
+			if (out_y==0 || k>=s){  // no overlap with the last window, start again
+				memset(col_sums, 0, in_width * 3 * sizeof(guint32));
+				if (defects){
+					memset(col_defects, 0, in_width * sizeof(guint32));
+					window_defects = 0;
+				}
+				for(r=y; r<y+s; r++){
+					guint32 *row = ring + (gsize)(r % s) * in_width * 3;
+					load_tile_row(params, image, &copy, r, in_x, row, col_sums, in_width);
+					if (defects && (r < height || !partial)){   // rows past the bottom have those of the row they repeat
+						gint ir = r < height ? r : binning_border_index(params->border, r, height);
+						window_defects += remove_defects(defects, top + ir, left + in_x, in_inside, row, col_sums, col_defects);
+						if (repeated)
+							window_defects += remove_border_defects(params, image, ir, in_x, in_inside, in_width, row, col_sums, col_defects);
+					}
+				}
+			}
+			else{  // the ring slot of each new row holds the row that has just left the window
+				for(r=y+s-k; r<y+s; r++){
+					guint32 *row = ring + (gsize)(r % s) * in_width * 3;
+					drop_row(row, col_sums, in_width);
+					load_tile_row(params, image, &copy, r, in_x, row, col_sums, in_width);
+					if (defects){
+						window_defects -= drop_defects(defects, top + r-s, left + in_x, in_inside, col_defects);
+						if (repeated)
+							window_defects -= drop_border_defects(params, image, r-s, in_x, in_inside, in_width, col_defects);
+						if (r < height || !partial){
+							gint ir = r < height ? r : binning_border_index(params->border, r, height);
+							window_defects += remove_defects(defects, top + ir, left + in_x, in_inside, row, col_sums, col_defects);
+							if (repeated)
+								window_defects += remove_border_defects(params, image, ir, in_x, in_inside, in_width, row, col_sums, col_defects);
+						}
+					}
+				}
+			}
+
+			guint32 sum[3] = {0, 0, 0};
+			out_ptr = (bgr_pixel *)img_ptr + pitch * out_y + tile_x; // ptr to start of line in this tile
+			if (image->out)
+				lin_ptr = (guint16 *)(image->out + (gsize)image->out_stride * out_y) + tile_x * channels;
+
+			// bins with defects, or with pixels past the edge of a partial border, are scaled up by n/(pixels binned),
+			// in a loop of their own, so that the loop of the other bins has no test
+			gint rows_inside = partial && bottom ? MIN(s, height - y) : s;
+			gint plain_end = window_defects > 0 || rows_inside < s ? tile_x : MIN(tile_end, full_width);
+
+			for(out_x=tile_x, x=0; out_x<plain_end; out_x++, x+=k){   // x is relative to the tile
+
+				if (out_x==tile_x || k>=s){
+					sum[0] = sum[1] = sum[2] = 0;
+					for(r=x; r<x+s; r++)
+						for(c=0; c<3; c++)
+							sum[c] += col_sums[r*3+c];
+				}
+				else{
+					for(r=x-k; r<x; r++)
+						for(c=0; c<3; c++)
+							sum[c] += col_sums[(r+s)*3+c] - col_sums[r*3+c];
+				}
+
+				guint32 mixed[3] = {sum[0], sum[1], sum[2]};   // the running sum carries on from the unmixed one
+				if (chroma)
+					chroma_mix(mixed, chroma_factor);
+
+				if (lin_ptr){
+					binning_store_linear(params, lin_ptr, mixed[0]*gain_b, mixed[1]*gain_g, mixed[2]*gain_r, stats);
+					lin_ptr += channels;
+					continue;
+				}
+
+				out_ptr->b = inverse_gamma[(unsigned int)CLAMP(mixed[0]*gain_b, 0, out_limit)];
+				out_ptr->g = inverse_gamma[(unsigned int)CLAMP(mixed[1]*gain_g, 0, out_limit)];
+				out_ptr->r = inverse_gamma[(unsigned int)CLAMP(mixed[2]*gain_r, 0, out_limit)];
+
+				BINNING_STATS_ADD(stats, out_ptr);
+				out_ptr++;
+			}
+
+			gint d = 0;
+			for(; out_x<tile_end; out_x++, x+=k){
+
+				if (out_x==plain_end || k>=s){
+					sum[0] = sum[1] = sum[2] = 0;
+					d = 0;
+					for(r=x; r<x+s; r++){
+						for(c=0; c<3; c++)
+							sum[c] += col_sums[r*3+c];
+						if (defects)
+							d += col_defects[r];
+					}
+				}
+				else{
+					for(r=x-k; r<x; r++){
+						for(c=0; c<3; c++)
+							sum[c] += col_sums[(r+s)*3+c] - col_sums[r*3+c];
+						if (defects)
+							d += (gint)col_defects[r+s] - (gint)col_defects[r];
+					}
+				}
+
+				gint binned = rows_inside * (partial && right ? MIN(s, width - in_x - x) : s) - d;
+				gfloat w = binned > 0 ? (gfloat)n / binned : 0.0f;
+
+				guint32 mixed[3] = {sum[0], sum[1], sum[2]};
+				if (chroma)
+					chroma_mix(mixed, chroma_factor);
+
+				if (lin_ptr){
+					binning_store_linear(params, lin_ptr, mixed[0]*gain_b*w, mixed[1]*gain_g*w, mixed[2]*gain_r*w, stats);
+					lin_ptr += channels;
+					continue;
+				}
+				out_ptr->b = inverse_gamma[(unsigned int)CLAMP(mixed[0]*gain_b*w, 0, out_limit)];
+				out_ptr->g = inverse_gamma[(unsigned int)CLAMP(mixed[1]*gain_g*w, 0, out_limit)];
+				out_ptr->r = inverse_gamma[(unsigned int)CLAMP(mixed[2]*gain_r*w, 0, out_limit)];
+
+				BINNING_STATS_ADD(stats, out_ptr);
+				out_ptr++;
+			}
+		}
+	}
+}
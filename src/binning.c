@@ -0,0 +1,316 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "binning-private.h"
+
+// The gamma luts are the same for every user, so they are made once and shared
+static double forward_gamma_lut[IN_RANGE];
+static unsigned int inverse_gamma_lut[OUT_RANGE];
+
+static void
+create_gamma_lut(void)
+{
+	unsigned int i;
+	double invgamma = 1.0/GAMMA;
+
+	for (i=0;i<IN_RANGE;i++){
+		forward_gamma_lut[i] = (double)((double)OUT_RANGE * pow(((double)i/(double)FACTOR) + OFFSET, (double)GAMMA));
+//		forward_gamma_lut[i] = (double)((double)OUT_RANGE * pow(((double)i/(double)IN_RANGE), (double)GAMMA));
+	}
+
+    // NB Not applying the output offset, OFFSET, here since not adding a linear portion to the gamma curve (see flycapsrc LUT))!!! TODO: Is this OK?
+	for (i=0;i<OUT_RANGE;i++){
+		inverse_gamma_lut[i] = (unsigned int)(IN_RANGE * pow(((double)i/OUT_RANGE), invgamma));
+	}
+}
+
+void
+binning_gamma_luts(const double **forward_gamma, const unsigned int **inverse_gamma)
+{
+	static gsize made = 0;
+
+	if (g_once_init_enter (&made)){
+		create_gamma_lut();
+		g_once_init_leave (&made, 1);
+	}
+
+	*forward_gamma = forward_gamma_lut;
+	*inverse_gamma = inverse_gamma_lut;
+}
+
+void
+binning_settings_init(BinningSettings *settings)
+{
+	memset(settings, 0, sizeof(*settings));
+	settings->algorithm = BINNING_RGB;
+	settings->format = BINNING_FORMAT_BGR;
+	settings->binsize = 1;
+	settings->resize = FALSE;
+	settings->bin_stride = 0;
+	settings->contrast_r = settings->contrast_g = settings->contrast_b = 100;
+	settings->clip_sigma = 3.0;
+	settings->output = BINNING_OUTPUT_8BIT;
+	settings->chroma_weight = 2.0;
+	settings->border = BINNING_BORDER_NONE;
+}
+
+BinningParams *
+binning_params_new(const BinningSettings *settings)
+{
+	BinningParams *params = g_new0 (BinningParams, 1);
+	gint n;
+
+	params->refcount = 1;
+
+	params->algorithm = settings->algorithm;
+	params->binsize = CLAMP(settings->binsize, 1, 7);
+	n = params->binsize * params->binsize;   // pixels summed in each bin, for averaging, of the binsize the kernels use
+	params->resize = settings->resize;
+	params->bin_stride = settings->bin_stride;
+	params->clip_sigma = settings->clip_sigma;
+	params->format = settings->format;
+	params->output = settings->output;
+	params->border = settings->border;
+	params->huge_pages = settings->huge_pages;
+
+	// chroma binning keeps the sum of green and the mean colour difference times the weight, B = G + (B-G)*weight/n,
+	// a bin of one pixel has no difference to average and is left as it is
+	params->chroma_factor = params->binsize > 1 ?
+			(gint)(settings->chroma_weight * 65536.0 / (params->binsize * params->binsize) + 0.5) : 65536;
+
+	if(settings->format == BINNING_FORMAT_RGB){  // kernels work in BGR order, so swap black and contrast b for r
+		params->black_r = settings->black_b; params->black_g = settings->black_g; params->black_b = settings->black_r;
+		params->contrast_r = settings->contrast_b; params->contrast_g = settings->contrast_g; params->contrast_b = settings->contrast_r;
+	}
+	else{
+		params->black_r = settings->black_r; params->black_g = settings->black_g; params->black_b = settings->black_b;
+		params->contrast_r = settings->contrast_r; params->contrast_g = settings->contrast_g; params->contrast_b = settings->contrast_b;
+	}
+
+	// convert contrast values into real gain factors, contrast=100 => gain=1 => normal summed binning
+	// the special contrast value (-1) does averaging rather than binning, the gain then depends on the bin size
+	params->gain_r = params->contrast_r < 0 ? 1.0f / n : params->contrast_r / 100.0f;
+	params->gain_g = params->contrast_g < 0 ? 1.0f / n : params->contrast_g / 100.0f;
+	params->gain_b = params->contrast_b < 0 ? 1.0f / n : params->contrast_b / 100.0f;
+
+	binning_gamma_luts(&params->forward_gamma, &params->inverse_gamma);
+
+	return params;
+}
+
+BinningParams *
+binning_params_ref (BinningParams *params)
+{
+	g_atomic_int_inc (&params->refcount);
+	return params;
+}
+
+void
+binning_params_unref (BinningParams *params)
+{
+	if (g_atomic_int_dec_and_test (&params->refcount)){
+		if (params->dark_file)
+			g_mapped_file_unref (params->dark_file);
+		if (params->flat_file)
+			g_mapped_file_unref (params->flat_file);
+		if (params->defects)
+			binning_defects_unref (params->defects);
+		g_free (params);
+	}
+}
+
+BinningDefects *
+binning_defects_ref(BinningDefects *defects)
+{
+	g_atomic_int_inc(&defects->refcount);
+	return defects;
+}
+
+void
+binning_defects_unref(BinningDefects *defects)
+{
+	if (g_atomic_int_dec_and_test(&defects->refcount)){
+		g_free(defects->row_start);
+		g_free(defects->x);
+		g_free(defects);
+	}
+}
+
+// Per thread, for the border copy of the image being binned, grown to the biggest needed and freed when the thread exits
+static GPrivate border_scratch = G_PRIVATE_INIT (g_free);
+
+// Copy the last s rows and columns of the image, the pixels that a clamp or mirror border reads past its right and
+// bottom edges, so an in-place kernel can read them after it has written over the image. Without right (bottom)
+// the columns (rows) are not copied.
+void
+binning_border_copy(const BinningImage *image, gint s, gboolean right, gboolean bottom, BinningBorderCopy *copy)
+{
+	gsize row_pixels = bottom ? (gsize)s * image->width : 0;
+	gsize col_pixels = right ? (gsize)s * image->height : 0;
+	gsize size = (row_pixels + col_pixels) * sizeof(bgr_pixel);
+	gsize *scratch = g_private_get(&border_scratch);   // its size, then the pixels
+	bgr_pixel *rows, *cols;
+	gint r;
+
+	if (!scratch || scratch[0] < size){
+		scratch = g_malloc(sizeof(gsize) + size);
+		scratch[0] = size;
+		g_private_replace(&border_scratch, scratch);
+	}
+	rows = (bgr_pixel *)(scratch + 1);
+	cols = rows + row_pixels;
+
+	for(r=0; bottom && r<s; r++)
+		memcpy(rows + (gsize)r * image->width, image->data + (gsize)(image->height - s + r) * image->stride, image->width * 3);
+	for(r=0; right && r<image->height; r++)
+		memcpy(cols + (gsize)r * s, image->data + (gsize)r * image->stride + (image->width - s) * 3, s * 3);
+
+	copy->rows = bottom ? rows : NULL;
+	copy->cols = right ? cols : NULL;
+	copy->s = s;
+	copy->width = image->width;
+	copy->height = image->height;
+}
+
+// Gather statistics from an image that the kernel did not need to change
+void
+binning_stats_add_image(BinningStats *stats, guint8 *img_ptr, gint width, gint height, gint pitch)
+{
+	gint x, y;
+	bgr_pixel *ptr;
+
+	for(y=0; y<height; y++){
+		ptr = (bgr_pixel *)img_ptr + pitch * y; // ptr to start of line
+		for(x=0; x<width; x++){
+			BINNING_STATS_ADD(stats, ptr);
+			ptr++;
+		}
+	}
+}
+
+// Bin one image in place with the kernel chosen by the algorithm, may be called for several images at once
+void
+binning_process_image(const BinningParams *params, const BinningImage *image)
+{
+	gint k = params->bin_stride > 0 ? params->bin_stride : (params->resize ? params->binsize : 1);   // as binning_output_size()
+
+	if (image->out){   // 16-bit linear sums, only the stride engine and the gray kernel write them
+		if (BINNING_FORMAT_IS_GRAY(params->format))
+			binning_gray_image(params, image, k);
+		else
+			binning_stride_image_rgb(params, image, k);
+		return;
+	}
+	if (BINNING_FORMAT_IS_GRAY(params->format))   // packed samples can not be binned in place
+		return;
+
+	switch (params->algorithm) {
+	case BINNING_CHROMA:   // the stride engine sums in linear space and mixes the sums, a bin of one pixel is just rgb
+		if(params->binsize > 1 || params->border){
+			binning_stride_image_rgb(params, image, k);
+			break;
+		}
+		// fall through
+	case BINNING_RGB:
+	default:
+		// calibration and defects are done as the stride engine loads each row, in linear space, so are a bin-stride
+		// and the borders of sliding bins. Resize sums the gamma encoded values, borders included.
+		if(params->bin_stride > 0 || params->corrected || (params->border && !params->resize))
+			binning_stride_image_rgb(params, image, k);
+		else if(!params->resize)
+			binning_image_rgb(params, image);
+		else
+			binning_resize_image_rgb(params, image);
+		break;
+	case BINNING_MEDIAN:
+	case BINNING_SIGMA_CLIP:   // calibration and defects are not applied, the median already ignores isolated defects
+		binning_robust_image_rgb(params, image, k);
+		break;
+	}
+}
+
+void
+binning_process(const BinningParams *params, const guint8 *src, guint8 *dst, gint width, gint height, gint stride, BinningStats *stats)
+{
+	BinningImage image = { dst, width, height, stride, stats, 0, 0, NULL, 0, 0, 0 };
+	gint y;
+
+	g_return_if_fail (!BINNING_FORMAT_IS_GRAY (params->format));   // see binning_process_linear()
+
+	if (src != dst)   // the kernels work in place
+		for (y = 0; y < height; y++)
+			memcpy(dst + (gsize)y * stride, src + (gsize)y * stride, width * 3);
+
+	binning_process_image(params, &image);
+}
+
+void
+binning_output_size(const BinningParams *params, gint width, gint height, gint *out_width, gint *out_height)
+{
+	gint s = params->binsize;
+	gint k = params->bin_stride > 0 ? params->bin_stride : (params->resize ? s : 1);   // as chosen in binning_process_image()
+
+	if (s > width || s > height){   // too small to bin, the image is left as it is
+		*out_width = width;
+		*out_height = height;
+		return;
+	}
+
+	if (params->border){   // a bin at every k pixels up to the edge
+		*out_width = (width - 1) / k + 1;
+		*out_height = (height - 1) / k + 1;
+		return;
+	}
+
+	*out_width = (width - s) / k + 1;
+	*out_height = (height - s) / k + 1;
+}
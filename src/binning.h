@@ -0,0 +1,178 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// libbinning, the binning engine of the binningfilter element as a plain C library.
+//
+// Bins 24-bit BGR or RGB images in linear intensity space, in place on the caller's memory or from one buffer
+// into another, with no GStreamer involved. The element is a wrapper over these calls.
+//
+//   BinningSettings settings;
+//   BinningParams *params;
+//
+//   binning_settings_init(&settings);
+//   settings.binsize = 2;
+//   params = binning_params_new(&settings);
+//   ...
+//   binning_process(params, frame, frame, width, height, stride, NULL);   // for each frame, from any thread
+//   ...
+//   binning_params_unref(params);
+
+#ifndef __BINNING_H__
+#define __BINNING_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+	BINNING_RGB,   // R, G and B binned separately
+	BINNING_CHROMA,   // luminance binned, chroma difference kept
+	BINNING_MEDIAN,   // median of each bin, robust to impulse noise
+	BINNING_SIGMA_CLIP   // mean of the values within clip_sigma of the median of each bin
+} BinningAlgorithm;
+
+typedef enum
+{
+	BINNING_FORMAT_BGR,
+	BINNING_FORMAT_RGB,
+	// Linear mono sensor data, as GStreamer's formats of the same name. These are unpacked as the rows
+	// are loaded for binning, into a 16-bit linear output of binning_process_linear(), with the black level and
+	// contrast of g. Calibration frames and defects are not applied. Every sample is binned alike, so a raw Bayer
+	// mosaic in one of these formats comes out as a mono image, with the colour sites of each bin summed together.
+	BINNING_FORMAT_GRAY10_LE32,   // three 10-bit samples in each little endian 32-bit word, the top 2 bits unused
+	BINNING_FORMAT_GRAY10_LE16,   // a 10-bit sample in the low bits of each little endian 16-bit word
+	BINNING_FORMAT_GRAY16_LE   // 16-bit samples, e.g. 12-bit data shifted up to the top bits
+} BinningFormat;
+
+#define BINNING_FORMAT_IS_GRAY(format) ((format) >= BINNING_FORMAT_GRAY10_LE32)
+
+// What binning_process_linear() writes, the binned sums in linear intensity, without the gamma of the input.
+// 16 bits a sample, little endian, with 65535 at the white of the 8-bit output, so a dim binned image keeps the
+// levels that the 8 bits lose.
+typedef enum
+{
+	BINNING_OUTPUT_8BIT,   // gamma encoded, in place, as binning_process()
+	BINNING_OUTPUT_RGBA64,   // R, G, B and an opaque A, as GStreamer's RGBA64_LE, whatever the order of the input
+	BINNING_OUTPUT_GRAY16   // the Rec. 709 luminance, as GRAY16_LE
+} BinningOutput;
+
+// What the bins that reach past the right and bottom of the image gather there. Without a border the output stops at
+// the last bin inside the image, with one there is a bin at every pixel (or every bin stride) up to the edge.
+typedef enum
+{
+	BINNING_BORDER_NONE,   // the last binsize-1 rows and columns are left as they were, resize drops partial bins
+	BINNING_BORDER_CLAMP,   // the edge pixel is repeated
+	BINNING_BORDER_MIRROR,   // the image is reflected about the edge pixel
+	BINNING_BORDER_PARTIAL   // only the pixels inside are binned, scaled up to a whole bin
+} BinningBorder;
+
+// What to do to the images, set the defaults with binning_settings_init() and change what is needed.
+// Black levels and contrasts are given for the real r, g and b, whatever the byte order of the format.
+typedef struct
+{
+	BinningAlgorithm algorithm;
+	BinningFormat format;
+	gint binsize;   // 1 to 7, pixels are combined over binsize x binsize
+	gboolean resize;   // put the binned image, reduced by binsize, in the top left rather than bin at every pixel.
+	                   // The rgb bins of resize are sums of the gamma encoded values, the others are summed in linear space,
+	                   // as are those of resize with a dark frame, flat field or defect map.
+	gint bin_stride;   // pixels between bins, 0 to use the binsize (resize) or 1 (no resize), always summed in linear space,
+	                   // so bin_stride = binsize is resize in linear space
+	gint black_r, black_g, black_b;   // subtracted from each pixel
+	gint contrast_r, contrast_g, contrast_b;   // gain*100 applied to the binned values, 100 sums, -1 averages
+	gdouble clip_sigma;   // for BINNING_SIGMA_CLIP
+	BinningOutput output;   // for binning_process_linear()
+	gdouble chroma_weight;   // for BINNING_CHROMA, the mean colour difference of a bin is scaled by this
+	BinningBorder border;
+	gboolean huge_pages;   // the frame sized scratch of the worker pool in huge pages, see binning_memory_alloc()
+} BinningSettings;
+
+// Statistics of the binned output, gathered by the kernels as they write each pixel
+// Only the histograms are accumulated in the pixel loops, min, max, mean and clipped counts are derived from them
+typedef struct
+{
+	guint32 histogram[3][256];   // in buffer order, i.e. b, g, r for BGR data
+} BinningStats;
+
+// Settings prepared for the kernels, immutable and reference counted, so one set can be shared by many threads
+typedef struct _BinningParams BinningParams;
+
+void binning_settings_init(BinningSettings *settings);
+
+BinningParams *binning_params_new(const BinningSettings *settings);
+BinningParams *binning_params_ref(BinningParams *params);
+void binning_params_unref(BinningParams *params);
+
+// Bin one image of width x height pixels, stride bytes from one line to the next.
+// dst may be src to bin in place, otherwise src is copied to dst first and left unchanged.
+// The histograms of the binned pixels are added to stats, unless it is NULL.
+void binning_process(const BinningParams *params, const guint8 *src, guint8 *dst, gint width, gint height, gint stride, BinningStats *stats);
+
+// As binning_process(), with the image split into bands of rows that are binned in parallel on the worker pool
+void binning_process_parallel(const BinningParams *params, const guint8 *src, guint8 *dst, gint width, gint height, gint stride, BinningStats *stats);
+
+// Bin a width x height image from src into a new 16-bit linear image in dst, dst_stride bytes from one line to the next,
+// in the output of the settings. The binned image, of binning_output_size(), is in the top left of dst and the rest is
+// not written. src is left unchanged. The bins are the linear sums of BINNING_RGB, with the colour differences mixed
+// for BINNING_CHROMA, the median and sigma-clip algorithms are summed as BINNING_RGB. They are binned in bands of rows
+// on the worker pool. The gray formats of the settings can only be binned with this. The statistics are those of the 8-bit image that binning_process() would have made.
+void binning_process_linear(const BinningParams *params, const guint8 *src, gint width, gint height, gint stride,
+		guint8 *dst, gint dst_stride, BinningStats *stats);
+
+// libbinning has one pool of worker threads for the whole process. Before the first image is binned in parallel,
+// its number of threads can be set (0 for one per core) and the cores to pin them to, e.g. "0-3,8", NULL not to pin them.
+void binning_pool_configure(gint threads, const gchar *cores);
+
+// Memory for frame sized buffers, aligned to a page. With huge_pages it is in huge pages where the system has them,
+// reserved ones (vm.nr_hugepages) or else transparent ones, otherwise and for less than 1 MB in normal pages.
+// Free it with binning_memory_free().
+gpointer binning_memory_alloc(gsize size, gboolean huge_pages);
+void binning_memory_free(gpointer mem);
+
+// Size of the binned image that binning_process() leaves in the top left of a width x height image
+void binning_output_size(const BinningParams *params, gint width, gint height, gint *out_width, gint *out_height);
+
+G_END_DECLS
+
+#endif /* __BINNING_H__ */
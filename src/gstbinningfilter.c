@@ -51,6 +51,8 @@
  * |[
  * gst-launch-1.0 videotestsrc ! videoconvert ! binningfilter binsize=2 ! videoconvert ! xvimagesink
  * gst-launch-1.0 videotestsrc ! videoconvert ! binningfilter binsize=2 resize=true ! videocrop right=160 bottom=120 ! videoconvert ! xvimagesink
+ * gst-launch-1.0 videotestsrc ! videoconvert ! binningfilter binsize=4 bin-stride=2 ! videocrop right=160 bottom=120 ! videoconvert ! xvimagesink
+ * gst-launch-1.0 videotestsrc ! videoconvert ! binningfilter name=b rcontrast=-1 gcontrast=-1 bcontrast=-1 b.src_1 ! videoconvert ! xvimagesink b.src_3 ! videoconvert ! xvimagesink b.src ! fakesink
  * ]|
  * </refsect2>
  */
@@ -64,6 +66,7 @@
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "gstbinningfilter.h"
 
@@ -83,23 +86,69 @@ enum
 	PROP_ALGORITHM,
 	PROP_BINSIZE,
 	PROP_RESIZE,
+	PROP_BIN_STRIDE,
+	PROP_COMPUTE_STATS,
 	PROP_RBLACK,
 	PROP_GBLACK,
 	PROP_BBLACK,
 	PROP_RCONTRAST,
 	PROP_GCONTRAST,
-	PROP_BCONTRAST
+	PROP_BCONTRAST,
+	PROP_AUTO_LEVELS,
+	PROP_AUTO_LEVELS_SMOOTHING,
+	PROP_AUTO_BINSIZE,
+	PROP_AUTO_BINSIZE_TARGET,
+	PROP_CLIP_SIGMA,
+	PROP_CHROMA_WEIGHT,
+	PROP_BORDER,
+	PROP_COMPARE_A,
+	PROP_COMPARE_B,
+	PROP_OUTPUT_FORMAT,
+	PROP_INCREMENTAL,
+	PROP_INCREMENTAL_THRESHOLD,
+	PROP_INCREMENTAL_TILES_BINNED,
+	PROP_INCREMENTAL_TILES_REUSED,
+	PROP_ASYNC,
+	PROP_ASYNC_QUEUE_SIZE,
+	PROP_SLICE_HEIGHT,
+	PROP_CROP,
+	PROP_HUGE_PAGES,
+	PROP_DARK_FRAME,
+	PROP_FLAT_FIELD,
+	PROP_DEFECT_MAP
 };
 
-#define DEFAULT_PROP_ALGORITHM PROP_RGB
+#define DEFAULT_PROP_ALGORITHM BINNING_RGB
 #define DEFAULT_PROP_BINSIZE 1
 #define DEFAULT_PROP_RESIZE FALSE
+#define DEFAULT_PROP_BIN_STRIDE 0
+#define DEFAULT_PROP_COMPUTE_STATS FALSE
 #define DEFAULT_PROP_RBLACK 0
 #define DEFAULT_PROP_GBLACK 0
 #define DEFAULT_PROP_BBLACK 0
 #define DEFAULT_PROP_RCONTRAST 100
 #define DEFAULT_PROP_GCONTRAST 100
 #define DEFAULT_PROP_BCONTRAST 100
+#define DEFAULT_PROP_AUTO_LEVELS FALSE
+#define DEFAULT_PROP_AUTO_LEVELS_SMOOTHING 0.1
+#define DEFAULT_PROP_AUTO_BINSIZE FALSE
+#define DEFAULT_PROP_AUTO_BINSIZE_TARGET 128
+#define DEFAULT_PROP_CLIP_SIGMA 3.0
+#define DEFAULT_PROP_CHROMA_WEIGHT 2.0
+#define DEFAULT_PROP_BORDER BINNING_BORDER_NONE
+#define DEFAULT_PROP_COMPARE_A BINNING_RGB
+#define DEFAULT_PROP_COMPARE_B BINNING_CHROMA
+#define DEFAULT_PROP_OUTPUT_FORMAT BINNING_OUTPUT_8BIT
+#define DEFAULT_PROP_INCREMENTAL FALSE
+#define DEFAULT_PROP_INCREMENTAL_THRESHOLD 0
+#define DEFAULT_PROP_ASYNC FALSE
+#define DEFAULT_PROP_ASYNC_QUEUE_SIZE 2
+#define DEFAULT_PROP_SLICE_HEIGHT 0
+#define DEFAULT_PROP_CROP FALSE
+#define DEFAULT_PROP_HUGE_PAGES FALSE
+#define DEFAULT_PROP_DARK_FRAME NULL
+#define DEFAULT_PROP_FLAT_FIELD NULL
+#define DEFAULT_PROP_DEFECT_MAP NULL
 
 /* the capabilities of the inputs and outputs.
  *
@@ -109,12 +158,22 @@ static GstStaticPadTemplate sink_factory = GST_STATIC_PAD_TEMPLATE ("sink",
 		GST_PAD_SINK,
 		GST_PAD_ALWAYS,
 		GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE
-				("{ BGR, RGB }"))
+				("{ BGR, RGB, GRAY10_LE32, GRAY10_LE16, GRAY16_LE }"))
 );
 
+// the inputs that can be binned in place, the gray formats need a 16-bit linear output
+static GstStaticCaps rgb_caps = GST_STATIC_CAPS ("video/x-raw, format = (string) { BGR, RGB }");
+
 static GstStaticPadTemplate src_factory = GST_STATIC_PAD_TEMPLATE ("src",
 		GST_PAD_SRC,
 		GST_PAD_ALWAYS,
+		GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE
+				("{ BGR, RGB, RGBA64_LE, GRAY16_LE }"))
+);
+
+static GstStaticPadTemplate src_pyramid_factory = GST_STATIC_PAD_TEMPLATE ("src_%u",
+		GST_PAD_SRC,
+		GST_PAD_REQUEST,
 		GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE
 				("{ BGR, RGB }"))
 );
@@ -128,31 +187,146 @@ static void gst_binningfilter_get_property (GObject * object, guint prop_id,
 		GValue * value, GParamSpec * pspec);
 
 static gboolean gst_binningfilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event);
+static gboolean gst_binningfilter_handle_event (GstPad * pad, GstObject * parent, GstEvent * event);
+static gboolean gst_binningfilter_sink_query (GstPad * pad, GstObject * parent, GstQuery * query);
+static gboolean gst_binningfilter_src_query (GstPad * pad, GstObject * parent, GstQuery * query);
+static gboolean gst_binningfilter_src_activate_mode (GstPad * pad, GstObject * parent, GstPadMode mode, gboolean active);
+static gboolean gst_binningfilter_pyramid_query (GstPad * pad, GstObject * parent, GstQuery * query);
+static GstPad *gst_binningfilter_request_new_pad (GstElement * element, GstPadTemplate * templ,
+		const gchar * name, const GstCaps * caps);
+static void gst_binningfilter_release_pad (GstElement * element, GstPad * pad);
+static GList *gst_binningfilter_get_pyramid_pads (Gstbinningfilter *filter, guint *levels);
 static GstFlowReturn gst_binningfilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf);
+static GstFlowReturn gst_binningfilter_chain_list (GstPad * pad, GstObject * parent, GstBufferList * list);
+static GstFlowReturn gst_binningfilter_process (Gstbinningfilter *filter, GstBuffer * buf);
+static void gst_binningfilter_loop (Gstbinningfilter *filter);
 static void gst_binningfilter_finalize (GObject * object);
+static GstStateChangeReturn gst_binningfilter_change_state (GstElement * element, GstStateChange transition);
+
+/* Make the params for the current property values, binning with the given algorithm */
+static BinningParams *
+gst_binningfilter_params_new_for (Gstbinningfilter *filter, BinningAlgorithm algorithm)
+{
+	BinningSettings settings;
+	BinningParams *params;
+
+	binning_settings_init (&settings);
+	settings.algorithm = algorithm;
+	settings.format = filter->format;   // the library swaps b and r for RGB data
+	settings.binsize = filter->binsize;
+	settings.resize = filter->resize;
+	settings.bin_stride = filter->bin_stride;
+	settings.black_r = filter->black_r; settings.black_g = filter->black_g; settings.black_b = filter->black_b;
+	settings.contrast_r = filter->contrast_r; settings.contrast_g = filter->contrast_g; settings.contrast_b = filter->contrast_b;
+	settings.clip_sigma = filter->clip_sigma;
+	settings.chroma_weight = filter->chroma_weight;
+	settings.border = filter->border;
+	settings.output = filter->output;
+	settings.huge_pages = filter->huge_pages;
+
+	params = binning_params_new (&settings);
+
+	// not shared yet, so the calibration can still be filled in
+	if (filter->dark_valid){
+		params->dark_file = g_mapped_file_ref (filter->dark_file);
+		params->dark = (const guint8 *) g_mapped_file_get_contents (params->dark_file);
+	}
+	if (filter->flat_valid){
+		params->flat_file = g_mapped_file_ref (filter->flat_file);
+		params->flat = (const guint8 *) g_mapped_file_get_contents (params->flat_file);
+		memcpy (params->flat_gain, filter->flat_gain, sizeof (params->flat_gain));
+	}
+	if (filter->defects)
+		params->defects = binning_defects_ref (filter->defects);
+
+	params->corrected = params->dark || params->flat || params->defects;
+
+	return params;
+}
+
+/* Make the params for the current property values, call with the object lock held.
+ * In compare mode they bin with compare-a, see gst_binningfilter_frame_settings() for compare-b. */
+static BinningParams *
+gst_binningfilter_params_new (Gstbinningfilter *filter)
+{
+	if (filter->algorithm != GST_BINNING_COMPARE)
+		return gst_binningfilter_params_new_for (filter, filter->algorithm);
+	if (filter->output != BINNING_OUTPUT_8BIT)   // a linear output is binned as rgb, and not compared
+		return gst_binningfilter_params_new_for (filter, BINNING_RGB);
+
+	return gst_binningfilter_params_new_for (filter, filter->compare_a);
+}
+
+/* The element's part of the settings for the current property values, call with the object lock held */
+static void
+gst_binningfilter_frame_settings (Gstbinningfilter *filter, BinningFrameSettings *frame)
+{
+	frame->compare = NULL;
+	if (filter->algorithm == GST_BINNING_COMPARE && filter->output == BINNING_OUTPUT_8BIT)
+		frame->compare = gst_binningfilter_params_new_for (filter, filter->compare_b);
+
+	frame->compute_stats = filter->compute_stats;
+	frame->auto_levels = filter->auto_levels && !BINNING_FORMAT_IS_GRAY (filter->format);   // sampled from 24-bit frames
+	frame->auto_levels_smoothing = filter->auto_levels_smoothing;
+	frame->auto_binsize = filter->auto_binsize && !BINNING_FORMAT_IS_GRAY (filter->format);   // as auto-levels
+	frame->auto_binsize_target = filter->auto_binsize_target;
+	frame->incremental = filter->incremental && filter->output == BINNING_OUTPUT_8BIT &&   // the cache is of 8-bit images
+			filter->border == BINNING_BORDER_NONE;   // and its tiles would need the pixels a border reads past their own
+	frame->incremental_threshold = filter->incremental_threshold;
+	frame->slice_height = filter->slice_height;
+	frame->crop = filter->crop && !filter->slice_height;   // slices are rows of the whole frame
+}
+
+static void
+gst_binningfilter_pending_free (BinningPendingSettings *pending)
+{
+	binning_params_unref (pending->params);
+	if (pending->frame.compare)
+		binning_params_unref (pending->frame.compare);
+	g_free (pending);
+}
 
+/* Make new settings from the properties and leave them for the streaming thread to take at its next frame,
+ * settings published before that and not yet taken are dropped. Call with the object lock held. */
 void
-create_gamma_lut(Gstbinningfilter *filter)
+gst_binningfilter_publish_params (Gstbinningfilter *filter)
 {
-	unsigned int i;
-	double invgamma = 1.0/GAMMA;
+	BinningPendingSettings *pending = g_new (BinningPendingSettings, 1);
+	BinningPendingSettings *old;
 
-	filter->forward_gamma = g_new(double, IN_RANGE);
-	filter->inverse_gamma = g_new(unsigned int, OUT_RANGE);
+	pending->params = gst_binningfilter_params_new (filter);
+	gst_binningfilter_frame_settings (filter, &pending->frame);
 
-//	GST_DEBUG_OBJECT (filter, "create_gamma_lut NOW !!!!!!!!!");
+	do
+		old = g_atomic_pointer_get (&filter->pending);
+	while (!g_atomic_pointer_compare_and_exchange (&filter->pending, old, pending));
 
-	for (i=0;i<IN_RANGE;i++){
-		filter->forward_gamma[i] = (double)((double)OUT_RANGE * pow(((double)i/(double)FACTOR) + OFFSET, (double)GAMMA));
-//		filter->forward_gamma[i] = (double)((double)OUT_RANGE * pow(((double)i/(double)IN_RANGE), (double)GAMMA));
-//		GST_DEBUG_OBJECT (filter, "forward_gamma: %d - %d", i, filter->forward_gamma[i]);
-	}
+	if (old)
+		gst_binningfilter_pending_free (old);
+}
 
-    // NB Not applying the output offset, OFFSET, here since not adding a linear portion to the gamma curve (see flycapsrc LUT))!!! TODO: Is this OK?
-	for (i=0;i<OUT_RANGE;i++){
-		filter->inverse_gamma[i] = (unsigned int)(IN_RANGE * pow(((double)i/OUT_RANGE), invgamma));
-//		GST_DEBUG_OBJECT (filter, "inverse_gamma: %d - %d", i, filter->inverse_gamma[i]);
+/* The params for the next frame, the newest published if there are any, otherwise those of the last frame,
+ * with the element's part in filter->frame. Only called from the streaming thread, which owns filter->params
+ * and filter->frame */
+static BinningParams *
+gst_binningfilter_take_params (Gstbinningfilter *filter)
+{
+	BinningPendingSettings *pending;
+
+	do
+		pending = g_atomic_pointer_get (&filter->pending);
+	while (pending && !g_atomic_pointer_compare_and_exchange (&filter->pending, pending, NULL));
+
+	if (pending){
+		binning_params_unref (filter->params);
+		if (filter->frame.compare)
+			binning_params_unref (filter->frame.compare);
+		filter->params = pending->params;
+		filter->frame = pending->frame;
+		g_free (pending);
 	}
+
+	return filter->params;
 }
 
 #define TYPE_BUNNINGTYPE (binningtype_get_type ())
@@ -163,9 +337,11 @@ binningtype_get_type (void)
 
   if (!binningtype_type) {
     static GEnumValue binningtype_types[] = {
-	  { PROP_RGB, "Bin R, G and B channels separately.", "rgb" },
-	  { PROP_CHROMA,  "Bin Luminance, maintaining chroma difference signal (B-G and R-G).", "chroma"  },
-	  { PROP_TEST,  "Switch between all options.", "test"  },
+	  { BINNING_RGB, "Bin R, G and B channels separately.", "rgb" },
+	  { BINNING_CHROMA,  "Bin Luminance, maintaining chroma difference signal (B-G and R-G), scaled by chroma-weight.", "chroma"  },
+	  { BINNING_MEDIAN,  "Bin R, G and B channels separately, with the median of each bin scaled to the bin size, robust to impulse noise.", "median"  },
+	  { BINNING_SIGMA_CLIP,  "Bin R, G and B channels separately, with the mean of the values within clip-sigma of the median of each bin.", "sigma-clip"  },
+	  { GST_BINNING_COMPARE,  "Bin each frame with both compare-a and compare-b, time them and measure their difference, pass on the compare-a result.", "compare"  },
       { 0, NULL, NULL },
     };
 
@@ -176,6 +352,72 @@ binningtype_get_type (void)
   return binningtype_type;
 }
 
+/* The algorithms compare mode can run, those of the library */
+#define TYPE_BINNING_KERNEL (binning_kernel_get_type ())
+static GType
+binning_kernel_get_type (void)
+{
+  static GType binning_kernel_type = 0;
+
+  if (!binning_kernel_type) {
+    static GEnumValue binning_kernel_types[] = {
+	  { BINNING_RGB, "Bin R, G and B channels separately.", "rgb" },
+	  { BINNING_CHROMA,  "Bin Luminance, maintaining chroma difference signal (B-G and R-G), scaled by chroma-weight.", "chroma"  },
+	  { BINNING_MEDIAN,  "Bin R, G and B channels separately, with the median of each bin scaled to the bin size.", "median"  },
+	  { BINNING_SIGMA_CLIP,  "Bin R, G and B channels separately, with the mean of the values within clip-sigma of the median of each bin.", "sigma-clip"  },
+      { 0, NULL, NULL },
+    };
+
+    binning_kernel_type =
+	g_enum_register_static ("BinningKernelType", binning_kernel_types);
+  }
+
+  return binning_kernel_type;
+}
+
+#define TYPE_BINNING_OUTPUT (binning_output_get_type ())
+static GType
+binning_output_get_type (void)
+{
+  static GType binning_output_type = 0;
+
+  if (!binning_output_type) {
+    static GEnumValue binning_output_types[] = {
+	  { BINNING_OUTPUT_8BIT, "The format of the input, gamma encoded, binned in place.", "8bit" },
+	  { BINNING_OUTPUT_RGBA64, "RGBA64_LE, the 16-bit linear sums of R, G and B.", "rgba64" },
+	  { BINNING_OUTPUT_GRAY16, "GRAY16_LE, the 16-bit linear luminance of the sums.", "gray16" },
+      { 0, NULL, NULL },
+    };
+
+    binning_output_type =
+	g_enum_register_static ("BinningOutputType", binning_output_types);
+  }
+
+  return binning_output_type;
+}
+
+#define TYPE_BINNING_BORDER (binning_border_get_type ())
+static GType
+binning_border_get_type (void)
+{
+  static GType binning_border_type = 0;
+
+  if (!binning_border_type) {
+    static GEnumValue binning_border_types[] = {
+	  { BINNING_BORDER_NONE, "No bins past the edge, the last binsize-1 rows and columns are left as they were.", "none" },
+	  { BINNING_BORDER_CLAMP, "Bins up to the edge, the edge pixels are repeated past it.", "clamp" },
+	  { BINNING_BORDER_MIRROR, "Bins up to the edge, the image is reflected about the edge pixels.", "mirror" },
+	  { BINNING_BORDER_PARTIAL, "Bins up to the edge, with the pixels inside scaled up to a whole bin.", "partial" },
+      { 0, NULL, NULL },
+    };
+
+    binning_border_type =
+	g_enum_register_static ("BinningBorderType", binning_border_types);
+  }
+
+  return binning_border_type;
+}
+
 
 /* GObject vmethod implementations */
 
@@ -193,6 +435,10 @@ gst_binningfilter_class_init (GstbinningfilterClass * klass)
 	gobject_class->get_property = gst_binningfilter_get_property;
 	gobject_class->finalize = GST_DEBUG_FUNCPTR (gst_binningfilter_finalize);
 
+	gstelement_class->change_state = GST_DEBUG_FUNCPTR (gst_binningfilter_change_state);
+	gstelement_class->request_new_pad = GST_DEBUG_FUNCPTR (gst_binningfilter_request_new_pad);
+	gstelement_class->release_pad = GST_DEBUG_FUNCPTR (gst_binningfilter_release_pad);
+
 	// binning type property
 	g_object_class_install_property (gobject_class, PROP_ALGORITHM,
 			g_param_spec_enum("algorithm", "Binning algorithm.", "Algorithm to use.", TYPE_BUNNINGTYPE, DEFAULT_PROP_ALGORITHM,
@@ -203,7 +449,15 @@ gst_binningfilter_class_init (GstbinningfilterClass * klass)
 	  g_param_spec_int("binsize", "Bin size.", "Pixel data will be combined over the area binsize x binsize.", 1, 7, DEFAULT_PROP_BINSIZE,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
 	g_object_class_install_property (gobject_class, PROP_RESIZE,
-	  g_param_spec_boolean("resize", "Re-size.", "Resize the image as binning is performed. Makes a resized image in the top-left of the buffer, use a videocrop element to remove unwanted area. Only valid for rgb binning.", DEFAULT_PROP_RESIZE,
+	  g_param_spec_boolean("resize", "Re-size.", "Resize the image as binning is performed. Makes a resized image in the top-left of the buffer, use a videocrop element to remove unwanted area. Valid for every algorithm. The rgb bins are sums of the gamma encoded values, unless a dark-frame, flat-field or defect-map is set, those are binned in linear space.", DEFAULT_PROP_RESIZE,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_BIN_STRIDE,
+	  g_param_spec_int("bin-stride", "Bin stride.", "Place a bin every bin-stride pixels, the image is resized by this factor and built up in the top-left of the buffer. 0 (default) uses the binsize with resize and 1 (sliding bins) without. A stride less than the binsize gives overlapping bins. Valid for every algorithm. Always binned in linear space, so a stride equal to the binsize is resize in linear space.", 0, 7, DEFAULT_PROP_BIN_STRIDE,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+
+	// statistics
+	g_object_class_install_property (gobject_class, PROP_COMPUTE_STATS,
+	  g_param_spec_boolean("compute-stats", "Compute statistics.", "Gather per-channel histograms, min, max, mean and clipped pixel counts of the binned image as it is made, and post them in a binningfilter-stats element message for every frame.", DEFAULT_PROP_COMPUTE_STATS,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
 
 	// Black level properties
@@ -228,6 +482,84 @@ gst_binningfilter_class_init (GstbinningfilterClass * klass)
 	  g_param_spec_int("bcontrast", "Blue Contrast.", "A gain of bcontrast/100 will be applied to all blue pixel binned values. Use bcontrast = 100 for normal pixel summation, -1 for averaging.", -1, 1000, DEFAULT_PROP_BCONTRAST,
           (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
 
+	// Automatic level properties
+	g_object_class_install_property (gobject_class, PROP_AUTO_LEVELS,
+	  g_param_spec_boolean("auto-levels", "Automatic levels.", "Track the black and contrast levels of each channel from a sparse sample of every frame. The black level follows a low percentile and the contrast takes a high percentile towards full scale. New levels are used from the next frame and overwrite the black and contrast properties.", DEFAULT_PROP_AUTO_LEVELS,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_AUTO_LEVELS_SMOOTHING,
+	  g_param_spec_double("auto-levels-smoothing", "Automatic level smoothing.", "Fraction of the way the levels move towards those of the latest frame, 1 to follow each frame, smaller for slower changes.", 0.01, 1.0, DEFAULT_PROP_AUTO_LEVELS_SMOOTHING,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_AUTO_BINSIZE,
+	  g_param_spec_boolean("auto-binsize", "Automatic bin size.", "Choose the binsize from the brightness of a sparse sample of every frame, the smallest whose bins reach auto-binsize-target. It only changes once the bins are well past the target, so it does not flicker between two sizes. The new binsize is used from the next frame and overwrites the binsize property.", DEFAULT_PROP_AUTO_BINSIZE,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_AUTO_BINSIZE_TARGET,
+	  g_param_spec_int("auto-binsize-target", "Automatic bin size target.", "Mean level, on the 0-255 scale of the input, that the sum of each bin should reach before the contrast is applied.", 1, 255, DEFAULT_PROP_AUTO_BINSIZE_TARGET,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+
+	g_object_class_install_property (gobject_class, PROP_CLIP_SIGMA,
+	  g_param_spec_double("clip-sigma", "Clipping limit.", "For sigma-clip binning, values further than clip-sigma standard deviations from the median of the bin are left out of its mean. The standard deviation is estimated from the quartiles of the bin.", 0.5, 10.0, DEFAULT_PROP_CLIP_SIGMA,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_CHROMA_WEIGHT,
+	  g_param_spec_double("chroma-weight", "Chroma weight.", "For chroma binning, the mean colour difference (B-G and R-G) of each bin is multiplied by this and added to the summed green, in linear space. 0 gives a gray image, the binsize squared sums the colours as rgb binning does.", 0.0, 49.0, DEFAULT_PROP_CHROMA_WEIGHT,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_BORDER,
+	  g_param_spec_enum("border", "Border mode.", "What the bins that reach past the right and bottom of the frame gather there. With none the last binsize-1 rows and columns are left as they were and resize drops partial bins, with the others there is a bin at every pixel (or bin-stride) up to the edge, so the binned image has the full size, or the size rounded up with resize. Not used with incremental.", TYPE_BINNING_BORDER, DEFAULT_PROP_BORDER,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+
+	// Compare mode properties
+	g_object_class_install_property (gobject_class, PROP_COMPARE_A,
+			g_param_spec_enum("compare-a", "First compared algorithm.", "In compare mode, the algorithm whose result is passed on.", TYPE_BINNING_KERNEL, DEFAULT_PROP_COMPARE_A,
+					(GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_COMPARE_B,
+			g_param_spec_enum("compare-b", "Second compared algorithm.", "In compare mode, the algorithm measured against compare-a, its result is only used for the comparison.", TYPE_BINNING_KERNEL, DEFAULT_PROP_COMPARE_B,
+					(GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+
+	g_object_class_install_property (gobject_class, PROP_OUTPUT_FORMAT,
+			g_param_spec_enum("output-format", "Output format.", "Format of the binned image. The 16-bit formats carry the binned sums in linear intensity, without the gamma of the input and the rounding to 8 bits, with 65535 at the white of the 8-bit output. They go in a new buffer of the size of the input, with the binned image in the top left and the rest black. Rgb and chroma binning write their linear sums, the median and sigma-clip algorithms and compare mode are binned as rgb. They are never binned incrementally. Needed for the gray (GRAY10_LE32, GRAY10_LE16 and GRAY16_LE) input formats. Set before going to PAUSED.", TYPE_BINNING_OUTPUT, DEFAULT_PROP_OUTPUT_FORMAT,
+					(GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	// Incremental binning properties
+	g_object_class_install_property (gobject_class, PROP_INCREMENTAL,
+	  g_param_spec_boolean("incremental", "Incremental binning.", "Compare each frame with the last, in tiles of 32x32 pixels, and only bin again the parts of the image whose input has changed, the rest is copied from the last binned image. For static scenes.", DEFAULT_PROP_INCREMENTAL,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_INCREMENTAL_THRESHOLD,
+	  g_param_spec_int("incremental-threshold", "Incremental binning threshold.", "In incremental mode, a tile is taken as unchanged while no sample in it differs by more than this from the input it was last binned from, to let sensor noise through. 0 bins again on any change.", 0, 255, DEFAULT_PROP_INCREMENTAL_THRESHOLD,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_INCREMENTAL_TILES_BINNED,
+	  g_param_spec_uint64("incremental-tiles-binned", "Tiles binned.", "In incremental mode, the number of tiles of the binned image that have been binned again.", 0, G_MAXUINT64, 0,
+          (GParamFlags) (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+	g_object_class_install_property (gobject_class, PROP_INCREMENTAL_TILES_REUSED,
+	  g_param_spec_uint64("incremental-tiles-reused", "Tiles reused.", "In incremental mode, the number of tiles of the binned image that have been copied from the last frame, with incremental-tiles-binned gives the hit rate.", 0, G_MAXUINT64, 0,
+          (GParamFlags) (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+	// Calibration properties
+	g_object_class_install_property (gobject_class, PROP_DARK_FRAME,
+	  g_param_spec_string("dark-frame", "Dark frame file.", "Raw frame, of the same size and format as the video, that is subtracted pixel by pixel in linear space before binning. The file is memory-mapped when the element goes to READY. Only valid for rgb and chroma binning.", DEFAULT_PROP_DARK_FRAME,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+	g_object_class_install_property (gobject_class, PROP_FLAT_FIELD,
+	  g_param_spec_string("flat-field", "Flat field file.", "Raw frame of a uniformly lit scene, of the same size and format as the video. Each pixel is scaled by the channel mean over its flat field value, in linear space, before binning. The file is memory-mapped when the element goes to READY. Only valid for rgb and chroma binning.", DEFAULT_PROP_FLAT_FIELD,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+	g_object_class_install_property (gobject_class, PROP_DEFECT_MAP,
+	  g_param_spec_string("defect-map", "Defect map file.", "Text file listing defective (hot or dead) pixels, one 'x y' per line, '#' starts a comment. These pixels are left out of every bin they fall in, and those bins are scaled up for the pixels lost. The file is read when the element goes to READY. Only valid for rgb and chroma binning.", DEFAULT_PROP_DEFECT_MAP,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+	// Processing thread properties
+	g_object_class_install_property (gobject_class, PROP_ASYNC,
+	  g_param_spec_boolean("async", "Asynchronous processing.", "Queue incoming frames and bin them on a thread of the element, so that upstream (e.g. the capture loop of a camera source) is not held up while a frame is processed. Set before going to PAUSED.", DEFAULT_PROP_ASYNC,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY)));
+	g_object_class_install_property (gobject_class, PROP_ASYNC_QUEUE_SIZE,
+	  g_param_spec_int("async-queue-size", "Asynchronous queue size.", "Number of frames that can wait to be processed in async mode, upstream blocks when the queue is full.", 1, 16, DEFAULT_PROP_ASYNC_QUEUE_SIZE,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY)));
+	g_object_class_install_property (gobject_class, PROP_SLICE_HEIGHT,
+	  g_param_spec_int("slice-height", "Slice height.", "Push each frame on as slices of this many rows, each as soon as its rows are binned, so that downstream can start on the top of a frame while the rest is binned. Each slice is a buffer of whole rows of the frame with a GstBinningSliceMeta giving its rows, the last of a frame has the MARKER flag. Downstream must expect slices. 0 pushes whole frames.", 0, G_MAXINT, DEFAULT_PROP_SLICE_HEIGHT,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_CROP,
+	  g_param_spec_boolean("crop", "Crop to the binned image.", "Push only the binned image, with src caps of its size, rather than the whole frame with the binned image in its top left. A change of binsize, resize, bin-stride or border is applied at the next frame, with new caps pushed before it, so downstream must accept a change of size. The buffers of each size come from a pool that is kept, switching back to a size does not allocate again. Not used with slice-height.", DEFAULT_PROP_CROP,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING)));
+	g_object_class_install_property (gobject_class, PROP_HUGE_PAGES,
+	  g_param_spec_boolean("huge-pages", "Huge pages.", "Allocate the frame sized scratch and caches (the band scratch of the worker threads, the incremental cache, the compare copy and the pyramid sums) in huge pages, reserved ones (vm.nr_hugepages) if there are any, otherwise transparent ones. Large frames then take far fewer TLB misses. Falls back to normal pages where the system has neither. Set before going to PAUSED.", DEFAULT_PROP_HUGE_PAGES,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY)));
+
 	gst_element_class_set_details_simple(gstelement_class,
 			"binningfilter",
 			"Filter",
@@ -238,6 +570,8 @@ gst_binningfilter_class_init (GstbinningfilterClass * klass)
 			gst_static_pad_template_get (&src_factory));
 	gst_element_class_add_pad_template (gstelement_class,
 			gst_static_pad_template_get (&sink_factory));
+	gst_element_class_add_pad_template (gstelement_class,
+			gst_static_pad_template_get (&src_pyramid_factory));
 }
 
 /* initialize the new element
@@ -253,18 +587,30 @@ gst_binningfilter_init (Gstbinningfilter * filter)
 			GST_DEBUG_FUNCPTR(gst_binningfilter_sink_event));
 	gst_pad_set_chain_function (filter->sinkpad,
 			GST_DEBUG_FUNCPTR(gst_binningfilter_chain));
+	gst_pad_set_chain_list_function (filter->sinkpad,
+			GST_DEBUG_FUNCPTR(gst_binningfilter_chain_list));
+	gst_pad_set_query_function (filter->sinkpad,
+			GST_DEBUG_FUNCPTR(gst_binningfilter_sink_query));
 	GST_PAD_SET_PROXY_CAPS (filter->sinkpad);
 	gst_element_add_pad (GST_ELEMENT (filter), filter->sinkpad);
 
 	filter->srcpad = gst_pad_new_from_static_template (&src_factory, "src");
+	gst_pad_set_query_function (filter->srcpad,
+			GST_DEBUG_FUNCPTR(gst_binningfilter_src_query));
+	gst_pad_set_activatemode_function (filter->srcpad,
+			GST_DEBUG_FUNCPTR(gst_binningfilter_src_activate_mode));
 	GST_PAD_SET_PROXY_CAPS (filter->srcpad);
 	gst_element_add_pad (GST_ELEMENT (filter), filter->srcpad);
 
 	filter->format_is_RGB = FALSE;
+	filter->format = BINNING_FORMAT_BGR;
 
 	filter->algorithm = DEFAULT_PROP_ALGORITHM;
 	filter->binsize = DEFAULT_PROP_BINSIZE;
 	filter->resize = DEFAULT_PROP_RESIZE;
+	filter->bin_stride = DEFAULT_PROP_BIN_STRIDE;
+	filter->compute_stats = DEFAULT_PROP_COMPUTE_STATS;
+	filter->stats = NULL;
 
 	filter->black_r = DEFAULT_PROP_RBLACK;
 	filter->black_g = DEFAULT_PROP_GBLACK;
@@ -274,19 +620,113 @@ gst_binningfilter_init (Gstbinningfilter * filter)
 	filter->contrast_g = DEFAULT_PROP_GCONTRAST;
 	filter->contrast_b = DEFAULT_PROP_BCONTRAST;
 
-	create_gamma_lut(filter);
+	filter->auto_levels = DEFAULT_PROP_AUTO_LEVELS;
+	filter->auto_levels_smoothing = DEFAULT_PROP_AUTO_LEVELS_SMOOTHING;
+	filter->auto_binsize = DEFAULT_PROP_AUTO_BINSIZE;
+	filter->auto_binsize_target = DEFAULT_PROP_AUTO_BINSIZE_TARGET;
+	filter->clip_sigma = DEFAULT_PROP_CLIP_SIGMA;
+	filter->chroma_weight = DEFAULT_PROP_CHROMA_WEIGHT;
+	filter->border = DEFAULT_PROP_BORDER;
+	filter->auto_levels_valid = FALSE;
+	filter->levels_changed = 0;
+
+	filter->compare_a = DEFAULT_PROP_COMPARE_A;
+	filter->compare_b = DEFAULT_PROP_COMPARE_B;
+	filter->compare_scratch = NULL;
+	filter->compare_scratch_size = 0;
+	memset(&filter->compare_totals, 0, sizeof(filter->compare_totals));
+
+	filter->output_format = filter->output = DEFAULT_PROP_OUTPUT_FORMAT;
+	gst_video_info_init(&filter->output_info);
+
+	filter->incremental = DEFAULT_PROP_INCREMENTAL;
+	filter->incremental_threshold = DEFAULT_PROP_INCREMENTAL_THRESHOLD;
+	filter->incremental_params = NULL;
+	filter->incremental_reference = filter->incremental_output = NULL;
+	filter->incremental_size = 0;
+	filter->tiles_binned = filter->tiles_reused = 0;
+
+	filter->pyramid_pads = NULL;
+	filter->pyramid_reserved = 0;
+	memset(filter->pyramid_caps, 0, sizeof(filter->pyramid_caps));
+	filter->pyramid_sums = NULL;
+	filter->pyramid_sums_size = 0;
+
+	filter->dark_frame_location = DEFAULT_PROP_DARK_FRAME;
+	filter->flat_field_location = DEFAULT_PROP_FLAT_FIELD;
+	filter->dark_file = filter->flat_file = NULL;
+	filter->dark_valid = filter->flat_valid = FALSE;
+	filter->defect_map_location = DEFAULT_PROP_DEFECT_MAP;
+	filter->defect_list = NULL;
+	filter->defect_list_length = 0;
+	filter->defects = NULL;
+
+	filter->frame_duration = GST_CLOCK_TIME_NONE;
+
+	filter->async = DEFAULT_PROP_ASYNC;
+	filter->async_queue_size = DEFAULT_PROP_ASYNC_QUEUE_SIZE;
+	filter->slice_height = DEFAULT_PROP_SLICE_HEIGHT;
+	filter->crop = DEFAULT_PROP_CROP;
+	filter->huge_pages = DEFAULT_PROP_HUGE_PAGES;
+	filter->output_caps = NULL;
+	filter->src_width = filter->src_height = 0;
+	memset (filter->crop_pools, 0, sizeof (filter->crop_pools));
+	filter->async_running = FALSE;
+	g_queue_init(&filter->async_queue);
+	filter->async_queued = 0;
+	filter->async_busy = FALSE;
+	filter->async_result = GST_FLOW_FLUSHING;
+	g_mutex_init(&filter->async_lock);
+	g_cond_init(&filter->async_cond);
+
+	binning_gamma_luts(&filter->forward_gamma, &filter->inverse_gamma);
+
+	filter->params = gst_binningfilter_params_new(filter);
+	gst_binningfilter_frame_settings(filter, &filter->frame);
+	filter->pending = NULL;
 }
 
 static void
 gst_binningfilter_finalize (GObject * object)
 {
 	Gstbinningfilter *filter = GST_BINNINGFILTER (object);
-
-	g_free(filter->forward_gamma);
-	filter->forward_gamma = NULL;
-
-	g_free(filter->inverse_gamma);
-	filter->inverse_gamma = NULL;
+	gint level;
+
+	binning_params_unref(filter->params);
+	filter->params = NULL;
+	if (filter->frame.compare)
+		binning_params_unref(filter->frame.compare);
+	filter->frame.compare = NULL;
+	if (filter->pending)
+		gst_binningfilter_pending_free(filter->pending);
+	filter->pending = NULL;
+
+	if (filter->dark_file)
+		g_mapped_file_unref(filter->dark_file);
+	if (filter->flat_file)
+		g_mapped_file_unref(filter->flat_file);
+	g_free(filter->dark_frame_location);
+	g_free(filter->flat_field_location);
+	g_free(filter->defect_map_location);
+	g_free(filter->defect_list);
+	if (filter->defects)
+		binning_defects_unref(filter->defects);
+
+	for(level=1; level<=PYRAMID_MAX_LEVELS; level++)
+		if (filter->pyramid_caps[level])
+			gst_caps_unref(filter->pyramid_caps[level]);
+	binning_memory_free(filter->pyramid_sums);
+	filter->pyramid_sums = NULL;
+	binning_memory_free(filter->compare_scratch);
+	filter->compare_scratch = NULL;
+	gst_binningfilter_compare_reset(filter);
+	gst_binningfilter_incremental_reset(filter);
+	gst_binningfilter_crop_reset(filter);
+
+	g_queue_foreach(&filter->async_queue, (GFunc) gst_mini_object_unref, NULL);
+	g_queue_clear(&filter->async_queue);
+	g_mutex_clear(&filter->async_lock);
+	g_cond_clear(&filter->async_cond);
 
 	G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -297,6 +737,7 @@ gst_binningfilter_set_property (GObject * object, guint prop_id,
 {
 	Gstbinningfilter *filter = GST_BINNINGFILTER (object);
 
+	GST_OBJECT_LOCK (filter);
 	switch (prop_id) {
 	case PROP_ALGORITHM:
 		filter->algorithm = g_value_get_enum (value);
@@ -307,6 +748,12 @@ gst_binningfilter_set_property (GObject * object, guint prop_id,
 	case PROP_RESIZE:
 		filter->resize = g_value_get_boolean(value);
 		break;
+	case PROP_BIN_STRIDE:
+		filter->bin_stride = g_value_get_int (value);
+		break;
+	case PROP_COMPUTE_STATS:
+		filter->compute_stats = g_value_get_boolean (value);
+		break;
 	case PROP_RBLACK:
 		filter->black_r = g_value_get_int (value);
 		break;
@@ -325,10 +772,77 @@ gst_binningfilter_set_property (GObject * object, guint prop_id,
 	case PROP_BCONTRAST:
 		filter->contrast_b = g_value_get_int (value);
 		break;
+	case PROP_AUTO_LEVELS:
+		filter->auto_levels = g_value_get_boolean (value);   // the streaming thread starts again when it sees it off
+		break;
+	case PROP_AUTO_LEVELS_SMOOTHING:
+		filter->auto_levels_smoothing = g_value_get_double (value);
+		break;
+	case PROP_AUTO_BINSIZE:
+		filter->auto_binsize = g_value_get_boolean (value);
+		break;
+	case PROP_AUTO_BINSIZE_TARGET:
+		filter->auto_binsize_target = g_value_get_int (value);
+		break;
+	case PROP_CLIP_SIGMA:
+		filter->clip_sigma = g_value_get_double (value);
+		break;
+	case PROP_CHROMA_WEIGHT:
+		filter->chroma_weight = g_value_get_double (value);
+		break;
+	case PROP_COMPARE_A:
+		filter->compare_a = g_value_get_enum (value);
+		break;
+	case PROP_COMPARE_B:
+		filter->compare_b = g_value_get_enum (value);
+		break;
+	case PROP_OUTPUT_FORMAT:
+		filter->output_format = g_value_get_enum (value);   // used from the next caps
+		break;
+	case PROP_BORDER:
+		filter->border = g_value_get_enum (value);
+		break;
+	case PROP_INCREMENTAL:
+		filter->incremental = g_value_get_boolean (value);
+		break;
+	case PROP_INCREMENTAL_THRESHOLD:
+		filter->incremental_threshold = g_value_get_int (value);
+		break;
+	case PROP_ASYNC:
+		filter->async = g_value_get_boolean (value);
+		break;
+	case PROP_ASYNC_QUEUE_SIZE:
+		filter->async_queue_size = g_value_get_int (value);
+		break;
+	case PROP_SLICE_HEIGHT:
+		filter->slice_height = g_value_get_int (value);
+		break;
+	case PROP_CROP:
+		filter->crop = g_value_get_boolean (value);
+		break;
+	case PROP_HUGE_PAGES:
+		filter->huge_pages = g_value_get_boolean (value);
+		break;
+	case PROP_DARK_FRAME:
+		g_free (filter->dark_frame_location);
+		filter->dark_frame_location = g_value_dup_string (value);
+		break;
+	case PROP_FLAT_FIELD:
+		g_free (filter->flat_field_location);
+		filter->flat_field_location = g_value_dup_string (value);
+		break;
+	case PROP_DEFECT_MAP:
+		g_free (filter->defect_map_location);
+		filter->defect_map_location = g_value_dup_string (value);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
 	}
+
+	// used from the next frame
+	gst_binningfilter_publish_params(filter);
+	GST_OBJECT_UNLOCK (filter);
 }
 
 static void
@@ -337,6 +851,7 @@ gst_binningfilter_get_property (GObject * object, guint prop_id,
 {
 	Gstbinningfilter *filter = GST_BINNINGFILTER (object);
 
+	GST_OBJECT_LOCK (filter);
 	switch (prop_id) {
 	case PROP_ALGORITHM:
 		g_value_set_enum(value, filter->algorithm);
@@ -347,47 +862,236 @@ gst_binningfilter_get_property (GObject * object, guint prop_id,
 	case PROP_RESIZE:
 		g_value_set_boolean(value, filter->resize);
 		break;
+	case PROP_BIN_STRIDE:
+		g_value_set_int (value, filter->bin_stride);
+		break;
+	case PROP_COMPUTE_STATS:
+		g_value_set_boolean (value, filter->compute_stats);
+		break;
 	case PROP_RBLACK:
-		if(!filter->format_is_RGB)
-			g_value_set_int (value, filter->black_r);
-		else
-			g_value_set_int (value, filter->black_b);	 // if RGB format data reverse r and b
+		g_value_set_int (value, filter->black_r);   // the real colour, as set, whatever the byte order
 		break;
 	case PROP_GBLACK:
 		g_value_set_int (value, filter->black_g);
 		break;
 	case PROP_BBLACK:
-		if(!filter->format_is_RGB)
-			g_value_set_int (value, filter->black_b);
-		else
-			g_value_set_int (value, filter->black_r);	 // if RGB format data reverse r and b
+		g_value_set_int (value, filter->black_b);   // the real colour, as set, whatever the byte order
 		break;
 	case PROP_RCONTRAST:
-		if(!filter->format_is_RGB)
-			g_value_set_int (value, filter->contrast_r);
-		else
-			g_value_set_int (value, filter->contrast_b);	 // if RGB format data reverse r and b
+		g_value_set_int (value, filter->contrast_r);   // the real colour, as set, whatever the byte order
 		break;
 	case PROP_GCONTRAST:
 		g_value_set_int (value, filter->contrast_g);
 		break;
 	case PROP_BCONTRAST:
-		if(!filter->format_is_RGB)
-			g_value_set_int (value, filter->contrast_b);
-		else
-			g_value_set_int (value, filter->contrast_r);	 // if RGB format data reverse r and b
+		g_value_set_int (value, filter->contrast_b);   // the real colour, as set, whatever the byte order
+		break;
+	case PROP_AUTO_LEVELS:
+		g_value_set_boolean (value, filter->auto_levels);
+		break;
+	case PROP_AUTO_LEVELS_SMOOTHING:
+		g_value_set_double (value, filter->auto_levels_smoothing);
+		break;
+	case PROP_AUTO_BINSIZE:
+		g_value_set_boolean (value, filter->auto_binsize);
+		break;
+	case PROP_AUTO_BINSIZE_TARGET:
+		g_value_set_int (value, filter->auto_binsize_target);
+		break;
+	case PROP_CLIP_SIGMA:
+		g_value_set_double (value, filter->clip_sigma);
+		break;
+	case PROP_CHROMA_WEIGHT:
+		g_value_set_double (value, filter->chroma_weight);
+		break;
+	case PROP_COMPARE_A:
+		g_value_set_enum (value, filter->compare_a);
+		break;
+	case PROP_COMPARE_B:
+		g_value_set_enum (value, filter->compare_b);
+		break;
+	case PROP_OUTPUT_FORMAT:
+		g_value_set_enum (value, filter->output_format);
+		break;
+	case PROP_BORDER:
+		g_value_set_enum (value, filter->border);
+		break;
+	case PROP_INCREMENTAL:
+		g_value_set_boolean (value, filter->incremental);
+		break;
+	case PROP_INCREMENTAL_THRESHOLD:
+		g_value_set_int (value, filter->incremental_threshold);
+		break;
+	case PROP_INCREMENTAL_TILES_BINNED:
+		g_value_set_uint64 (value, filter->tiles_binned);
+		break;
+	case PROP_INCREMENTAL_TILES_REUSED:
+		g_value_set_uint64 (value, filter->tiles_reused);
+		break;
+	case PROP_ASYNC:
+		g_value_set_boolean (value, filter->async);
+		break;
+	case PROP_ASYNC_QUEUE_SIZE:
+		g_value_set_int (value, filter->async_queue_size);
+		break;
+	case PROP_SLICE_HEIGHT:
+		g_value_set_int (value, filter->slice_height);
+		break;
+	case PROP_CROP:
+		g_value_set_boolean (value, filter->crop);
+		break;
+	case PROP_HUGE_PAGES:
+		g_value_set_boolean (value, filter->huge_pages);
+		break;
+	case PROP_DARK_FRAME:
+		g_value_set_string (value, filter->dark_frame_location);
+		break;
+	case PROP_FLAT_FIELD:
+		g_value_set_string (value, filter->flat_field_location);
+		break;
+	case PROP_DEFECT_MAP:
+		g_value_set_string (value, filter->defect_map_location);
 		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
 	}
+	GST_OBJECT_UNLOCK (filter);
+}
+
+/* Caps on the other side of the element, the same size and rate, with a 16-bit linear output in its format.
+ * direction is that of the pad the caps are for, from sink caps the src caps are made and the other way round.
+ * Binned in place, the caps are the same on both sides and only the 24-bit formats. */
+static GstCaps *
+gst_binningfilter_transform_format (Gstbinningfilter *filter, GstPadDirection direction, GstCaps *caps)
+{
+	BinningOutput output;
+	GstCaps *ret;
+	guint i;
+
+	GST_OBJECT_LOCK (filter);
+	output = filter->output_format;
+	GST_OBJECT_UNLOCK (filter);
+
+	if (!caps)
+		return NULL;
+	if (output == BINNING_OUTPUT_8BIT){
+		GstCaps *rgb = gst_static_caps_get (&rgb_caps);
+		GstCaps *result = gst_caps_intersect (caps, rgb);
+
+		gst_caps_unref (rgb);
+		return result;
+	}
+
+	ret = gst_caps_copy (caps);
+	for (i = 0; i < gst_caps_get_size (ret); i++){
+		GstStructure *structure = gst_caps_get_structure (ret, i);
+
+		if (direction == GST_PAD_SINK)
+			gst_structure_set (structure, "format", G_TYPE_STRING, output == BINNING_OUTPUT_GRAY16 ? "GRAY16_LE" : "RGBA64_LE", NULL);
+		else   // made from either input format, the sink template narrows it down again
+			gst_structure_remove_field (structure, "format");
+	}
+
+	return ret;
+}
+
+/* As gst_binningfilter_transform_format(), with any size the cropped output can have when it is cropped */
+static GstCaps *
+gst_binningfilter_transform_caps (Gstbinningfilter *filter, GstPadDirection direction, GstCaps *caps)
+{
+	GstCaps *ret;
+	gboolean crop;
+
+	GST_OBJECT_LOCK (filter);
+	crop = filter->crop && !filter->slice_height;
+	GST_OBJECT_UNLOCK (filter);
+
+	ret = gst_binningfilter_transform_format (filter, direction, caps);
+	if (ret && crop){
+		ret = gst_caps_make_writable (ret);
+		gst_binningfilter_crop_transform_caps (ret, direction);
+	}
+
+	return ret;
 }
 
 /* GstElement vmethod implementations */
 
-/* this function handles sink events */
+/* this function handles sink events
+ * in async mode serialized events are queued with the buffers, so that the task sees them in stream order
+ */
 static gboolean
 gst_binningfilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (parent);
+	gboolean ret;
+
+	if (!filter->async_running)
+		return gst_binningfilter_handle_event (pad, parent, event);
+
+	switch (GST_EVENT_TYPE (event)) {
+	case GST_EVENT_FLUSH_START:
+		ret = gst_pad_push_event (filter->srcpad, event);
+
+		// unblock the chain function and stop the task
+		g_mutex_lock (&filter->async_lock);
+		filter->async_result = GST_FLOW_FLUSHING;
+		g_cond_broadcast (&filter->async_cond);
+		g_mutex_unlock (&filter->async_lock);
+		gst_pad_pause_task (filter->srcpad);
+		break;
+	case GST_EVENT_FLUSH_STOP:
+		g_mutex_lock (&filter->async_lock);
+		g_queue_foreach (&filter->async_queue, (GFunc) gst_mini_object_unref, NULL);
+		g_queue_clear (&filter->async_queue);
+		filter->async_queued = 0;
+		filter->async_result = GST_FLOW_OK;
+		g_mutex_unlock (&filter->async_lock);
+
+		ret = gst_pad_push_event (filter->srcpad, event);
+		gst_pad_start_task (filter->srcpad, (GstTaskFunction) gst_binningfilter_loop, filter, NULL);
+		break;
+	default:
+		if (!GST_EVENT_IS_SERIALIZED (event))
+			return gst_binningfilter_handle_event (pad, parent, event);
+
+		g_mutex_lock (&filter->async_lock);
+		ret = filter->async_result == GST_FLOW_OK;
+		if (ret){
+			g_queue_push_tail (&filter->async_queue, event);
+			g_cond_broadcast (&filter->async_cond);
+		}
+		g_mutex_unlock (&filter->async_lock);
+
+		if (!ret)
+			gst_event_unref (event);
+		break;
+	}
+
+	return ret;
+}
+
+/* The format of the library for that of the caps */
+static BinningFormat
+gst_binningfilter_format_from_string (const gchar *format)
+{
+	if (!format)
+		return BINNING_FORMAT_BGR;
+	if (strcmp (format, "RGB") == 0)
+		return BINNING_FORMAT_RGB;
+	if (strcmp (format, "GRAY10_LE32") == 0)
+		return BINNING_FORMAT_GRAY10_LE32;
+	if (strcmp (format, "GRAY10_LE16") == 0)
+		return BINNING_FORMAT_GRAY10_LE16;
+	if (strcmp (format, "GRAY16_LE") == 0)
+		return BINNING_FORMAT_GRAY16_LE;
+	return BINNING_FORMAT_BGR;
+}
+
+/* Act on an event in stream order, called from the sink event function or from the task in async mode */
+static gboolean
+gst_binningfilter_handle_event (GstPad * pad, GstObject * parent, GstEvent * event)
 {
 	gboolean ret;
 	Gstbinningfilter *filter;
@@ -398,8 +1102,10 @@ gst_binningfilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event
 	switch (GST_EVENT_TYPE (event)) {
 	case GST_EVENT_CAPS:
 	{
-		GstCaps *caps;
+		GstCaps *caps, *out_caps = NULL;
 		GstStructure *structure;
+		GstVideoInfo in_info;
+		BinningFormat input_format;
 
 		gst_event_parse_caps (event, &caps);
 		/* do something with the caps */
@@ -414,25 +1120,67 @@ gst_binningfilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event
 
 			filter->stride = filter->width * 3;  // TODO Not sure how to get this properly, but we have BGR or RGB data
 
+			gint fps_n = 0, fps_d = 1;
+			gst_structure_get_fraction (structure, "framerate", &fps_n, &fps_d);
+			GST_OBJECT_LOCK (filter);
+			if (fps_n > 0)
+				filter->frame_duration = gst_util_uint64_scale_int (GST_SECOND, fps_d, fps_n);
+			else
+				filter->frame_duration = GST_CLOCK_TIME_NONE;
+			GST_OBJECT_UNLOCK (filter);
+
 			format = gst_structure_get_string (structure, "format");
 			if (!format) {
 				GST_ERROR_OBJECT (filter, "No format available\n");
 			}
+			input_format = gst_binningfilter_format_from_string (format);
+
+			if (BINNING_FORMAT_IS_GRAY (input_format) && gst_video_info_from_caps (&in_info, caps))
+				filter->stride = GST_VIDEO_INFO_PLANE_STRIDE (&in_info, 0);   // rows of packed samples are padded to whole words
+
+			gst_binningfilter_calibration_set_caps(filter);
 
-			if (strcmp(format, "RGB")==0){
-				filter->format_is_RGB = TRUE;
+			// with a 16-bit linear output the src pad has caps of its own
+			out_caps = gst_binningfilter_transform_format (filter, GST_PAD_SINK, caps);
+			gst_video_info_from_caps (&filter->output_info, out_caps);
+
+			// the params carry the blacks and contrasts in buffer order, so remake them for the new format
+			GST_OBJECT_LOCK (filter);
+			filter->format_is_RGB = input_format == BINNING_FORMAT_RGB;
+			filter->format = input_format;
+			filter->output = filter->output_format;
+			gst_binningfilter_publish_params(filter);
+			GST_OBJECT_UNLOCK (filter);
+			if (filter->format_is_RGB)
 				GST_DEBUG_OBJECT (filter, "Format is RGB");
-			}
 
 			GST_DEBUG_OBJECT (filter, "The video size of this set of capabilities is %dx%d, %d\n",
 					filter->width, filter->height, filter->stride);
+
+			// each pyramid pad gets the caps of its own level
+			GList *pyramid_pads, *l;
+			GST_OBJECT_LOCK (filter);
+			gst_binningfilter_pyramid_set_caps(filter, caps);
+			GST_OBJECT_UNLOCK (filter);
+			pyramid_pads = gst_binningfilter_get_pyramid_pads(filter, NULL);
+			for (l = pyramid_pads; l; l = l->next)
+				gst_pad_push_event (GST_PAD (l->data), gst_event_new_caps (filter->pyramid_caps[PYRAMID_PAD_LEVEL (l->data)]));
+			g_list_free_full (pyramid_pads, gst_object_unref);
 		}
 		else {
 			GST_ERROR_OBJECT (filter, "Caps not fixed.\n");
 		}
 
-		/* and forward */
-		ret = gst_pad_event_default (pad, parent, event);
+		/* and forward, to the main src pad only, with the size of the binned image when it is cropped */
+		if (out_caps){
+			gst_caps_replace (&filter->output_caps, out_caps);
+			filter->src_width = filter->src_height = 0;
+			gst_event_unref (event);
+			ret = gst_binningfilter_crop_set_caps (filter, gst_binningfilter_take_params(filter)) == GST_FLOW_OK;
+			gst_caps_unref (out_caps);
+		}
+		else
+			ret = gst_pad_push_event (filter->srcpad, event);
 		break;
 	}
 	case GST_EVENT_EOS:
@@ -447,42 +1195,804 @@ gst_binningfilter_sink_event (GstPad * pad, GstObject * parent, GstEvent * event
 	return ret;
 }
 
-/* chain function
- * this function does the actual processing
+/* this function handles sink queries
+ * caps are only proxied to the main src pad, in the format of a 16-bit linear output when there is one,
+ * the pyramid pads follow whatever is negotiated there
  */
-static GstFlowReturn
-gst_binningfilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+static gboolean
+gst_binningfilter_sink_query (GstPad * pad, GstObject * parent, GstQuery * query)
 {
-	Gstbinningfilter *filter;
+	Gstbinningfilter *filter = GST_BINNINGFILTER (parent);
 
-	filter = GST_BINNINGFILTER (parent);
+	switch (GST_QUERY_TYPE (query)) {
+	case GST_QUERY_CAPS:
+	{
+		GstCaps *filter_caps, *src_filter, *peer_caps, *out_templ, *out_caps, *in_caps, *templ, *caps;
+
+		gst_query_parse_caps (query, &filter_caps);
+		templ = gst_pad_get_pad_template_caps (pad);
+		src_filter = gst_binningfilter_transform_caps (filter, GST_PAD_SINK, filter_caps);
+		peer_caps = gst_pad_peer_query_caps (filter->srcpad, src_filter);
+		out_templ = gst_binningfilter_transform_caps (filter, GST_PAD_SINK, templ);   // what the element can give
+		out_caps = gst_caps_intersect_full (peer_caps, out_templ, GST_CAPS_INTERSECT_FIRST);
+		in_caps = gst_binningfilter_transform_caps (filter, GST_PAD_SRC, out_caps);
+		caps = gst_caps_intersect_full (in_caps, templ, GST_CAPS_INTERSECT_FIRST);
+		gst_query_set_caps_result (query, caps);
+		gst_caps_unref (caps);
+		gst_caps_unref (in_caps);
+		gst_caps_unref (out_caps);
+		gst_caps_unref (out_templ);
+		gst_caps_unref (peer_caps);
+		if (src_filter)
+			gst_caps_unref (src_filter);
+		gst_caps_unref (templ);
+		return TRUE;
+	}
+	case GST_QUERY_ACCEPT_CAPS:
+	{
+		GstCaps *caps, *out_caps, *templ;
+		gboolean result;
+
+		gst_query_parse_accept_caps (query, &caps);
+		templ = gst_pad_get_pad_template_caps (pad);
+		out_caps = gst_binningfilter_transform_caps (filter, GST_PAD_SINK, caps);
+		result = gst_caps_is_subset (caps, templ) && gst_pad_peer_query_accept_caps (filter->srcpad, out_caps);
+		gst_query_set_accept_caps_result (query, result);
+		gst_caps_unref (out_caps);
+		gst_caps_unref (templ);
+		return TRUE;
+	}
+	default:
+		// serialized queries (e.g. allocation) must only be answered once the frames before them are done
+		if (filter->async_running && GST_QUERY_IS_SERIALIZED (query)){
+			g_mutex_lock (&filter->async_lock);
+			while (filter->async_result == GST_FLOW_OK && (!g_queue_is_empty (&filter->async_queue) || filter->async_busy))
+				g_cond_wait (&filter->async_cond, &filter->async_lock);
+			g_mutex_unlock (&filter->async_lock);
+		}
+		return gst_pad_query_default (pad, parent, query);
+	}
+}
+
+/* this function handles queries on the src pads
+ * in async mode a frame can wait behind a full queue, which adds to the latency that downstream can allow for,
+ * caps are proxied to the sink pad unless the output is 16-bit linear, they are then made from those upstream
+ */
+static gboolean
+gst_binningfilter_src_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (parent);
+	gboolean linear;
+
+	GST_OBJECT_LOCK (filter);
+	linear = filter->output_format != BINNING_OUTPUT_8BIT;
+	GST_OBJECT_UNLOCK (filter);
+
+	switch (GST_QUERY_TYPE (query)) {
+	case GST_QUERY_CAPS:
+	{
+		GstCaps *filter_caps, *sink_filter, *peer_caps, *in_caps, *out_caps, *templ, *sink_templ, *caps;
+
+		if (!linear)
+			return gst_pad_query_default (pad, parent, query);
+
+		gst_query_parse_caps (query, &filter_caps);
+		templ = gst_pad_get_pad_template_caps (pad);
+		sink_templ = gst_pad_get_pad_template_caps (filter->sinkpad);
+		sink_filter = gst_binningfilter_transform_caps (filter, GST_PAD_SRC, filter_caps);
+		peer_caps = gst_pad_peer_query_caps (filter->sinkpad, sink_filter);
+		in_caps = gst_caps_intersect_full (peer_caps, sink_templ, GST_CAPS_INTERSECT_FIRST);   // what the element can take
+		out_caps = gst_binningfilter_transform_caps (filter, GST_PAD_SINK, in_caps);
+		caps = gst_caps_intersect_full (out_caps, templ, GST_CAPS_INTERSECT_FIRST);
+		if (filter_caps){
+			GstCaps *tmp = gst_caps_intersect_full (filter_caps, caps, GST_CAPS_INTERSECT_FIRST);
+			gst_caps_unref (caps);
+			caps = tmp;
+		}
+		gst_query_set_caps_result (query, caps);
+		gst_caps_unref (caps);
+		gst_caps_unref (out_caps);
+		gst_caps_unref (in_caps);
+		gst_caps_unref (peer_caps);
+		if (sink_filter)
+			gst_caps_unref (sink_filter);
+		gst_caps_unref (sink_templ);
+		gst_caps_unref (templ);
+		return TRUE;
+	}
+	case GST_QUERY_ACCEPT_CAPS:
+	{
+		GstCaps *caps, *in_caps, *peer_caps, *templ, *sink_templ;
+		gboolean result;
+
+		if (!linear)
+			return gst_pad_query_default (pad, parent, query);
+
+		// accepted when upstream can give an input that it is made from
+		gst_query_parse_accept_caps (query, &caps);
+		templ = gst_pad_get_pad_template_caps (pad);
+		sink_templ = gst_pad_get_pad_template_caps (filter->sinkpad);
+		in_caps = gst_binningfilter_transform_caps (filter, GST_PAD_SRC, caps);
+		peer_caps = gst_pad_peer_query_caps (filter->sinkpad, in_caps);
+		result = gst_caps_is_subset (caps, templ) && gst_caps_can_intersect (peer_caps, sink_templ);
+		gst_query_set_accept_caps_result (query, result);
+		gst_caps_unref (peer_caps);
+		gst_caps_unref (in_caps);
+		gst_caps_unref (sink_templ);
+		gst_caps_unref (templ);
+		return TRUE;
+	}
+	case GST_QUERY_LATENCY:
+	{
+		gboolean live;
+		GstClockTime min, max, frame_duration;
+
+		if (!gst_pad_peer_query (filter->sinkpad, query))
+			return FALSE;
+
+		if (filter->async_running){
+			gst_query_parse_latency (query, &live, &min, &max);
 
-	// Process image
-	switch (filter->algorithm) {
-	case PROP_RGB:
+			GST_OBJECT_LOCK (filter);
+			frame_duration = filter->frame_duration;
+			GST_OBJECT_UNLOCK (filter);
+
+			// capture and processing overlap, so the minimum is not changed, only how long a frame can be held
+			if (max != GST_CLOCK_TIME_NONE){
+				if (frame_duration != GST_CLOCK_TIME_NONE)
+					max += frame_duration * filter->async_queue_size;
+				else
+					max = GST_CLOCK_TIME_NONE;
+			}
+			GST_DEBUG_OBJECT (filter, "Latency with async queue min %" GST_TIME_FORMAT " max %" GST_TIME_FORMAT,
+					GST_TIME_ARGS (min), GST_TIME_ARGS (max));
+			gst_query_set_latency (query, live, min, max);
+		}
+		return TRUE;
+	}
 	default:
-		if(!filter->resize)
-			gst_bin_image_rgb(filter, buf);
+		return gst_pad_query_default (pad, parent, query);
+	}
+}
+
+/* Start the processing task with the src pad in async mode, and stop it again */
+static gboolean
+gst_binningfilter_src_activate_mode (GstPad * pad, GstObject * parent, GstPadMode mode, gboolean active)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (parent);
+	gboolean ret = TRUE;
+
+	if (mode != GST_PAD_MODE_PUSH)
+		return FALSE;
+
+	if (active){
+		filter->async_running = filter->async;
+		if (filter->async_running){
+			g_mutex_lock (&filter->async_lock);
+			filter->async_result = GST_FLOW_OK;
+			g_mutex_unlock (&filter->async_lock);
+			ret = gst_pad_start_task (pad, (GstTaskFunction) gst_binningfilter_loop, filter, NULL);
+		}
+	}
+	else if (filter->async_running){
+		g_mutex_lock (&filter->async_lock);
+		filter->async_result = GST_FLOW_FLUSHING;
+		g_cond_broadcast (&filter->async_cond);
+		g_mutex_unlock (&filter->async_lock);
+
+		ret = gst_pad_stop_task (pad);   // waits for the task to finish the frame it is on
+
+		g_queue_foreach (&filter->async_queue, (GFunc) gst_mini_object_unref, NULL);
+		g_queue_clear (&filter->async_queue);
+		filter->async_queued = 0;
+		filter->async_running = FALSE;
+	}
+
+	return ret;
+}
+
+/* this function handles queries on the pyramid pads, they only offer the size of their level */
+static gboolean
+gst_binningfilter_pyramid_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (parent);
+
+	switch (GST_QUERY_TYPE (query)) {
+	case GST_QUERY_CAPS:
+	{
+		GstCaps *filter_caps, *caps, *tmp;
+
+		gst_query_parse_caps (query, &filter_caps);
+
+		GST_OBJECT_LOCK (filter);
+		if (filter->pyramid_caps[PYRAMID_PAD_LEVEL (pad)])
+			caps = gst_caps_ref (filter->pyramid_caps[PYRAMID_PAD_LEVEL (pad)]);
 		else
-			gst_bin_resize_image_rgb(filter, buf);
-		break;
-	case PROP_CHROMA:
-		gst_bin_image_chroma(filter, buf);
-		break;
-	case PROP_TEST:
-		if (GST_TIME_AS_SECONDS(buf->pts)%2){   // every second switch the algorithm
-			GST_DEBUG_OBJECT (filter, "%d Binning algorithm: rgb\n", (int)GST_TIME_AS_SECONDS(buf->pts));
-			gst_bin_image_rgb(filter, buf);
+			caps = NULL;
+		GST_OBJECT_UNLOCK (filter);
+
+		if (!caps)  // nothing negotiated upstream yet
+			caps = gst_pad_get_pad_template_caps (pad);
+
+		if (filter_caps) {
+			tmp = gst_caps_intersect_full (filter_caps, caps, GST_CAPS_INTERSECT_FIRST);
+			gst_caps_unref (caps);
+			caps = tmp;
 		}
-		else{
-			GST_DEBUG_OBJECT (filter, "%d Binning algorithm: chroma\n", (int)GST_TIME_AS_SECONDS(buf->pts));
-			gst_bin_image_chroma(filter, buf);
+		gst_query_set_caps_result (query, caps);
+		gst_caps_unref (caps);
+		return TRUE;
+	}
+	case GST_QUERY_LATENCY:
+		return gst_binningfilter_src_query (pad, parent, query);
+	default:
+		return gst_pad_query_default (pad, parent, query);
+	}
+}
+
+/* Reffed copy of the list of pyramid pads, so that they can be pushed to without the lock,
+ * the bitmask of their levels is returned in 'levels' */
+static GList *
+gst_binningfilter_get_pyramid_pads (Gstbinningfilter *filter, guint *levels)
+{
+	GList *pads = NULL, *l;
+	guint wanted = 0;
+
+	GST_OBJECT_LOCK (filter);
+	for (l = filter->pyramid_pads; l; l = l->next){
+		pads = g_list_prepend (pads, gst_object_ref (l->data));
+		wanted |= 1 << PYRAMID_PAD_LEVEL (l->data);
+	}
+	GST_OBJECT_UNLOCK (filter);
+
+	if (levels)
+		*levels = wanted;
+
+	return pads;
+}
+
+typedef struct
+{
+	GstPad *pad;
+	GstCaps *caps;
+} PyramidStickyData;
+
+/* Give a new pyramid pad the sticky events of the stream, but with the caps of its level */
+static gboolean
+copy_sticky_event (GstPad * pad, GstEvent ** event, gpointer user_data)
+{
+	PyramidStickyData *data = user_data;
+
+	if (GST_EVENT_TYPE (*event) == GST_EVENT_CAPS){
+		if (data->caps){
+			GstEvent *caps_event = gst_event_new_caps (data->caps);
+			gst_pad_store_sticky_event (data->pad, caps_event);
+			gst_event_unref (caps_event);
 		}
+	}
+	else
+		gst_pad_store_sticky_event (data->pad, *event);
+
+	return TRUE;
+}
+
+static GstPad *
+gst_binningfilter_request_new_pad (GstElement * element, GstPadTemplate * templ,
+		const gchar * name, const GstCaps * caps)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (element);
+	PyramidStickyData data;
+	GstPad *pad;
+	GList *l;
+	guint level = 0, used = 0;
+	gchar *pad_name;
+
+	// the level is chosen and reserved under one lock, so two requests at once can not both take it.
+	// The pad only goes in pyramid_pads, where it is pushed to, once it has been added with the sticky events.
+	GST_OBJECT_LOCK (filter);
+	used = filter->pyramid_reserved;
+	for (l = filter->pyramid_pads; l; l = l->next)
+		used |= 1 << PYRAMID_PAD_LEVEL (l->data);
+
+	if (name == NULL){  // next free level
+		for (level = 1; level <= PYRAMID_MAX_LEVELS && (used & (1 << level)); level++);
+	}
+	else if (sscanf (name, "src_%u", &level) != 1)
+		level = 0;
+
+	if (level < 1 || level > PYRAMID_MAX_LEVELS || (used & (1 << level))){
+		GST_OBJECT_UNLOCK (filter);
+		GST_WARNING_OBJECT (filter, "Can not make pad %s, pyramid pads are src_1 to src_%d, each giving the image reduced by 2^n",
+				name ? name : "", PYRAMID_MAX_LEVELS);
+		return NULL;
+	}
+	filter->pyramid_reserved |= 1 << level;
+	GST_OBJECT_UNLOCK (filter);
+
+	pad_name = g_strdup_printf ("src_%u", level);
+	pad = gst_pad_new_from_template (templ, pad_name);
+	g_free (pad_name);
+
+	gst_pad_set_element_private (pad, GINT_TO_POINTER (level));
+	gst_pad_set_query_function (pad, GST_DEBUG_FUNCPTR(gst_binningfilter_pyramid_query));
+	if (!gst_element_add_pad (element, pad)){
+		GST_WARNING_OBJECT (filter, "Could not add pad src_%u", level);
+		gst_object_unref (pad);
+		GST_OBJECT_LOCK (filter);
+		filter->pyramid_reserved &= ~(1 << level);
+		GST_OBJECT_UNLOCK (filter);
+		return NULL;
+	}
+
+	// bring the new pad up to date with the stream
+	data.pad = pad;
+	GST_OBJECT_LOCK (filter);
+	data.caps = filter->pyramid_caps[level] ? gst_caps_ref (filter->pyramid_caps[level]) : NULL;
+	GST_OBJECT_UNLOCK (filter);
+	gst_pad_sticky_events_foreach (filter->sinkpad, copy_sticky_event, &data);
+	if (data.caps)
+		gst_caps_unref (data.caps);
+
+	GST_OBJECT_LOCK (filter);
+	filter->pyramid_pads = g_list_append (filter->pyramid_pads, pad);
+	filter->pyramid_reserved &= ~(1 << level);
+	GST_OBJECT_UNLOCK (filter);
+
+	GST_DEBUG_OBJECT (filter, "Added pyramid pad for level %d, reduced by %d", level, 1 << level);
+
+	return pad;
+}
+
+static void
+gst_binningfilter_release_pad (GstElement * element, GstPad * pad)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (element);
+
+	GST_OBJECT_LOCK (filter);
+	filter->pyramid_pads = g_list_remove (filter->pyramid_pads, pad);
+	GST_OBJECT_UNLOCK (filter);
+
+	gst_pad_set_active (pad, FALSE);
+	gst_element_remove_pad (element, pad);
+}
+
+static GstStateChangeReturn
+gst_binningfilter_change_state (GstElement * element, GstStateChange transition)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (element);
+	GstStateChangeReturn ret;
+
+	switch (transition) {
+	case GST_STATE_CHANGE_NULL_TO_READY:
+		if (!gst_binningfilter_calibration_open(filter))
+			return GST_STATE_CHANGE_FAILURE;
 		break;
+	default:
+		break;
+	}
+
+	ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+	switch (transition) {
+	case GST_STATE_CHANGE_PAUSED_TO_READY:
+		gst_binningfilter_incremental_reset(filter);   // the next stream starts with a whole frame
+		gst_binningfilter_crop_reset(filter);
+		// the scratch is made again by the next stream, in the pages huge-pages then asks for
+		binning_memory_free(filter->pyramid_sums);
+		filter->pyramid_sums = NULL;
+		filter->pyramid_sums_size = 0;
+		binning_memory_free(filter->compare_scratch);
+		filter->compare_scratch = NULL;
+		filter->compare_scratch_size = 0;
+		gst_binningfilter_compare_reset(filter);
+		break;
+	case GST_STATE_CHANGE_READY_TO_NULL:
+		gst_binningfilter_calibration_close(filter);
+		break;
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+/* chain function
+ * processes the buffer, or in async mode queues it for the task, waiting while the queue is full
+ */
+static GstFlowReturn
+gst_binningfilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (parent);
+	GstFlowReturn ret;
+
+	if (!filter->async_running)
+		return gst_binningfilter_process(filter, buf);
+
+	g_mutex_lock (&filter->async_lock);
+	while (filter->async_result == GST_FLOW_OK && filter->async_queued >= filter->async_queue_size)
+		g_cond_wait (&filter->async_cond, &filter->async_lock);
+
+	ret = filter->async_result;   // the task stopped, e.g. flushing, eos or a downstream error
+	if (ret == GST_FLOW_OK){
+		g_queue_push_tail (&filter->async_queue, buf);
+		filter->async_queued++;
+		g_cond_broadcast (&filter->async_cond);
+	}
+	g_mutex_unlock (&filter->async_lock);
+
+	if (ret != GST_FLOW_OK)
+		gst_buffer_unref (buf);
+
+	return ret;
+}
+
+/* The task of the src pad in async mode, processes the queued buffers and events in order */
+static void
+gst_binningfilter_loop (Gstbinningfilter *filter)
+{
+	GstMiniObject *item;
+	GstFlowReturn ret = GST_FLOW_OK;
+
+	g_mutex_lock (&filter->async_lock);
+	while (filter->async_result == GST_FLOW_OK && g_queue_is_empty (&filter->async_queue))
+		g_cond_wait (&filter->async_cond, &filter->async_lock);
+
+	if (filter->async_result != GST_FLOW_OK){
+		g_mutex_unlock (&filter->async_lock);
+		gst_pad_pause_task (filter->srcpad);
+		return;
+	}
+
+	item = g_queue_pop_head (&filter->async_queue);
+	if (GST_IS_BUFFER (item))
+		filter->async_queued--;
+	filter->async_busy = TRUE;
+	g_cond_broadcast (&filter->async_cond);   // room in the queue
+	g_mutex_unlock (&filter->async_lock);
+
+	if (GST_IS_BUFFER (item))
+		ret = gst_binningfilter_process(filter, GST_BUFFER (item));
+	else{
+		gboolean eos = GST_EVENT_TYPE (item) == GST_EVENT_EOS;
+
+		gst_binningfilter_handle_event (filter->sinkpad, GST_OBJECT (filter), GST_EVENT (item));
+		if (eos)
+			ret = GST_FLOW_EOS;
+	}
+
+	g_mutex_lock (&filter->async_lock);
+	filter->async_busy = FALSE;
+	if (ret != GST_FLOW_OK && filter->async_result == GST_FLOW_OK)
+		filter->async_result = ret;   // returned to upstream from the next chain call
+	g_cond_broadcast (&filter->async_cond);
+	g_mutex_unlock (&filter->async_lock);
+
+	if (ret != GST_FLOW_OK){
+		GST_DEBUG_OBJECT (filter, "Pausing task, reason %s", gst_flow_get_name (ret));
+		if (ret == GST_FLOW_NOT_LINKED || ret < GST_FLOW_EOS){
+			GST_ELEMENT_ERROR (filter, STREAM, FAILED, ("Internal data stream error."),
+					("streaming task paused, reason %s (%d)", gst_flow_get_name (ret), ret));
+			gst_pad_push_event (filter->srcpad, gst_event_new_eos ());
+		}
+		gst_pad_pause_task (filter->srcpad);
 	}
+}
+
+/* A buffer list being binned on the worker pool */
+typedef struct
+{
+	Gstbinningfilter *filter;
+	const BinningParams *params;   // the same for every frame of the list
+	GstBufferList *list;
+	gint failed;   // frames that could not be mapped, atomic
+} BinningBatch;
+
+static void
+gst_binningfilter_batch_worker (gpointer data, guint index)
+{
+	BinningBatch *batch = data;
+
+	if (!gst_binningfilter_bin_frame(batch->filter, batch->params, gst_buffer_list_get (batch->list, index)))
+		g_atomic_int_inc (&batch->failed);
+}
+
+/* Make a frame of a writable list writable, before it is binned in place */
+static gboolean
+gst_binningfilter_list_make_writable (GstBuffer ** buf, guint index, gpointer data)
+{
+	*buf = gst_buffer_make_writable (*buf);
+	return TRUE;
+}
+
+/* A buffer list going frame by frame through the chain function */
+typedef struct
+{
+	GstPad *pad;
+	GstObject *parent;
+	GstFlowReturn ret;
+} BinningChainList;
+
+/* Take a frame out of a writable list and pass it to the chain function, which then has the list's ref of it */
+static gboolean
+gst_binningfilter_list_chain (GstBuffer ** buf, guint index, gpointer data)
+{
+	BinningChainList *chain = data;
 
-	// push out the changed buffer
-	return gst_pad_push (filter->srcpad, buf);
+	chain->ret = gst_binningfilter_chain (chain->pad, chain->parent, *buf);
+	*buf = NULL;   // removed from the list
+
+	return chain->ret == GST_FLOW_OK;
+}
+
+/* chain list function
+ * high frame rate sources send bursts of frames as a list, the params are taken once and the frames are binned
+ * in parallel on the worker pool of libbinning, shared by every element in the process, then pushed on as one list.
+ * Pyramid levels, statistics, auto-levels, auto-binsize, compare mode measurements and incremental binning go frame by frame in stream order,
+ * so with any of those, with a 16-bit linear output, which is a new buffer, with slices, and in async mode, each buffer goes through
+ * the chain function instead.
+ */
+static GstFlowReturn
+gst_binningfilter_chain_list (GstPad * pad, GstObject * parent, GstBufferList * list)
+{
+	Gstbinningfilter *filter = GST_BINNINGFILTER (parent);
+	BinningParams *params;
+	const BinningFrameSettings *frame;
+	BinningBatch batch;
+	BinningChainList chain;
+	guint n, wanted;
+	GList *pyramid_pads;
+
+	// binned in place, so neither the list nor its frames may be shared, e.g. with the other branch of a tee
+	list = gst_buffer_list_make_writable (list);
+	n = gst_buffer_list_length (list);
+	params = gst_binningfilter_take_params(filter);
+	frame = &filter->frame;
+	pyramid_pads = gst_binningfilter_get_pyramid_pads(filter, &wanted);
+	g_list_free_full (pyramid_pads, gst_object_unref);
+
+	if (filter->async_running || wanted || frame->compute_stats || frame->auto_levels || frame->auto_binsize || frame->compare || frame->incremental ||
+			params->output != BINNING_OUTPUT_8BIT || frame->slice_height || frame->crop || n < 2){
+		chain.pad = pad;
+		chain.parent = parent;
+		chain.ret = GST_FLOW_OK;
+		gst_buffer_list_foreach (list, gst_binningfilter_list_chain, &chain);
+		gst_buffer_list_unref (list);   // and the frames not taken after an error
+		return chain.ret;
+	}
+
+	filter->stats = NULL;
+	filter->auto_levels_valid = FALSE;
+
+	gst_buffer_list_foreach (list, gst_binningfilter_list_make_writable, NULL);
+	batch.filter = filter;
+	batch.params = params;
+	batch.list = list;
+	batch.failed = 0;
+	binning_pool_run (n, gst_binningfilter_batch_worker, &batch);   // each frame whole, not in bands
+
+	if (batch.failed){
+		gst_buffer_list_unref (list);
+		return GST_FLOW_ERROR;
+	}
+
+	GST_LOG_OBJECT (filter, "Binned a list of %u frames", n);
+
+	return gst_pad_push_list (filter->srcpad, list);
+}
+
+/* Bin one frame with the given params, with the kernel chosen by the algorithm, in bands of rows on the worker pool,
+ * may be called for several frames at once from the pool, each frame is then binned whole on its thread.
+ * buf must be writable. FALSE, with an error posted, if it could not be mapped. */
+gboolean
+gst_binningfilter_bin_frame (Gstbinningfilter *filter, const BinningParams *params, GstBuffer * buf)
+{
+	GstMapInfo minfo;
+	BinningImage image;
+
+	// Access the buffer - READ AND WRITE
+	if (!gst_buffer_map (buf, &minfo, GST_MAP_READWRITE)){
+		GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, ("Could not map the frame to bin."), (NULL));
+		return FALSE;
+	}
+
+	image.data = minfo.data;
+	image.width = filter->width;
+	image.height = filter->height;
+	image.stride = filter->stride;
+	image.stats = filter->stats;
+	image.top = image.left = 0;
+	image.out = NULL;   // in place
+	image.out_stride = 0;
+	image.frame_width = image.frame_height = 0;
+
+	if (filter->frame.compare)   // compare-a in place and compare-b on a copy, each timed on this thread
+		gst_binningfilter_compare_image(filter, params, &image, GST_BUFFER_PTS (buf));
+	else if (filter->frame.incremental)   // only the tiles that have changed since the last frame
+		gst_binningfilter_incremental_image(filter, params, &image);
+	else
+		binning_process_image_parallel(params, &image);
+
+	gst_buffer_unmap (buf, &minfo);
+
+	return TRUE;
+}
+
+/* A new buffer of the 16-bit linear output for buf, with its timestamps, to bin into.
+ * Only the binned image is written by the kernel, the rest of the output is made black here. */
+GstBuffer *
+gst_binningfilter_linear_output_new (Gstbinningfilter *filter, const BinningParams *params, GstBuffer * buf)
+{
+	GstMapInfo out_info;
+	GstBuffer *out;
+	gint out_width, out_height, y;
+	gint pixel_bytes = GST_VIDEO_INFO_COMP_PSTRIDE (&filter->output_info, 0);
+	gint out_stride = GST_VIDEO_INFO_PLANE_STRIDE (&filter->output_info, 0);
+
+	out = gst_buffer_new_allocate (NULL, GST_VIDEO_INFO_SIZE (&filter->output_info), NULL);
+	gst_buffer_copy_into (out, buf, GST_BUFFER_COPY_METADATA, 0, -1);
+
+	if (!gst_buffer_map (out, &out_info, GST_MAP_WRITE))
+		return out;
+
+	binning_output_size (params, filter->width, filter->height, &out_width, &out_height);
+	if (params->binsize > filter->width || params->binsize > filter->height)   // nothing is binned
+		out_width = out_height = 0;
+	for (y = 0; y < filter->height; y++){
+		gint x0 = y < out_height ? out_width : 0;
+		memset (out_info.data + (gsize)y * out_stride + x0 * pixel_bytes, 0, (filter->width - x0) * pixel_bytes);
+	}
+
+	gst_buffer_unmap (out, &out_info);
+
+	return out;
+}
+
+/* Bin one frame into a new buffer of the 16-bit linear output, in bands of rows on the worker pool.
+ * Cropped, the kernel writes the whole of a buffer from the pool. NULL if there is none or the frames could not be mapped. */
+static GstBuffer *
+gst_binningfilter_bin_frame_linear (Gstbinningfilter *filter, const BinningParams *params, GstBuffer * buf)
+{
+	GstMapInfo minfo, out_info;
+	BinningImage image;
+	GstBuffer *out;
+	const GstVideoInfo *out_video_info = filter->frame.crop ? &filter->crop_info : &filter->output_info;
+
+	out = filter->frame.crop ? gst_binningfilter_crop_buffer (filter, buf) : gst_binningfilter_linear_output_new (filter, params, buf);
+
+	if (!out)
+		return NULL;
+	if (!gst_buffer_map (buf, &minfo, GST_MAP_READ)){
+		GST_ELEMENT_ERROR (filter, RESOURCE, READ, ("Could not map the frame to bin."), (NULL));
+		gst_buffer_unref (out);
+		return NULL;
+	}
+	if (!gst_buffer_map (out, &out_info, GST_MAP_WRITE)){
+		GST_ELEMENT_ERROR (filter, RESOURCE, WRITE, ("Could not map the output frame."), (NULL));
+		gst_buffer_unmap (buf, &minfo);
+		gst_buffer_unref (out);
+		return NULL;
+	}
+	if (filter->frame.crop && (params->binsize > filter->width || params->binsize > filter->height))   // nothing is binned
+		memset (out_info.data, 0, out_info.size);
+
+	image.data = minfo.data;   // only read
+	image.width = filter->width;
+	image.height = filter->height;
+	image.stride = filter->stride;
+	image.stats = filter->stats;
+	image.top = image.left = 0;
+	image.out = out_info.data;
+	image.out_stride = GST_VIDEO_INFO_PLANE_STRIDE (out_video_info, 0);
+	image.frame_width = image.frame_height = 0;
+
+	binning_process_image_parallel (params, &image);
+
+	gst_buffer_unmap (out, &out_info);
+	gst_buffer_unmap (buf, &minfo);
+
+	return out;
+}
+
+/* this function does the actual processing
+ */
+static GstFlowReturn
+gst_binningfilter_process (Gstbinningfilter *filter, GstBuffer * buf)
+{
+	GstFlowReturn ret, level_ret;
+	GstBuffer *levels[PYRAMID_MAX_LEVELS+1];
+	GList *pyramid_pads, *l;
+	guint wanted;
+	BinningParams *params;
+
+	// One set of settings for the whole frame, changes made while it is processed apply from the next
+	params = gst_binningfilter_take_params(filter);
+
+	// Cropped, the src caps follow the size of the binned image, new caps go just before the first frame of a new size
+	ret = gst_binningfilter_crop_set_caps(filter, params);
+	if (ret != GST_FLOW_OK){
+		gst_buffer_unref (buf);
+		return ret;
+	}
+
+	// Binned in place, the frame must not be shared, e.g. with the other branch of a tee
+	if (params->output == BINNING_OUTPUT_8BIT)
+		buf = gst_buffer_make_writable (buf);
+
+	// Make the pyramid levels from the frame before it is binned in-place, they are only made from 24-bit frames
+	pyramid_pads = gst_binningfilter_get_pyramid_pads(filter, &wanted);
+	if (BINNING_FORMAT_IS_GRAY (params->format)){
+		g_list_free_full (pyramid_pads, gst_object_unref);
+		pyramid_pads = NULL;
+		wanted = 0;
+	}
+	if (wanted && gst_bin_pyramid_image_rgb(filter, params, buf, wanted, levels) != GST_FLOW_OK){
+		g_list_free_full (pyramid_pads, gst_object_unref);
+		gst_buffer_unref (buf);
+		return GST_FLOW_ERROR;
+	}
+
+	// The kernels add to the statistics as they write each binned pixel
+	if (filter->frame.compute_stats){
+		memset(&filter->frame_stats, 0, sizeof(BinningStats));
+		filter->stats = &filter->frame_stats;
+	}
+	else
+		filter->stats = NULL;
+
+	// Sample the frame before it is binned in-place, the levels and binsize found are used for the next frame
+	if (filter->frame.auto_levels || filter->frame.auto_binsize)
+		gst_binningfilter_auto_levels_sample(filter, buf);
+	if (!filter->frame.auto_levels)
+		filter->auto_levels_valid = FALSE;   // start again when it is turned on
+
+	// Process image, in place or into the 16-bit linear output, in slices that are pushed on as each is binned
+	if (filter->frame.slice_height > 0)
+		ret = gst_binningfilter_push_slices(filter, params, buf);
+	else if (params->output != BINNING_OUTPUT_8BIT){
+		GstBuffer *out = gst_binningfilter_bin_frame_linear(filter, params, buf);
+		gst_buffer_unref (buf);
+		buf = out;
+	}
+	else if (!gst_binningfilter_bin_frame(filter, params, buf)){
+		gst_buffer_unref (buf);
+		buf = NULL;
+	}
+	else if (filter->frame.crop)   // the binned image copied out of the frame
+		buf = gst_binningfilter_crop_frame(filter, buf);
+
+	if (filter->stats && buf)
+		gst_binningfilter_post_stats(filter, buf);
+
+	if (filter->frame.auto_binsize)
+		gst_binningfilter_auto_binsize_update(filter, params);
+	if (filter->frame.auto_levels)
+		gst_binningfilter_auto_levels_update(filter, params);
+
+	// push out the changed buffer, the slices have gone already
+	if (!buf)   // not binned, or no buffer of the cropped output
+		ret = GST_FLOW_ERROR;
+	else if (filter->frame.slice_height > 0)
+		gst_buffer_unref (buf);
+	else
+		ret = gst_pad_push (filter->srcpad, buf);
+
+	// and the pyramid levels, an unlinked or finished branch does not stop the others
+	for (l = pyramid_pads; l; l = l->next){
+		GstPad *level_pad = GST_PAD (l->data);
+		gint level = PYRAMID_PAD_LEVEL (level_pad);
+
+		if (!levels[level])
+			continue;
+		level_ret = gst_pad_push (level_pad, levels[level]);
+		if (ret == GST_FLOW_NOT_LINKED || level_ret == GST_FLOW_FLUSHING || level_ret <= GST_FLOW_NOT_NEGOTIATED)
+			ret = level_ret;
+	}
+	g_list_free_full (pyramid_pads, gst_object_unref);
+
+	// the levels and binsize found for the next frame, now that this one has gone
+	gst_binningfilter_levels_notify(filter);
+
+	return ret;
 }
 
 
@@ -493,6 +2003,8 @@ gst_binningfilter_chain (GstPad * pad, GstObject * parent, GstBuffer * buf)
 static gboolean
 binningfilter_init (GstPlugin * plugin)
 {
+	const gchar *threads;
+
 	/* debug category for fltering log messages
 	 *
 	 * exchange the string 'Template binningfilter' with your description
@@ -500,9 +2012,18 @@ binningfilter_init (GstPlugin * plugin)
 	GST_DEBUG_CATEGORY_INIT (gst_binningfilter_debug, "binningfilter",
 			1, "Template binningfilter");
 
-	  gst_binningfilter_rgb_init();
-	  gst_binningfilter_rgbresize_init();
-	  gst_binningfilter_chroma_init();
+	  gst_binningfilter_stats_init();
+	  gst_binningfilter_levels_init();
+	  gst_binningfilter_pyramid_init();
+	  gst_binningfilter_calibration_init();
+	  gst_binningfilter_compare_init();
+	  gst_binningfilter_incremental_init();
+	  gst_binningfilter_slice_init();
+	  gst_binningfilter_crop_init();
+
+	  // one worker pool for every binningfilter in the process, sized and pinned from the environment
+	  threads = g_getenv ("GST_BINNING_THREADS");
+	  binning_pool_configure (threads ? atoi (threads) : 0, g_getenv ("GST_BINNING_AFFINITY"));
 
 	  if (gst_element_register (plugin, "binningfilter", GST_RANK_NONE,
 				GST_TYPE_BINNINGFILTER))
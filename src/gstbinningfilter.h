@@ -47,6 +47,10 @@
 #define __GST_BINNINGFILTER_H__
 
 #include <gst/gst.h>
+#include <gst/video/video.h>
+
+#include "binning-private.h"
+#include "gstbinningslicemeta.h"
 
 G_BEGIN_DECLS
 
@@ -63,30 +67,69 @@ G_BEGIN_DECLS
   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_BINNINGFILTER))
 
 typedef struct _Gstbinningfilter      Gstbinningfilter;
-typedef struct _GstbinningfilterClass GstbinningfilterClass;
 
-void gst_binningfilter_rgb_init(void);
-void gst_binningfilter_rgbresize_init(void);
-void gst_binningfilter_chroma_init(void);
+// The algorithm property also has compare mode, which only the element has: each frame is binned with both
+// compare-a and compare-b, which are timed and measured against each other, and the compare-a result passed on
+#define GST_BINNING_COMPARE 0x100
 
-// Bin in linear intensity space, we expect the camera to have applied a 0.45 gamma
-// So linearise with a 2.22 gamma, bin and then re-gamma with 0.45
-// We create a gamma luts for speed, with integers
-// To apply the 2.22 gamma to the int input value i, use v=gamma[i]
-// To apply the 0.45 gamma to the int calculated value v, use i=inverse_gamma[v]
-#define GAMMA 2.22
-#define OFFSET 0.099   // from Rec. 709 standard
-#define FACTOR 283.02  // Factor to divide input by so that it's never >1 when 0.099 is added
-#define IN_RANGE 256
-#define OUT_RANGE 4096     // an higher bit lut for reverse lookup, 18 bit (262144) guarantees every level preserved, 12 (4096) may be ok
+// Running totals of compare mode, since it was turned on or the compared setup last changed
+typedef struct
+{
+  BinningParams *params, *params_b;   // reffed, the setup the totals are for, any new params start them again
+  guint64 frames;
+  GstClockTime time_a, time_b;   // summed kernel times
+  guint64 squared_error;   // summed over every compared sample
+  guint64 samples;
+  guint max_abs_diff;
+} BinningCompareTotals;
+typedef struct _GstbinningfilterClass GstbinningfilterClass;
 
+// A buffer pool of the cropped output, for the size of its caps
+#define CROP_POOLS 8   // sizes kept, enough for every binsize
+typedef struct
+{
+  GstCaps *caps;
+  GstBufferPool *pool;
+} BinningCropPool;
+
+// The element's part of the settings a frame is processed with, made with the params of the library whenever
+// the properties change and taken with them at the start of a frame, so a frame never sees half of a change
+typedef struct
+{
+  BinningParams *compare;   // the second kernel of compare mode, reffed, NULL otherwise
+  gboolean compute_stats;
+  gboolean auto_levels;
+  gdouble auto_levels_smoothing;
+  gboolean auto_binsize;
+  gint auto_binsize_target;
+  gboolean incremental;   // rebin only the tiles that changed since the last frame
+  gint incremental_threshold;
+  gint slice_height;   // rows of each slice pushed, 0 for whole frames
+  gboolean crop;   // push the binned image alone, with src caps of its size
+} BinningFrameSettings;
 
-typedef enum
+// Settings published for the streaming thread to take, see gst_binningfilter_publish_params()
+typedef struct
 {
-	PROP_RGB,
-	PROP_CHROMA,
-	PROP_TEST
-} BinningAlgorithm;
+  BinningParams *params;
+  BinningFrameSettings frame;
+} BinningPendingSettings;
+
+void gst_binningfilter_stats_init(void);
+void gst_binningfilter_levels_init(void);
+void gst_binningfilter_pyramid_init(void);
+void gst_binningfilter_calibration_init(void);
+void gst_binningfilter_compare_init(void);
+void gst_binningfilter_incremental_init(void);
+void gst_binningfilter_slice_init(void);
+void gst_binningfilter_crop_init(void);
+
+// The meta of slice-height mode, see gstbinningslicemeta.h
+const GstMetaInfo *gst_binning_slice_meta_get_info (void);
+
+// Pyramid outputs, request pad src_n gives the image reduced by 2^n
+#define PYRAMID_MAX_LEVELS 4
+#define PYRAMID_PAD_LEVEL(pad) GPOINTER_TO_INT(gst_pad_get_element_private(pad))
 
 struct _Gstbinningfilter
 {
@@ -94,18 +137,98 @@ struct _Gstbinningfilter
 
   GstPad *sinkpad, *srcpad;
 
-  BinningAlgorithm algorithm;
+  gint algorithm;   // a BinningAlgorithm, or GST_BINNING_COMPARE
 
   gboolean format_is_RGB;   // otherwise it is BGR, if true must reverse r and b black and contrast values
+  BinningFormat format;   // of the input caps
   gint width, height; // image size
   gint stride;    // bytes to next line
   gint binsize;   // The number of pixels binned will be binsize x binsize
   gboolean resize;   // Whether to resize the image as we bin
+  gint bin_stride;   // Pixels between bins, 0 to use the binsize (resize) or 1 (no resize)
   gint black_r, black_g, black_b;   // RGB black levels that will be subtracted from each pixel
   gint contrast_r, contrast_g, contrast_b;   // RGB contrast values that will be applied to the summed/binned data
+  gdouble clip_sigma;   // sigma-clip binning leaves out values further than this many standard deviations from the median
+  gdouble chroma_weight;   // chroma binning scales the mean colour difference of each bin by this
+  BinningBorder border;   // what the bins past the right and bottom of the frame gather
+  BinningAlgorithm compare_a, compare_b;   // the kernels run side by side in compare mode, a is passed on
+  BinningOutput output_format;   // format of the src pad, the input format or a 16-bit linear one, set before PAUSED
+
+  // The property values above are written under the object lock and published as a new params block,
+  // the streaming thread only reads 'params'
+  BinningParams *params;   // settings of the current frame, owned by the streaming thread
+  BinningFrameSettings frame;   // and the element's part of them
+  BinningPendingSettings *pending;   // newest settings not yet taken by the streaming thread, exchanged atomically
+
+  BinningOutput output;   // output_format when the caps were set, what the params are made with
+  GstVideoInfo output_info;   // of the src caps, for a 16-bit linear output
+
+  const double *forward_gamma;   // the shared luts of binning_gamma_luts()
+  const unsigned int *inverse_gamma;
+
+  gboolean auto_levels;   // Whether to track the black and contrast levels from the data
+  gdouble auto_levels_smoothing;   // fraction of the way to move to the new levels each frame
+  gboolean auto_levels_valid;   // FALSE until the first frame has been sampled
+  gdouble auto_black[3], auto_contrast[3];   // smoothed levels, in buffer order
+  guint32 levels_histogram[3][IN_RANGE];   // histograms of the sparse sample of the current frame, in buffer order
+  guint levels_changed;   // properties set by auto-levels and auto-binsize, notified once the frame is pushed
 
-  double *forward_gamma;
-  unsigned int *inverse_gamma;
+  gboolean auto_binsize;   // Whether to choose the binsize from the brightness of the data
+  gint auto_binsize_target;   // 8-bit level that the sum of a bin should reach
+
+  gboolean compute_stats;   // Whether to post the statistics of each binned frame
+  BinningStats frame_stats;   // statistics of the current frame
+  BinningStats *stats;   // points to frame_stats while a frame is processed with compute_stats set, otherwise NULL
+
+  GList *pyramid_pads;   // the requested src_n pads, protected by the object lock
+  guint pyramid_reserved;   // levels of pads being added, not yet in pyramid_pads, also under the object lock
+  GstCaps *pyramid_caps[PYRAMID_MAX_LEVELS+1];   // caps of each level, made from the input caps
+  GstVideoInfo pyramid_info[PYRAMID_MAX_LEVELS+1];
+  guint32 *pyramid_sums;   // sums of every level
+  gsize pyramid_sums_size;   // number of guint32 in pyramid_sums
+
+  guint8 *compare_scratch;   // a copy of the frame for each compared kernel
+  gsize compare_scratch_size;
+  BinningCompareTotals compare_totals;
+
+  gboolean incremental;   // Whether to bin again only the tiles whose input has changed
+  gint incremental_threshold;   // largest change of a sample that still counts as unchanged
+  BinningParams *incremental_params;   // params the cache was made with, owned by the streaming thread
+  guint8 *incremental_reference;   // input the cached tiles were binned from, laid out as the frame
+  guint8 *incremental_output;   // cache of the binned image, laid out as the frame
+  gsize incremental_size;   // bytes in each of them
+  guint64 tiles_binned, tiles_reused;   // counts since the element was made, protected by the object lock
+
+  gchar *dark_frame_location, *flat_field_location;   // calibration files, mapped at READY
+  GMappedFile *dark_file, *flat_file;
+  gboolean dark_valid, flat_valid;   // the mapped files match the frame size of the caps
+  gfloat flat_gain[3][IN_RANGE];   // from the flat field, made when the caps are set
+  gchar *defect_map_location;   // list of defective pixels, read at READY
+  guint64 *defect_list;   // the defects as (y << 32 | x), sorted
+  guint defect_list_length;
+  BinningDefects *defects;   // index for the frame size of the caps
+
+  GstClockTime frame_duration;   // from the caps framerate, GST_CLOCK_TIME_NONE if not known, protected by the object lock
+
+  gboolean async;   // Whether to process on a task of the src pad rather than in the chain function
+  gint async_queue_size;   // frames that can wait for the task
+  gboolean async_running;   // async was set when the src pad was activated
+  GQueue async_queue;   // buffers and serialized events waiting for the task, in stream order
+  guint async_queued;   // buffers in async_queue
+  gboolean async_busy;   // the task is processing an item
+  GstFlowReturn async_result;   // GST_FLOW_OK while the task can take items, otherwise why it stopped
+  GMutex async_lock;   // protects the async queue, count, busy and result
+  GCond async_cond;   // signalled when any of them change
+
+  gint slice_height;   // rows of each slice pushed, 0 to push whole frames
+
+  gboolean crop;   // Whether the src caps are of the binned image alone, rather than the whole frame
+  GstCaps *output_caps;   // src caps made from the sink caps, of the whole frame, owned by the streaming thread
+  gint src_width, src_height;   // size of the src caps last pushed, 0 before any
+  GstVideoInfo crop_info;   // of the src caps when cropped
+  BinningCropPool crop_pools[CROP_POOLS];   // most recently used first, the first is of the current size
+
+  gboolean huge_pages;   // Whether the frame sized scratch and caches are allocated in huge pages, set before PAUSED
 };
 
 struct _GstbinningfilterClass 
@@ -113,17 +236,34 @@ struct _GstbinningfilterClass
   GstElementClass parent_class;
 };
 
-typedef struct {
-	guint8 b, g, r;
-} bgr_pixel;
-
 GType gst_binningfilter_get_type (void);
 
-void gst_bin_image_rgb(Gstbinningfilter *filter, GstBuffer *buf);
-void gst_bin_resize_image_rgb(Gstbinningfilter *filter, GstBuffer *buf);
-void gst_bin_image_chroma(Gstbinningfilter *filter, GstBuffer *buf);
+void gst_binningfilter_publish_params(Gstbinningfilter *filter);
+gboolean gst_binningfilter_bin_frame(Gstbinningfilter *filter, const BinningParams *params, GstBuffer *buf);
+GstBuffer *gst_binningfilter_linear_output_new(Gstbinningfilter *filter, const BinningParams *params, GstBuffer *buf);
+
+GstFlowReturn gst_bin_pyramid_image_rgb(Gstbinningfilter *filter, const BinningParams *params, GstBuffer *buf, guint wanted, GstBuffer **levels);
+void gst_binningfilter_pyramid_set_caps(Gstbinningfilter *filter, GstCaps *caps);
+
+gboolean gst_binningfilter_calibration_open(Gstbinningfilter *filter);
+void gst_binningfilter_calibration_close(Gstbinningfilter *filter);
+void gst_binningfilter_calibration_set_caps(Gstbinningfilter *filter);
 
-#define SWAP(x, y) do { typeof(x) SWAP = x; x = y; y = SWAP; } while (0)
+void gst_binningfilter_post_stats(Gstbinningfilter *filter, GstBuffer *buf);
+void gst_binningfilter_compare_image(Gstbinningfilter *filter, const BinningParams *params, const BinningImage *image, GstClockTime timestamp);
+void gst_binningfilter_compare_reset(Gstbinningfilter *filter);
+void gst_binningfilter_incremental_image(Gstbinningfilter *filter, const BinningParams *params, const BinningImage *image);
+void gst_binningfilter_incremental_reset(Gstbinningfilter *filter);
+void gst_binningfilter_auto_levels_sample(Gstbinningfilter *filter, GstBuffer *buf);
+void gst_binningfilter_auto_levels_update(Gstbinningfilter *filter, const BinningParams *params);
+void gst_binningfilter_auto_binsize_update(Gstbinningfilter *filter, const BinningParams *params);
+void gst_binningfilter_levels_notify(Gstbinningfilter *filter);
+GstFlowReturn gst_binningfilter_push_slices(Gstbinningfilter *filter, const BinningParams *params, GstBuffer *buf);
+GstFlowReturn gst_binningfilter_crop_set_caps(Gstbinningfilter *filter, const BinningParams *params);
+void gst_binningfilter_crop_transform_caps(GstCaps *caps, GstPadDirection direction);
+GstBuffer *gst_binningfilter_crop_buffer(Gstbinningfilter *filter, GstBuffer *buf);
+GstBuffer *gst_binningfilter_crop_frame(Gstbinningfilter *filter, GstBuffer *buf);
+void gst_binningfilter_crop_reset(Gstbinningfilter *filter);
 
 G_END_DECLS
 
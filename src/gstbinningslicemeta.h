@@ -0,0 +1,85 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __GST_BINNING_SLICE_META_H__
+#define __GST_BINNING_SLICE_META_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+// Where a slice pushed in slice-height mode lies in its frame, rows y to y+height-1 of frame_height.
+// This header is all downstream needs, the API type is found by its name, so nothing of the plug-in is linked.
+#define GST_BINNING_SLICE_META_API_NAME "GstBinningSliceMetaAPI"
+
+typedef struct
+{
+  GstMeta meta;
+
+  guint y, height;
+  guint frame_height;
+  gboolean last;   // the slice ends the frame, it also has GST_BUFFER_FLAG_MARKER
+} GstBinningSliceMeta;
+
+// The API type of the meta, registered when the binningfilter plug-in is loaded, 0 before that
+static inline GType
+gst_binning_slice_meta_api_get_type (void)
+{
+  return g_type_from_name (GST_BINNING_SLICE_META_API_NAME);
+}
+
+#define GST_BINNING_SLICE_META_API_TYPE (gst_binning_slice_meta_api_get_type())
+
+// The slice meta of a buffer, NULL if it has none
+static inline GstBinningSliceMeta *
+gst_buffer_get_binning_slice_meta (GstBuffer *buffer)
+{
+  GType api = GST_BINNING_SLICE_META_API_TYPE;
+
+  return api ? (GstBinningSliceMeta *) gst_buffer_get_meta (buffer, api) : NULL;
+}
+
+G_END_DECLS
+
+#endif /* __GST_BINNING_SLICE_META_H__ */
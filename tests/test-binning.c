@@ -0,0 +1,703 @@
+/*
+ * Binning Filter GStreamer Plugin
+ * Copyright (C) 2015-2016 Gray Cancer Institute
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * Alternatively, the contents of this file may be used under the
+ * GNU Lesser General Public License Version 2.1 (the "LGPL"), in
+ * which case the following provisions apply instead of the ones
+ * mentioned above:
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+// Tests of the binning kernels of libbinning against a plain reference that sums every bin pixel by pixel.
+// Each kernel must give the reference, to within the rounding of the luts, on sizes that are not a whole number of bins,
+// and the bands of the worker pool and the tiles of incremental binning must give exactly the whole frame.
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binning-private.h"
+
+#define TILE 32   // as binning-incremental.c
+
+static const gint sizes[][2] = { {37, 29}, {8, 9}, {7, 7}, {33, 17}, {61, 45} };
+
+static const BinningBorder borders[] = { BINNING_BORDER_NONE, BINNING_BORDER_CLAMP, BINNING_BORDER_MIRROR, BINNING_BORDER_PARTIAL };
+
+// A frame of random pixels, stride a little more than the width
+static guint8 *
+random_frame (GRand *rand, gint width, gint height, gint *stride)
+{
+	gsize size, i;
+	guint8 *data;
+
+	*stride = width * 3 + 6;
+	size = (gsize)*stride * height;
+	data = g_malloc (size);
+	for (i = 0; i < size; i++)
+		data[i] = g_rand_int_range (rand, 0, 256);
+
+	return data;
+}
+
+// A copy of a frame, as g_memdup2() which is newer than the GLib of configure.ac
+static guint8 *
+copy_frame (const guint8 *data, gsize size)
+{
+	return memcpy (g_malloc (size), data, size);
+}
+
+// Some defects in the interior and some in the last columns, which a border repeats
+static BinningDefects *
+make_defects (gint width, gint height)
+{
+	BinningDefects *defects = g_new0 (BinningDefects, 1);
+	guint count = 0;
+	gint y;
+
+	defects->refcount = 1;
+	defects->height = height;
+	defects->row_start = g_new0 (guint, height + 1);
+	defects->x = g_new (guint32, 2 * height);
+	for (y = 0; y < height; y++){
+		defects->row_start[y] = count;
+		if (y % 5 == 3)
+			defects->x[count++] = (y * 13) % (width - 2);
+		if (y % 7 == 2)
+			defects->x[count++] = width - 1 - (y % 2);
+	}
+	defects->row_start[height] = count;
+	defects->count = count;
+
+	return defects;
+}
+
+static gboolean
+is_defect (const BinningDefects *defects, gint x, gint y)
+{
+	guint i;
+
+	if (!defects)
+		return FALSE;
+	for (i = defects->row_start[y]; i < defects->row_start[y+1]; i++)
+		if ((gint)defects->x[i] == x)
+			return TRUE;
+
+	return FALSE;
+}
+
+// The image position that i reads, past the end of size with a clamp or mirror border
+static gint
+border_index (BinningBorder border, gint i, gint size)
+{
+	if (i < size)
+		return i;
+	return border == BINNING_BORDER_MIRROR ? 2 * (size - 1) - i : size - 1;
+}
+
+static gint
+compare_bytes (gconstpointer a, gconstpointer b)
+{
+	return *(const guint8 *)a - *(const guint8 *)b;
+}
+
+// The robust estimate of the sorted linear values of a bin, as binning-robust.c describes it
+static gdouble
+robust_estimate (const BinningParams *params, const guint8 *v, gint m)
+{
+	const double *lin = params->forward_gamma;
+	gdouble median = m & 1 ? lin[v[m/2]] : 0.5 * (lin[v[m/2-1]] + lin[v[m/2]]);
+	gdouble low, high, limit, sum = 0.0;
+	gint i, kept = 0;
+
+	if (params->algorithm == BINNING_MEDIAN)
+		return median;
+
+	low = median - lin[v[m/4]];
+	high = lin[v[(3*m)/4]] - median;
+	limit = params->clip_sigma * MIN(low, high) / 0.6745;
+	for (i = 0; i < m; i++)
+		if (fabs (lin[v[i]] - median) <= limit){
+			sum += lin[v[i]];
+			kept++;
+		}
+
+	return kept ? sum / kept : median;
+}
+
+// Bin in with the params, pixel by pixel, into the top left of ref, which starts as a copy of in
+static void
+reference_bin (const BinningParams *params, const guint8 *in, gint width, gint height, gint stride, guint8 *ref,
+		gint *out_width, gint *out_height)
+{
+	gint s = params->binsize, n = s * s;
+	gint k = params->bin_stride > 0 ? params->bin_stride : (params->resize ? s : 1);
+	gint black[3] = { params->black_b, params->black_g, params->black_r };
+	gfloat gain[3] = { params->gain_b, params->gain_g, params->gain_r };
+	gboolean robust = params->algorithm == BINNING_MEDIAN || params->algorithm == BINNING_SIGMA_CLIP;
+	gboolean chroma = params->algorithm == BINNING_CHROMA && (s > 1 || params->border);
+	// resize sums the gamma encoded values, except where the stride engine does it, see binning_process_image()
+	gboolean encoded = !robust && !chroma && params->resize && params->bin_stride == 0 && !params->corrected;
+	// the rgb and resize kernels leave the image as it is when there is nothing to do
+	gboolean unchanged = s == 1 && !robust && !chroma && params->bin_stride == 0 && !params->corrected && !params->border &&
+			gain[0] == 1.0f && gain[1] == 1.0f && gain[2] == 1.0f && !black[0] && !black[1] && !black[2];
+	gint ox, oy, i, j, c, x, y, sx, sy, m;
+	guint8 values[3][49];
+
+	memcpy (ref, in, (gsize)stride * height);
+	if (s > width || s > height || unchanged){
+		*out_width = width;
+		*out_height = height;
+		return;
+	}
+	*out_width = params->border ? (width - 1) / k + 1 : (width - s) / k + 1;
+	*out_height = params->border ? (height - 1) / k + 1 : (height - s) / k + 1;
+
+	for (oy = 0; oy < *out_height; oy++)
+		for (ox = 0; ox < *out_width; ox++){
+			gdouble sum[3] = { 0.0, 0.0, 0.0 };
+			guint8 *out = ref + (gsize)oy * stride + ox * 3;
+
+			m = 0;
+			for (j = 0; j < s; j++)
+				for (i = 0; i < s; i++){
+					x = ox * k + i;
+					y = oy * k + j;
+					if (params->border == BINNING_BORDER_PARTIAL && (x >= width || y >= height))
+						continue;
+					sx = border_index (params->border, x, width);
+					sy = border_index (params->border, y, height);
+					if (!robust && is_defect (params->defects, sx, sy))   // the robust kernels do not need the map
+						continue;
+					for (c = 0; c < 3; c++){
+						gint p = in[(gsize)sy * stride + sx * 3 + c];
+						gint v = CLAMP(p - black[c], 0, IN_RANGE - 1);
+
+						if (encoded)
+							sum[c] += p;
+						else
+							sum[c] += (guint32) params->forward_gamma[v];   // the kernels keep whole linear values
+						values[c][m] = v;
+					}
+					m++;
+				}
+
+			for (c = 0; c < 3; c++){
+				gdouble w = m > 0 ? (gdouble)n / m : 0.0;   // for the pixels a partial border or the defects leave out
+
+				if (robust){
+					qsort (values[c], m, 1, compare_bytes);
+					out[c] = params->inverse_gamma[(guint)CLAMP(robust_estimate (params, values[c], m) * gain[c] * n, 0, OUT_RANGE - 1)];
+				}
+				else if (encoded)
+					out[c] = CLAMP((sum[c] * w - n * black[c]) * gain[c], 0, 255);
+				else{
+					gdouble v = sum[c];
+
+					if (chroma && c != 1)   // B = G + (B-G)*factor
+						v = MAX(sum[1] + floor ((sum[c] - sum[1]) * params->chroma_factor / 65536.0), 0.0);
+					out[c] = params->inverse_gamma[(guint)CLAMP(v * gain[c] * w, 0, OUT_RANGE - 1)];
+				}
+			}
+		}
+}
+
+// Number of samples of the binned images that differ by more than tolerance
+static gint
+count_differences (const guint8 *a, const guint8 *b, gint width, gint height, gint stride, gint tolerance, const gchar *what)
+{
+	gint x, y, bad = 0;
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width * 3; x++){
+			gint d = a[(gsize)y * stride + x] - b[(gsize)y * stride + x];
+
+			if (ABS(d) > tolerance){
+				if (!bad)
+					g_test_message ("%s: first difference at %d,%d (%d): %d and %d", what, x / 3, y, x % 3, a[(gsize)y * stride + x], b[(gsize)y * stride + x]);
+				bad++;
+			}
+		}
+
+	return bad;
+}
+
+// Bin a random frame in place with the settings, and compare it with the reference
+static void
+check_settings (GRand *rand, const BinningSettings *settings, gint width, gint height, gboolean defects)
+{
+	BinningParams *params = binning_params_new (settings);
+	gint stride, out_width, out_height, ref_width, ref_height;
+	guint8 *in = random_frame (rand, width, height, &stride);
+	guint8 *out = copy_frame (in, (gsize)stride * height);
+	guint8 *ref = g_malloc ((gsize)stride * height);
+	gchar *what;
+
+	if (defects){
+		params->defects = make_defects (width, height);
+		params->corrected = TRUE;
+	}
+
+	what = g_strdup_printf ("algorithm %d binsize %d bin-stride %d resize %d border %d %dx%d defects %d", settings->algorithm,
+			settings->binsize, settings->bin_stride, settings->resize, settings->border, width, height, defects);
+
+	reference_bin (params, in, width, height, stride, ref, &ref_width, &ref_height);
+	binning_output_size (params, width, height, &out_width, &out_height);
+	g_assert_cmpint (out_width, ==, ref_width);
+	g_assert_cmpint (out_height, ==, ref_height);
+
+	binning_process (params, out, out, width, height, stride, NULL);
+	g_assert_cmpint (count_differences (out, ref, out_width, out_height, stride, 1, what), ==, 0);
+
+	g_free (what);
+	g_free (in);
+	g_free (out);
+	g_free (ref);
+	binning_params_unref (params);
+}
+
+// Every binsize of one algorithm, sliding, every bin-stride and resize, on each size, with and without levels
+static void
+check_algorithm (BinningAlgorithm algorithm, BinningBorder border, gboolean defects)
+{
+	GRand *rand = g_rand_new_with_seed (algorithm * 16 + border * 2 + defects);
+	BinningSettings settings;
+	gint s, k, z, levels;
+
+	for (s = 1; s <= 7; s++)
+		for (k = -1; k <= s; k++)   // -1 for resize, 0 for sliding bins, then each bin-stride
+			for (z = 0; z < G_N_ELEMENTS (sizes); z++)
+				for (levels = 0; levels < 2; levels++){
+					binning_settings_init (&settings);
+					settings.algorithm = algorithm;
+					settings.binsize = s;
+					settings.resize = k < 0;
+					settings.bin_stride = MAX(k, 0);
+					settings.border = border;
+					settings.clip_sigma = 1.5;
+					if (levels){
+						settings.black_r = 12; settings.black_g = 3;
+						settings.contrast_g = -1; settings.contrast_b = 150;
+					}
+					check_settings (rand, &settings, sizes[z][0], sizes[z][1], defects);
+				}
+
+	g_rand_free (rand);
+}
+
+static void
+test_rgb (void)
+{
+	check_algorithm (BINNING_RGB, BINNING_BORDER_NONE, FALSE);
+}
+
+static void
+test_chroma (void)
+{
+	check_algorithm (BINNING_CHROMA, BINNING_BORDER_NONE, FALSE);
+}
+
+static void
+test_median (void)
+{
+	check_algorithm (BINNING_MEDIAN, BINNING_BORDER_NONE, FALSE);
+}
+
+static void
+test_sigma_clip (void)
+{
+	check_algorithm (BINNING_SIGMA_CLIP, BINNING_BORDER_NONE, FALSE);
+}
+
+static void
+test_border (void)
+{
+	gint b;
+
+	for (b = 1; b < G_N_ELEMENTS (borders); b++){
+		check_algorithm (BINNING_RGB, borders[b], FALSE);
+		check_algorithm (BINNING_CHROMA, borders[b], FALSE);
+		check_algorithm (BINNING_MEDIAN, borders[b], FALSE);
+		check_algorithm (BINNING_SIGMA_CLIP, borders[b], FALSE);
+	}
+}
+
+static void
+test_defects (void)
+{
+	gint b;
+
+	for (b = 0; b < G_N_ELEMENTS (borders); b++){
+		check_algorithm (BINNING_RGB, borders[b], TRUE);
+		check_algorithm (BINNING_CHROMA, borders[b], TRUE);
+	}
+}
+
+// A binsize out of range is clamped, and the averaging gain is that of the clamped binsize
+static void
+test_params (void)
+{
+	BinningSettings settings;
+	BinningParams *params;
+
+	binning_settings_init (&settings);
+	settings.contrast_g = -1;
+
+	settings.binsize = 9;
+	params = binning_params_new (&settings);
+	g_assert_cmpint (params->binsize, ==, 7);
+	g_assert (params->gain_g == 1.0f / 49);
+	binning_params_unref (params);
+
+	settings.binsize = 0;
+	params = binning_params_new (&settings);
+	g_assert_cmpint (params->binsize, ==, 1);
+	g_assert (params->gain_g == 1.0f);
+	binning_params_unref (params);
+}
+
+// The resize of a power of two binsize goes through the cascade of 2x2 halvings, on frames wider than its blocks
+static void
+test_cascade (void)
+{
+	GRand *rand = g_rand_new_with_seed (48);
+	BinningSettings settings;
+	gint s, b;
+
+	for (s = 2; s <= 4; s += 2)
+		for (b = 0; b < G_N_ELEMENTS (borders); b++){
+			binning_settings_init (&settings);
+			settings.binsize = s;
+			settings.resize = TRUE;
+			settings.border = borders[b];
+			check_settings (rand, &settings, 203, 67, FALSE);
+			check_settings (rand, &settings, 129, 33, FALSE);
+			settings.black_b = 7;
+			settings.contrast_r = -1;
+			check_settings (rand, &settings, 130, 34, FALSE);
+		}
+
+	g_rand_free (rand);
+}
+
+// Random samples of a gray format, packed into data and unpacked into samples, width x height of each.
+// GRAY10_LE32 has three samples to a word, the last word of a row partly used when the width is not a multiple of 3,
+// GRAY10_LE16 has random bits above the 10 of each sample, which must be masked off.
+static guint8 *
+random_gray_frame (GRand *rand, BinningFormat format, gint width, gint height, gint *stride, gint *samples)
+{
+	guint8 *data;
+	gint x, y, v;
+
+	if (format == BINNING_FORMAT_GRAY10_LE32)
+		*stride = (width + 2) / 3 * 4 + 4;
+	else
+		*stride = width * 2 + 4;
+	data = g_malloc0 ((gsize)*stride * height);
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++){
+			guint8 *line = data + (gsize)y * *stride;
+
+			if (format == BINNING_FORMAT_GRAY10_LE32){
+				guint32 *word = (guint32 *)line + x / 3;
+
+				v = g_rand_int_range (rand, 0, 1024);
+				*word = GUINT32_TO_LE(GUINT32_FROM_LE(*word) | (guint32)v << (10 * (x % 3)));
+			}
+			else{
+				guint16 word = g_rand_int_range (rand, 0, 65536);
+
+				((guint16 *)line)[x] = GUINT16_TO_LE(word);
+				v = format == BINNING_FORMAT_GRAY10_LE16 ? word & 0x3FF : word;
+			}
+			samples[y * width + x] = v;
+		}
+
+	return data;
+}
+
+// 16-bit linear luminance of packed gray samples, against the sums of the samples
+static void
+check_gray (GRand *rand, BinningFormat format)
+{
+	BinningSettings settings;
+	gint s, k, b, z;
+	gint bits = format == BINNING_FORMAT_GRAY16_LE ? 16 : 10;
+
+	for (s = 1; s <= 7; s++)
+		for (k = -1; k <= s; k++)
+			for (b = 0; b < G_N_ELEMENTS (borders); b++)
+				for (z = 0; z < G_N_ELEMENTS (sizes); z++){
+					gint width = sizes[z][0], height = sizes[z][1];
+					gint kk = k > 0 ? k : (k < 0 ? s : 1);
+					gint stride, out_stride = width * 2;
+					gint out_width, out_height, ox, oy, i, j, x, y, m, sample, bad = 0;
+					gint *samples = g_new (gint, width * height);
+					guint8 *in = random_gray_frame (rand, format, width, height, &stride, samples);
+					guint16 *out = g_malloc0 ((gsize)out_stride * height), *ref = g_malloc0 ((gsize)out_stride * height);
+					BinningParams *params;
+					guint32 sum;
+					gfloat gain, v;
+
+					binning_settings_init (&settings);
+					settings.format = format;
+					settings.output = BINNING_OUTPUT_GRAY16;
+					settings.binsize = s;
+					settings.resize = k < 0;
+					settings.bin_stride = MAX(k, 0);
+					settings.border = borders[b];
+					settings.black_g = 2;
+					params = binning_params_new (&settings);
+					gain = params->gain_g * (OUT_RANGE - 1) / ((1 << bits) - 1);
+
+					binning_process_linear (params, in, width, height, stride, (guint8 *)out, out_stride, NULL);
+
+					binning_output_size (params, width, height, &out_width, &out_height);
+					if (s > width || s > height)   // nothing is written
+						out_width = out_height = 0;
+					for (oy = 0; oy < out_height; oy++)
+						for (ox = 0; ox < out_width; ox++){
+							sum = 0;
+							m = 0;
+							for (j = 0; j < s; j++)
+								for (i = 0; i < s; i++){
+									x = ox * kk + i;
+									y = oy * kk + j;
+									if (settings.border == BINNING_BORDER_PARTIAL && (x >= width || y >= height))
+										continue;
+									sample = samples[border_index (settings.border, y, height) * width + border_index (settings.border, x, width)]
+											- (params->black_g << (bits - 8));
+									sum += MAX(sample, 0);
+									m++;
+								}
+							v = sum * gain * s * s / m;
+							binning_store_linear (params, ref + (gsize)oy * out_stride / 2 + ox, v, v, v, NULL);
+						}
+
+					for (i = 0; i < out_stride * height / 2; i++)
+						if (ABS((gint)out[i] - (gint)ref[i]) > 2){
+							if (!bad)
+								g_test_message ("gray format %d binsize %d bin-stride %d resize %d border %d %dx%d: %d and %d at %d",
+										format, s, settings.bin_stride, settings.resize, settings.border, width, height, out[i], ref[i], i);
+							bad++;
+						}
+					g_assert_cmpint (bad, ==, 0);
+
+					binning_params_unref (params);
+					g_free (samples);
+					g_free (in);
+					g_free (out);
+					g_free (ref);
+				}
+}
+
+static void
+test_gray (void)
+{
+	GRand *rand = g_rand_new_with_seed (43);
+
+	check_gray (rand, BINNING_FORMAT_GRAY10_LE32);
+	check_gray (rand, BINNING_FORMAT_GRAY10_LE16);
+	check_gray (rand, BINNING_FORMAT_GRAY16_LE);
+
+	g_rand_free (rand);
+}
+
+// Frames tall enough for several bands, binned whole, in bands on the pool, and in slices of rows down the frame,
+// must be the same, statistics included
+static void
+test_bands (void)
+{
+	GRand *rand = g_rand_new_with_seed (40);
+	BinningAlgorithm algorithms[] = { BINNING_RGB, BINNING_CHROMA, BINNING_MEDIAN, BINNING_SIGMA_CLIP };
+	BinningSettings settings;
+	gint a, s, k, b, slice;
+
+	for (a = 0; a < G_N_ELEMENTS (algorithms); a++)
+		for (s = 1; s <= 7; s++)
+			for (k = -1; k <= s; k += 2)
+				for (b = 0; b < G_N_ELEMENTS (borders); b++){
+					gint width = 97, height = 150 + s, stride, out_width, out_height, row, y;
+					guint8 *whole = random_frame (rand, width, height, &stride);
+					gsize size = (gsize)stride * height;
+					guint8 *bands = copy_frame (whole, size), *slices = copy_frame (whole, size);
+					BinningStats stats_whole, stats_bands;
+					BinningImage image = { slices, width, height, stride, NULL, 0, 0, NULL, 0, 0, 0 };
+					BinningParams *params;
+
+					binning_settings_init (&settings);
+					settings.algorithm = algorithms[a];
+					settings.binsize = s;
+					settings.resize = k < 0;
+					settings.bin_stride = MAX(k, 0);
+					settings.border = borders[b];
+					settings.black_g = 5;
+					params = binning_params_new (&settings);
+
+					memset (&stats_whole, 0, sizeof (stats_whole));
+					memset (&stats_bands, 0, sizeof (stats_bands));
+					binning_process (params, whole, whole, width, height, stride, &stats_whole);
+					binning_process_parallel (params, bands, bands, width, height, stride, &stats_bands);
+					g_assert (memcmp (whole, bands, size) == 0);
+					g_assert (memcmp (&stats_whole, &stats_bands, sizeof (BinningStats)) == 0);
+
+					binning_output_size (params, width, height, &out_width, &out_height);
+					slice = 1 + g_rand_int_range (rand, 0, 40);
+					for (row = 0; row < out_height; )
+						row = binning_process_image_rows (params, &image, row, row + slice);
+					for (y = 0; y < out_height; y++)
+						g_assert (memcmp (whole + (gsize)y * stride, slices + (gsize)y * stride, out_width * 3) == 0);
+
+					binning_params_unref (params);
+					g_free (whole);
+					g_free (bands);
+					g_free (slices);
+				}
+
+	g_rand_free (rand);
+}
+
+// The input rows and columns that output tiles first to end-1 gather from, as binning-incremental.c
+static void
+footprint (gint s, gint k, gint first, gint end, gint size, gint *in_first, gint *in_end)
+{
+	*in_first = first * k;
+	*in_end = MIN((end - 1) * k + s, size);
+}
+
+// Incremental binning bins tiles of the output from a copy of their footprint, with the frame stride and their place
+// in the frame, so the calibration and defects line up. Every tile must be the same as that part of the whole frame.
+static void
+test_tiles (void)
+{
+	GRand *rand = g_rand_new_with_seed (32);
+	BinningAlgorithm algorithms[] = { BINNING_RGB, BINNING_CHROMA, BINNING_MEDIAN, BINNING_SIGMA_CLIP };
+	BinningSettings settings;
+	gint a, s, k, d;
+
+	for (a = 0; a < G_N_ELEMENTS (algorithms); a++)
+		for (s = 1; s <= 7; s++)
+			for (k = -1; k <= s; k++)
+				for (d = 0; d < 2; d++){
+					gint width = 101, height = 77, stride, out_width, out_height, tx, ty, r;
+					gint kk = k > 0 ? k : (k < 0 ? s : 1);
+					guint8 *whole = random_frame (rand, width, height, &stride);
+					gsize size = (gsize)stride * height;
+					guint8 *frame = copy_frame (whole, size), *tiles = g_malloc0 (size), *scratch = g_malloc (size);
+					BinningParams *params;
+
+					binning_settings_init (&settings);
+					settings.algorithm = algorithms[a];
+					settings.binsize = s;
+					settings.resize = k < 0;
+					settings.bin_stride = MAX(k, 0);
+					settings.black_r = 9;
+					params = binning_params_new (&settings);
+					if (d){
+						params->defects = make_defects (width, height);
+						params->corrected = TRUE;
+					}
+
+					binning_process (params, whole, whole, width, height, stride, NULL);
+
+					binning_output_size (params, width, height, &out_width, &out_height);
+					for (ty = 0; ty < out_height; ty += TILE)
+						for (tx = 0; tx < out_width; tx += TILE){
+							gint tw = MIN(TILE, out_width - tx), th = MIN(TILE, out_height - ty);
+							gint x0, x1, y0, y1;
+							BinningImage part;
+
+							footprint (s, kk, tx, tx + tw, width, &x0, &x1);
+							footprint (s, kk, ty, ty + th, height, &y0, &y1);
+							for (r = y0; r < y1; r++)
+								memcpy (scratch + (gsize)(r - y0) * stride, frame + (gsize)r * stride + x0 * 3, (x1 - x0) * 3);
+
+							part.data = scratch;
+							part.width = x1 - x0;
+							part.height = y1 - y0;
+							part.stride = stride;
+							part.stats = NULL;
+							part.top = y0;
+							part.left = x0;
+							part.out = NULL;
+							part.frame_width = width;
+							part.frame_height = height;
+							binning_process_image (params, &part);
+
+							for (r = 0; r < th; r++)
+								memcpy (tiles + (gsize)(ty + r) * stride + tx * 3, scratch + (gsize)r * stride, tw * 3);
+						}
+
+					g_assert_cmpint (count_differences (whole, tiles, out_width, out_height, stride, 0, "tiles"), ==, 0);
+
+					binning_params_unref (params);
+					g_free (whole);
+					g_free (frame);
+					g_free (tiles);
+					g_free (scratch);
+				}
+
+	g_rand_free (rand);
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_test_init (&argc, &argv, NULL);
+
+	binning_pool_configure (4, NULL);   // so that the frames of test_bands are split into bands
+
+	g_test_add_func ("/binning/params", test_params);
+	g_test_add_func ("/binning/rgb", test_rgb);
+	g_test_add_func ("/binning/chroma", test_chroma);
+	g_test_add_func ("/binning/median", test_median);
+	g_test_add_func ("/binning/sigma-clip", test_sigma_clip);
+	g_test_add_func ("/binning/border", test_border);
+	g_test_add_func ("/binning/defects", test_defects);
+	g_test_add_func ("/binning/cascade", test_cascade);
+	g_test_add_func ("/binning/gray", test_gray);
+	g_test_add_func ("/binning/pool/bands", test_bands);
+	g_test_add_func ("/binning/incremental/tiles", test_tiles);
+
+	return g_test_run ();
+}